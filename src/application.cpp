@@ -1,6 +1,6 @@
 #include "application.h"
 
-Application::Application(std::string title, uint32_t width, uint32_t height)
+Application::Application(std::string title, uint32_t width, uint32_t height, bool headless)
     : m_Title(title)
     , m_ViewportWidth(width)
     , m_ViewportHeight(height)
@@ -15,9 +15,18 @@ Application::Application(std::string title, uint32_t width, uint32_t height)
     , m_QuadVAO(0)
     , m_QuadVBO(0)
 {   
-    m_Window   = std::make_unique<Window>(m_Title.c_str(), m_ViewportWidth, m_ViewportHeight);
+    m_Window   = std::make_unique<Window>(m_Title.c_str(), m_ViewportWidth, m_ViewportHeight, headless);
     m_Scene    = std::make_unique<Scene>();
     m_Renderer = std::make_unique<Renderer>(m_ViewportWidth, m_ViewportHeight, &(*m_Scene));
+
+    // Configure app settings
+    m_Settings.tonemap = TONY_MCMAPFACE;
+    m_Settings.enableBlueNoise = true;
+    m_Settings.enableBVH = false;
+    m_Settings.enableCrosshair = false;
+    m_Settings.enableDebugBVHVisualisation = false;
+    m_Settings.enableVsync = false;
+    m_Settings.enableGui = true;
 }
 
 Application::~Application()
@@ -34,16 +43,6 @@ Application::~Application()
 void Application::Run()
 {
     Setup();
-
-    // Configure app settings
-    m_Settings.tonemap = TONY_MCMAPFACE;
-    m_Settings.enableBlueNoise = true;
-    m_Settings.enableBVH = false;
-    m_Settings.enableCrosshair = false;
-    m_Settings.enableDebugBVHVisualisation = false;
-    m_Settings.enableVsync = false;
-    m_Settings.enableGui = true;
-
     GetEnvMaps();
 
     // Initialise ImGui
@@ -90,6 +89,7 @@ void Application::Run()
             t += dt;
         }
 
+        WatchShaders();
         Render();
 
         m_Window->Update();
@@ -101,24 +101,106 @@ void Application::Run()
     ImGui::DestroyContext();
 }
 
-void Application::Render()
+// Newest modification time of any file in the shader tree
+static std::filesystem::file_time_type LastShaderWrite()
 {
-    if (!m_Renderer->hasPaused)
+    std::filesystem::file_time_type latest = std::filesystem::file_time_type::min();
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(PATH_TO_SHADERS, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
     {
-        using namespace glm;
-        float phi = radians(m_Scene->sunElevation);
-        float theta = radians(m_Scene->sunAzimuth);
-        float x = sin(theta) * cos(phi);
-        float y = sin(phi);
-        float z = cos(theta) * cos(phi);
-        m_Scene->Data.SunDirection = vec3(x,y,z);
-        m_Scene->Data.Depth = m_Scene->maxRayDepth;
-        m_Scene->Data.SelectedPrimIdx = m_Scene->PrimitiveIdx;
-        m_Scene->Data.Day = (int) m_Scene->day;
-        m_Scene->Data.SunColour = m_Scene->sunColour;
-
-        m_Renderer->Render(m_QuadVAO, m_Settings);
+        std::filesystem::file_time_type time = it->last_write_time(error);
+        if (!error && time > latest)
+            latest = time;
     }
+    return latest;
+}
+
+void Application::WatchShaders()
+{
+    // Walking the tree every frame would be wasteful, a save shows up within a quarter second
+    double now = glfwGetTime();
+    if (now - m_LastShaderCheck < 0.25)
+        return;
+    m_LastShaderCheck = now;
+
+    std::filesystem::file_time_type latest = LastShaderWrite();
+    if (latest > m_ShaderWriteTime)
+    {
+        // The first check only records the state of the tree
+        if (m_ShaderWriteTime != std::filesystem::file_time_type::min())
+            m_Renderer->ReloadShaders();
+        m_ShaderWriteTime = latest;
+    }
+}
+
+bool Application::RunHeadless(const std::string& outputPath, uint32_t frames)
+{
+    Setup();
+    Resize();
+    m_Scene->Eye->UpdateParams();
+
+    double start = glfwGetTime();
+    double frameTime = 0.0;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        // Timer queries miss compute dispatches on some drivers (llvmpipe among them), so frames
+        // are timed on the wall clock once the GPU has finished them, the same for both backends
+        double frameStart = glfwGetTime();
+        RenderFrame();
+        glFinish();
+        // The first frame is a warm-up that is left out
+        if (i >= 1)
+            frameTime += glfwGetTime() - frameStart;
+    }
+    std::vector<uint8_t> pixels = m_Renderer->ReadViewportPixels();
+    double elapsed = glfwGetTime() - start;
+
+    const char* backends[] = { "fragment", "wavefront" };
+    std::cout << "Rendered " << frames << " frames at " << m_ViewportWidth << " x " << m_ViewportHeight
+        << " with the " << backends[m_Settings.backend] << " backend in " << elapsed << " s" << std::endl;
+    if (frames > 1)
+        std::cout << "Frame time: " << 1000.0 * frameTime / (frames - 1) << " ms/frame (wall clock)" << std::endl;
+
+    unsigned error = lodepng::encode(outputPath, pixels, m_ViewportWidth, m_ViewportHeight);
+    if (error)
+    {
+        std::cout << "Failed to write " << outputPath << ": " << lodepng_error_text(error) << std::endl;
+        return false;
+    }
+    std::cout << "Saved " << outputPath << std::endl;
+    return true;
+}
+
+void Application::RenderFrame()
+{
+    using namespace glm;
+    float phi = radians(m_Scene->sunElevation);
+    float theta = radians(m_Scene->sunAzimuth);
+    float x = sin(theta) * cos(phi);
+    float y = sin(phi);
+    float z = cos(theta) * cos(phi);
+    m_Scene->Data.SunDirection = vec3(x,y,z);
+    m_Scene->Data.Depth = m_Scene->maxRayDepth;
+    m_Scene->Data.SelectedPrimIdx = m_Scene->PrimitiveIdx;
+    m_Scene->Data.Day = (int) m_Scene->day;
+    m_Scene->Data.SunColour = m_Scene->sunColour;
+
+    if (!m_Renderer->m_BVH->SupportsLayout(m_Settings.bvhLayout))
+    {
+        std::cout << "\033[1;31m[ERROR]\033[0;37m The scene has too many primitive references for the selected BVH layout, "
+            << "falling back to the binary layout" << std::endl;
+        m_Settings.bvhLayout = BVH_LAYOUT_BINARY;
+        m_Renderer->ResetSamples();
+    }
+
+    m_Renderer->Render(m_QuadVAO, m_Settings);
+}
+
+void Application::Render()
+{
+    if (!m_Renderer->hasPaused)
+        RenderFrame();
 
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, {0.0f, 0.0f});
     ImGui::Begin("Viewport", 0, ImGuiWindowFlags_NoTitleBar);
@@ -222,8 +304,21 @@ void Application::RenderUI()
         ImGui::Text("Render time: %.3f ms/frame", 1000.0f / ImGui::GetIO().Framerate);
         ImGui::Text("Framerate: %.1f FPS", ImGui::GetIO().Framerate);
         ImGui::Text("Iterations: %i", m_Renderer->GetIterations());
+        ImGui::Text("Path trace: %.3f ms (GPU)", m_Renderer->GetPathTraceTime());
+        ImGui::Text("Output: %.3f ms (GPU)", m_Renderer->GetOutputTime());
+        ImGui::Text("Fence waits: %u", m_Renderer->GetFenceWaits());
         ImGui::Checkbox("Pause", &m_Renderer->hasPaused);
 
+        ImGui::Text("Backend");
+        int backend = m_Settings.backend;
+        if (ImGui::Combo("##Backend", &backend, "Fragment\0Wavefront (Compute)\0") && m_Renderer->SupportsBackend(backend))
+        {
+            m_Settings.backend = backend;
+            m_Renderer->ResetSamples();
+        }
+        if (!m_Renderer->SupportsBackend(BACKEND_WAVEFRONT))
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "Wavefront needs more storage blocks than the driver offers");
+
         if (ImGui::CollapsingHeader("Application Settings"))
         {
             ImGui::Text("Tonemap");
@@ -252,6 +347,137 @@ void Application::RenderUI()
                 ImGui::Checkbox("Draw BVH", &m_Renderer->shouldDrawBVH);
                 ImGui::Text("BVH Depth");
                 ImGui::SliderInt("##BVH-Depth", &m_Renderer->BVHDepth, 0, 10);
+
+                if (ImGui::Checkbox("Use Instancing (TLAS/BLAS)", &m_Settings.enableInstancing))
+                    m_Renderer->ResetSamples();
+                if (m_Settings.enableInstancing)
+                {
+                    const TLAS& tlas = *m_Renderer->m_TLAS;
+                    ImGui::Text("Instances: %i, Geometries: %i", (int) tlas.instances.size(), (int) tlas.geometries.size());
+                    ImGui::Text("TLAS Builds: %i, BLAS Builds: %i", tlas.tlasBuilds, tlas.blasBuilds);
+                }
+
+                ImGui::Text("BVH Layout");
+                int layout = m_Settings.bvhLayout;
+                if (ImGui::Combo("##BVH-Layout", &layout, "Binary\0BVH4\0Quantized\0Stackless\0") && m_Renderer->m_BVH->SupportsLayout(layout))
+                {
+                    m_Settings.bvhLayout = layout;
+                    m_Renderer->ResetSamples();
+                }
+                if (!m_Renderer->m_BVH->SupportsLayout(BVH_LAYOUT_STACKLESS))
+                    ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "Stackless cannot address this many primitives");
+
+                BVHBuildSettings& buildSettings = m_Renderer->m_BVH->settings;
+                bool rebuild = false;
+                ImGui::Text("BVH Split Method");
+                rebuild |= ImGui::Combo("##BVH-Split", (int*)&buildSettings.splitMethod, "Equal Counts\0SAH\0LBVH\0HLBVH\0SBVH\0");
+                ImGui::Text("Max Primitives Per Leaf");
+                rebuild |= ImGui::SliderInt("##BVH-MaxPrims", &buildSettings.maxPrimsInNode, 1, 8);
+                if (buildSettings.splitMethod == SPLIT_SAH || buildSettings.splitMethod == SPLIT_HLBVH || buildSettings.splitMethod == SPLIT_SBVH)
+                {
+                    ImGui::Text("SAH Buckets");
+                    rebuild |= ImGui::SliderInt("##BVH-Buckets", &buildSettings.nBuckets, 2, 64);
+                    ImGui::Text("Traversal Cost");
+                    rebuild |= ImGui::SliderFloat("##BVH-TraversalCost", &buildSettings.traversalCost, 0.01f, 4.0f);
+                    ImGui::Text("Intersection Cost");
+                    rebuild |= ImGui::SliderFloat("##BVH-IntersectionCost", &buildSettings.intersectionCost, 0.01f, 4.0f);
+                }
+                if (buildSettings.splitMethod == SPLIT_SBVH)
+                {
+                    ImGui::Text("Spatial Split Budget");
+                    rebuild |= ImGui::SliderFloat("##BVH-SplitBudget", &buildSettings.spatialSplitBudget, 0.0f, 1.0f);
+                }
+                ImGui::Text("Node Order");
+                rebuild |= ImGui::Combo("##BVH-NodeOrder", (int*)&buildSettings.nodeOrder, "Depth First\0Treelets\0");
+                if (rebuild)
+                {
+                    m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                    m_Renderer->ResetSamples();
+                }
+
+                if (ImGui::Button("Measure Cache Misses"))
+                {
+                    // Flatten the same tree in both orders and trace the same rays through each
+                    node_order_t nodeOrder = buildSettings.nodeOrder;
+                    for (int order = ORDER_DEPTH_FIRST; order <= ORDER_TREELET; order++)
+                    {
+                        buildSettings.nodeOrder = (node_order_t) order;
+                        m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                        m_CacheStats[order] = m_Renderer->m_BVH->MeasureCacheMisses(10000);
+                    }
+                    buildSettings.nodeOrder = nodeOrder;
+                    m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                    m_HasCacheStats = true;
+                }
+                if (m_HasCacheStats)
+                {
+                    const char* names[] = { "Depth First", "Treelets" };
+                    for (int order = ORDER_DEPTH_FIRST; order <= ORDER_TREELET; order++)
+                        ImGui::Text("%s: %.1f nodes, %.1f misses per ray (%.2f ms)", names[order],
+                            m_CacheStats[order].nodeFetchesPerRay, m_CacheStats[order].cacheMissesPerRay, m_CacheStats[order].milliseconds);
+                }
+                ImGui::Text("SAH Cost: %.3f", m_Renderer->m_BVH->sahCost);
+                ImGui::Text("BVH Nodes: %i", m_Renderer->m_BVH->liveNodes);
+                if (m_Renderer->m_BVH->spatialSplits > 0)
+                    ImGui::Text("Split References: %i", m_Renderer->m_BVH->spatialSplits);
+
+                // Size of the layout currently being traversed, for comparing against the binary one
+                const BVH& bvh = *m_Renderer->m_BVH;
+                size_t nodeSize = sizeof(LinearBVH_Node);
+                size_t nodeCount = bvh.totalNodes;
+                if (bvh.GetLayout() == BVH_LAYOUT_BVH4)
+                {
+                    nodeSize = sizeof(LinearBVH4_Node);
+                    nodeCount = bvh.flatBVH4.size();
+                }
+                else if (bvh.GetLayout() == BVH_LAYOUT_QUANTIZED)
+                {
+                    nodeSize = sizeof(LinearQuantizedBVH_Node);
+                    nodeCount = bvh.flatQuantized.size();
+                }
+                else if (bvh.GetLayout() == BVH_LAYOUT_STACKLESS)
+                {
+                    nodeSize = sizeof(LinearStacklessBVH_Node);
+                    nodeCount = bvh.flatStackless.size();
+                }
+                ImGui::Text("Layout Nodes: %i x %i B", (int) nodeCount, (int) nodeSize);
+                ImGui::Text("Layout Memory: %.2f KB", float(nodeCount * nodeSize) / 1024.0f);
+
+                if (ImGui::TreeNode("BVH Statistics"))
+                {
+                    bool recompute = ImGui::Button("Recompute Statistics");
+                    if (recompute || !m_HasBVHStats || m_BVHStatsRevision != bvh.revision)
+                    {
+                        m_BVHStats = bvh.ComputeStats();
+                        m_BVHStatsRevision = bvh.revision;
+                        m_HasBVHStats = true;
+                        m_BVHDepthHistogram.assign(m_BVHStats.depthHistogram.begin(), m_BVHStats.depthHistogram.end());
+                        m_BVHLeafSizeHistogram.assign(m_BVHStats.leafSizeHistogram.begin(), m_BVHStats.leafSizeHistogram.end());
+                    }
+                    const BVHStats& stats = m_BVHStats;
+                    const std::vector<float>& depths = m_BVHDepthHistogram;
+                    const std::vector<float>& sizes = m_BVHLeafSizeHistogram;
+                    ImGui::Text("Leaves: %i, Max Depth: %i, Average Leaf Depth: %.2f", stats.leafCount, stats.maxDepth, stats.averageLeafDepth);
+                    ImGui::PlotHistogram("Leaf Depths", depths.data(), (int) depths.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+                    ImGui::PlotHistogram("Leaf Sizes", sizes.data(), (int) sizes.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+                    ImGui::Text("Sibling Overlap: %.3f total, %.4f average", stats.totalOverlap, stats.averageOverlap);
+                    ImGui::Text("Memory: tree %.2f KB, GPU %.2f KB, layouts %.2f KB",
+                        float(stats.treeBytes) / 1024.0f, float(stats.flatBytes) / 1024.0f, float(stats.layoutBytes) / 1024.0f);
+                    if (stats.loadedFromCache)
+                        ImGui::Text("Loaded from cache in %.2f ms", stats.buildTimes.total);
+                    else
+                        ImGui::Text("Build: %.2f ms (bounds %.2f, topology %.2f, flatten %.2f, layouts %.2f)", stats.buildTimes.total,
+                            stats.buildTimes.bounds, stats.buildTimes.topology, stats.buildTimes.flatten, stats.buildTimes.layouts);
+
+                    if (ImGui::Button("Dump Statistics (JSON)"))
+                    {
+                        std::string path = PROJECT_PATH + "bvh_stats.json";
+                        std::ofstream file(path);
+                        file << stats.ToJSON();
+                        std::cout << (file ? "BVH statistics written to " : "Failed to write BVH statistics to ") << path << std::endl;
+                    }
+                    ImGui::TreePop();
+                }
             }
             else
             {
@@ -320,6 +546,7 @@ void Application::RenderUI()
         if (ImGui::Button("Clear Scene"))
         {
             m_Scene->EmptyScene();
+            m_Renderer->m_BVH->Clear();
             m_Renderer->ResetSamples();
         }
 
@@ -327,7 +554,7 @@ void Application::RenderUI()
         if (ImGui::Combo("##SceneSelection", &m_Scene->SceneIdx, "Room with window\0Cornell Box\0White room with coloured lights\0")) 
         {
             m_Scene->SelectScene();
-            m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+            m_Renderer->m_BVH->LoadOrBuild(m_Scene->primitives, PATH_TO_BVH_CACHE);
             m_Renderer->ResetSamples();
         }
 
@@ -335,12 +562,7 @@ void Application::RenderUI()
             m_Renderer->ResetSamples();
         
         if (ImGui::Button("Reload Shader"))
-        {
-            std::cout << "Reloading Shader..." << std::endl;
-            m_Renderer->GetShader().ReloadShader();
-            std::cout << "Shader Successfully Reloaded" << std::endl;
-            m_Renderer->ResetSamples();
-        }
+            m_Renderer->ReloadShaders();
 
         ImGui::Text("SPP");
         if (ImGui::SliderInt("##SPP", &m_Scene->samplesPerPixel, 1, 10)) 
@@ -373,7 +595,7 @@ void Application::RenderUI()
             {
                 m_Scene->AddDefaultSphere();
                 m_Scene->AddLight(m_Scene->primitives.size() - 1, glm::vec3(1.0f));
-                m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                m_Renderer->m_BVH->Insert(m_Scene->primitives, int(m_Scene->primitives.size() - 1));
                 m_Renderer->ResetSamples();
             }
             ImGui::SameLine();
@@ -381,7 +603,7 @@ void Application::RenderUI()
             {
                 m_Scene->AddDefaultCube();
                 m_Scene->AddLight(m_Scene->primitives.size() - 1, glm::vec3(1.0f));
-                m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                m_Renderer->m_BVH->Insert(m_Scene->primitives, int(m_Scene->primitives.size() - 1));
                 m_Renderer->ResetSamples();
             }
 
@@ -412,7 +634,8 @@ void Application::RenderUI()
             
             if (m_Scene->lights.size() > 0)
             {
-                Primitive& prim = m_Scene->primitives[m_Scene->lights[m_Scene->LightIdx].id];
+                int primIdx = m_Scene->lights[m_Scene->LightIdx].id;
+                Primitive& prim = m_Scene->primitives[primIdx];
 
                 prim.type == 0 ? ImGui::Text("Type: Sphere") : ImGui::Text("Type: AABB");
                 ImGui::Text("Primitive Index: %i", m_Scene->lights[m_Scene->LightIdx].id);
@@ -422,7 +645,8 @@ void Application::RenderUI()
                 if (ImGui::DragFloat3("##LightPos", glm::value_ptr(prim.position), 0.1f))
                 {
                     m_Renderer->ResetSamples();
-                    m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                    m_Scene->dirtyPrimitives.Add(primIdx);
+                    m_Renderer->m_BVH->Refit(m_Scene->primitives);
                 }
 
                 switch (prim.type)
@@ -432,7 +656,8 @@ void Application::RenderUI()
                         if (ImGui::DragFloat("##LightRadius", &prim.radius, 0.05f, 0.1f, 1000.0f)) 
                         {
                             m_Renderer->ResetSamples();
-                            m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                            m_Scene->dirtyPrimitives.Add(primIdx);
+                            m_Renderer->m_BVH->Refit(m_Scene->primitives);
                         }
                         break;
                     case PRIM_AABB: // AABB
@@ -440,18 +665,25 @@ void Application::RenderUI()
                         if (ImGui::DragFloat3("##LightDims", glm::value_ptr(prim.dimensions), 0.1f, 0.1f, 1000.0f)) 
                         {
                             m_Renderer->ResetSamples();
-                            m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                            m_Scene->dirtyPrimitives.Add(primIdx);
+                            m_Renderer->m_BVH->Refit(m_Scene->primitives);
                         }
                         break;
                 }
 
                 ImGui::Text("Emissive");
                 if (ImGui::ColorEdit3("##Emissive", glm::value_ptr(prim.mat.emissive)))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(primIdx);
+                }
 
                 ImGui::Text("Intensity");
-                if (ImGui::DragFloat("##intensity", &prim.mat.intensity, 0.005f, 0.0f, 100.0f)) 
+                if (ImGui::DragFloat("##intensity", &prim.mat.intensity, 0.005f, 0.0f, 100.0f))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(primIdx);
+                }
             }
             else
             {
@@ -464,7 +696,7 @@ void Application::RenderUI()
             if (ImGui::Button("Add Sphere"))
             {
                 m_Scene->AddDefaultSphere();
-                m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                m_Renderer->m_BVH->Insert(m_Scene->primitives, int(m_Scene->primitives.size() - 1));
                 m_Renderer->ResetSamples();
                 m_Scene->PrimitiveIdx = m_Scene->primitives.size() - 1;
             }
@@ -472,10 +704,17 @@ void Application::RenderUI()
             if (ImGui::Button("Add Cube"))
             {
                 m_Scene->AddDefaultCube();
-                m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                m_Renderer->m_BVH->Insert(m_Scene->primitives, int(m_Scene->primitives.size() - 1));
                 m_Renderer->ResetSamples();
                 m_Scene->PrimitiveIdx = m_Scene->primitives.size() - 1;
             }
+            ImGui::SameLine();
+            if (ImGui::Button("Remove") && m_Scene->primitives.size() > 0)
+            {
+                m_Renderer->m_BVH->Remove(m_Scene->primitives, m_Scene->PrimitiveIdx);
+                m_Scene->RemovePrimitive(m_Scene->PrimitiveIdx);
+                m_Renderer->ResetSamples();
+            }
 
             if (ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_LeftArrow))) 
                 m_Scene->PrimitiveIdx = int(m_Scene->PrimitiveIdx == 0 ? m_Scene->primitives.size() - 1 : m_Scene->PrimitiveIdx - 1);
@@ -495,7 +734,8 @@ void Application::RenderUI()
                 if (ImGui::DragFloat3("##Position", glm::value_ptr(prim.position), 0.1f))
                 {
                     m_Renderer->ResetSamples();
-                    m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                    m_Renderer->m_BVH->Refit(m_Scene->primitives);
                 }
 
                 ImGui::Text("Rotation");
@@ -503,7 +743,8 @@ void Application::RenderUI()
                 {
                     prim.UpdateRotation();
                     m_Renderer->ResetSamples();
-                    m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                    m_Renderer->m_BVH->Refit(m_Scene->primitives);
                 }
 
                 switch (prim.type)
@@ -513,7 +754,8 @@ void Application::RenderUI()
                         if (ImGui::DragFloat("##Radius", &prim.radius, 0.05f, 0.1f, 1000.0f)) 
                         {
                             m_Renderer->ResetSamples();
-                            m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                            m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                            m_Renderer->m_BVH->Refit(m_Scene->primitives);
                         }
                         break;
                     case PRIM_AABB: // AABB
@@ -521,34 +763,53 @@ void Application::RenderUI()
                         if (ImGui::DragFloat3("##Dimensions", glm::value_ptr(prim.dimensions), 0.1f, 0.1f, 1000.0f)) 
                         {
                             m_Renderer->ResetSamples();
-                            m_Renderer->m_BVH->RebuildBVH(m_Scene->primitives);
+                            m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                            m_Renderer->m_BVH->Refit(m_Scene->primitives);
                         }
                         break;
                 }
 
                 ImGui::Text("Albedo");
-                if (ImGui::ColorEdit3("##Albedo", glm::value_ptr(prim.mat.albedo))) 
+                if (ImGui::ColorEdit3("##Albedo", glm::value_ptr(prim.mat.albedo)))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
 
                 ImGui::Text("Absorption");
                 if (ImGui::ColorEdit3("##Absorption", glm::value_ptr(prim.mat.absorption)))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
 
                 ImGui::Text("Roughness");
-                if (ImGui::SliderFloat("##roughness", &prim.mat.roughness, 0.0f, 1.0f)) 
+                if (ImGui::SliderFloat("##roughness", &prim.mat.roughness, 0.0f, 1.0f))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
 
                 ImGui::Text("Metallic");
-                if (ImGui::SliderFloat("##metallic", &prim.mat.metallic, 0.0f, 1.0f)) 
+                if (ImGui::SliderFloat("##metallic", &prim.mat.metallic, 0.0f, 1.0f))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
 
                 ImGui::Text("Transmission");
                 if (ImGui::SliderFloat("##transmission", &prim.mat.transmission, 0.0f, 1.0f))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
 
                 ImGui::Text("IOR");
                 if (ImGui::SliderFloat("##ior", &prim.mat.ior, 1.0f, 2.5f))
+                {
                     m_Renderer->ResetSamples();
+                    m_Scene->dirtyPrimitives.Add(m_Scene->PrimitiveIdx);
+                }
             }
             else
             {
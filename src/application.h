@@ -2,6 +2,7 @@
 
 #include <string>
 #include <filesystem>
+#include <fstream>
 
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_glfw.h"
@@ -18,9 +19,12 @@
 class Application
 {
 public:
-    Application(std::string title, uint32_t width, uint32_t height);
+    Application(std::string title, uint32_t width, uint32_t height, bool headless = false);
     ~Application();
     void Run();
+    // Accumulates frames samples without showing a window and writes the result as a PNG,
+    // returns false if it could not be written
+    bool RunHeadless(const std::string& outputPath, uint32_t frames);
 
     std::unique_ptr<Window> m_Window;
     std::unique_ptr<Renderer> m_Renderer;
@@ -32,8 +36,11 @@ private:
     void Setup();
     void Resize();
     void Render();
+    void RenderFrame();
     void RenderUI();
     void GetEnvMaps();
+    // Reloads the shaders after any file under PATH_TO_SHADERS was saved
+    void WatchShaders();
 
     std::string m_Title;
     uint32_t m_ViewportWidth;
@@ -49,4 +56,18 @@ private:
 
     std::vector<std::string> m_EnvMaps;
 
+    // Results of the last CPU cache benchmark, per node order
+    BVHCacheStats m_CacheStats[2];
+    bool m_HasCacheStats = false;
+
+    // Statistics of the current tree, recomputed only when BVH::revision moves on
+    BVHStats m_BVHStats;
+    std::vector<float> m_BVHDepthHistogram;
+    std::vector<float> m_BVHLeafSizeHistogram;
+    uint32_t m_BVHStatsRevision = 0;
+    bool m_HasBVHStats = false;
+
+    std::filesystem::file_time_type m_ShaderWriteTime = std::filesystem::file_time_type::min();
+    double m_LastShaderCheck = 0.0;
+
 };
@@ -1,161 +1,786 @@
 #include <glm/glm.hpp>
 #include <vector>
 #include <algorithm>
+#include <future>
+#include <thread>
+#include <array>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <cassert>
 
 #include "primitives.h"
 #include "scene.h"
 #include "bvh.h"
 
 
-struct BVHPrimitiveInfo 
+static size_t ThreadCount()
 {
-    BVHPrimitiveInfo() {}
-    BVHPrimitiveInfo(size_t primitiveNumber, const AABB& bounds)
-        : primitiveNumber(primitiveNumber)
-        , bounds(bounds)
-        , centroid(.5f * bounds.bMin + .5f * bounds.bMax)
-    {};
-    size_t primitiveNumber;
-    AABB bounds;
-    glm::vec3 centroid;
-};
+    return glm::max(size_t(std::thread::hardware_concurrency()), size_t(1));
+}
+
+// Subtrees are only handed to separate tasks down to this depth, which keeps the
+// number of concurrent build tasks around ThreadCount()
+static int MaxTaskDepth()
+{
+    static const int depth = [] {
+        int d = 0;
+        while ((size_t(1) << d) < ThreadCount())
+            d++;
+        return d;
+    }();
+    return depth;
+}
 
-BVH::BVH(std::vector<Primitive>& primitives)
+// Splits [0, count) into at most ThreadCount() contiguous chunks and runs _func_(chunk, begin, end)
+// on each. Ranges smaller than _grain_ are processed as a single chunk on the calling thread.
+template <typename Func>
+static void ParallelFor(size_t count, size_t grain, Func func)
 {
-    if (primitives.size() == 0)
+    size_t nThreads = ThreadCount();
+    if (count < grain || nThreads == 1)
+    {
+        func(size_t(0), size_t(0), count);
         return;
+    }
 
-    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); i++)
+    size_t chunkSize = (count + nThreads - 1) / nThreads;
+    std::vector<std::future<void>> tasks;
+    for (size_t chunk = 1; chunk * chunkSize < count; chunk++)
     {
-        AABB bbox;
-        primitives[i].BoundingBox(&bbox);
-        primitiveInfo[i] = {i, bbox};
+        size_t begin = chunk * chunkSize;
+        tasks.push_back(std::async(std::launch::async, func, chunk, begin, glm::min(begin + chunkSize, count)));
     }
+    func(size_t(0), size_t(0), glm::min(chunkSize, count));
 
-    /*std::vector<Primitive> orderedPrims;
-    orderedPrims.reserve(primitives.size());*/
+    for (auto& task : tasks)
+        task.get();
+}
 
-    primitivesIndexBuffer.reserve(primitives.size());
+BVH::BVH(const std::vector<Primitive>& primitives, const BVHBuildSettings& buildSettings)
+    : settings(buildSettings)
+{
+    Build(primitives);
+}
 
-    int nodeCount = 0;
-    bvh_root = RecursiveBuild(primitiveInfo, 0, primitives.size(), &nodeCount);
-    totalNodes = nodeCount;
-    LinearBVH_Node* flatten = new LinearBVH_Node[totalNodes];
+BVH::BVH(const std::vector<AABB>& bounds, const BVHBuildSettings& buildSettings)
+    : settings(buildSettings)
+{
+    Build(bounds);
+}
 
-    int offset = 0;
-    FlattenBVHTree(flatten, bvh_root, &offset);
-    flat_root = flatten;
+// Spreads the lower 10 bits of x so that two zero bits separate each of them
+static uint32_t LeftShift3(uint32_t x)
+{
+    if (x == (1 << 10)) --x;
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x <<  8)) & 0b00000011000000001111000000001111;
+    x = (x | (x <<  4)) & 0b00000011000011000011000011000011;
+    x = (x | (x <<  2)) & 0b00001001001001001001001001001001;
+    return x;
 }
 
-BVH::~BVH()
+// 30-bit Morton code of a point in [0, 1024)^3, bit i holds a bit of axis i % 3
+static uint32_t EncodeMorton3(const glm::vec3& v)
 {
-    DeleteBVHTree(bvh_root);
-    delete[] flat_root;
+    return (LeftShift3(uint32_t(v.z)) << 2) | (LeftShift3(uint32_t(v.y)) << 1) | LeftShift3(uint32_t(v.x));
 }
 
-void BVH::DeleteBVHTree(BVH_Node* node)
+// Stable LSD radix sort on the 30-bit Morton codes. Each pass counts digits per chunk in
+// parallel, then scatters every chunk into its own precomputed output range.
+static void RadixSort(std::vector<MortonPrimitive>* v, size_t grain)
 {
-    if (node == nullptr)
-        return; 
-    
-    DeleteBVHTree(node->left);
-    DeleteBVHTree(node->right);
+    std::vector<MortonPrimitive> tempVector(v->size());
+    constexpr int bitsPerPass = 6;
+    constexpr int nBits = 30;
+    constexpr int nPasses = nBits / bitsPerPass;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    constexpr uint32_t bitMask = nBuckets - 1;
+
+    std::vector<std::array<size_t, nBuckets>> offsets(ThreadCount());
+    for (int pass = 0; pass < nPasses; ++pass)
+    {
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+        for (auto& chunkOffsets : offsets)
+            chunkOffsets.fill(0);
+
+        ParallelFor(in.size(), grain, [&](size_t chunk, size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+                offsets[chunk][(in[i].mortonCode >> lowBit) & bitMask]++;
+        });
+
+        // Exclusive prefix sum, bucket-major then chunk order, keeps the sort stable
+        size_t total = 0;
+        for (int bucket = 0; bucket < nBuckets; ++bucket)
+        {
+            for (auto& chunkOffsets : offsets)
+            {
+                size_t count = chunkOffsets[bucket];
+                chunkOffsets[bucket] = total;
+                total += count;
+            }
+        }
+
+        ParallelFor(in.size(), grain, [&](size_t chunk, size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                uint32_t bucket = (in[i].mortonCode >> lowBit) & bitMask;
+                out[offsets[chunk][bucket]++] = in[i];
+            }
+        });
+    }
 
-    delete node;
+    if (nPasses & 1)
+        std::swap(*v, tempVector);
 }
 
-void BVH::RebuildBVH(std::vector<Primitive>& primitives)
+void BVHNodeArena::Reset(size_t capacity)
+{
+    m_Used = 0;
+    m_FreeNodes.clear();
+    Reserve(capacity);
+}
+
+void BVHNodeArena::Reserve(size_t capacity)
+{
+    while (Capacity() < capacity)
+        m_Blocks.push_back(std::make_unique<BVH_Node[]>(BLOCK_SIZE));
+}
+
+BVH_Node* BVHNodeArena::Allocate()
+{
+    BVH_Node* node;
+    if (!m_FreeNodes.empty())
+    {
+        node = m_FreeNodes.back();
+        m_FreeNodes.pop_back();
+    }
+    else
+    {
+        size_t index = m_Used++;
+        if (index >= Capacity())
+            Reserve(index + 1);
+        node = &m_Blocks[index / BLOCK_SIZE][index % BLOCK_SIZE];
+    }
+    *node = BVH_Node();
+    return node;
+}
+
+void BVHNodeArena::Free(BVH_Node* node)
+{
+    m_FreeNodes.push_back(node);
+}
+
+void BVH::RebuildBVH(const std::vector<Primitive>& primitives)
 {
     std::cout << "Rebuilding BVH..." << std::endl;
-    DeleteBVHTree(bvh_root);
-    delete[] flat_root;
+    Clear();
+    Build(primitives);
+    std::cout << "BVH Successfully Rebuilt (SAH cost: " << sahCost << ")" << std::endl;
+}
+
+void BVH::BuildFromBounds(const std::vector<AABB>& bounds)
+{
+    Clear();
+    Build(bounds);
+}
+
+void BVH::Build(const std::vector<Primitive>& primitives)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<AABB>& bounds = m_PrimitiveBounds;
+    bounds.resize(primitives.size());
+    ParallelFor(primitives.size(), size_t(settings.parallelThreshold), [&](size_t, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            primitives[i].BoundingBox(&bounds[i]);
+    });
+    float boundsTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    m_BuildPrimitives = &primitives;
+    Build(bounds);
+    m_BuildPrimitives = nullptr;
+    buildTimes.bounds = boundsTime;
+    buildTimes.total += boundsTime;
+}
+
+void BVH::Build(const std::vector<AABB>& bounds)
+{
+    buildTimes = BVHBuildTimes();
+    if (bounds.size() == 0)
+    {
+        WriteEmptyTree();
+        UpdateLayouts();
+        return;
+    }
 
+    using Clock = std::chrono::high_resolution_clock;
+    auto Elapsed = [](Clock::time_point since)
+    {
+        return std::chrono::duration<float, std::milli>(Clock::now() - since).count();
+    };
+    auto phaseStart = Clock::now();
+
+    std::vector<BVHPrimitiveInfo>& primitiveInfo = m_PrimitiveInfo;
+    primitiveInfo.resize(bounds.size());
+    ParallelFor(bounds.size(), size_t(settings.parallelThreshold), [&](size_t, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            primitiveInfo[i] = {i, bounds[i]};
+    });
+
+    // A binary tree with at least one primitive per leaf never has more than 2n - 1 nodes
+    m_NodeArena.Reset(2 * bounds.size() - 1);
+
+    std::atomic<int> nodeCount = 0;
+    spatialSplits = 0;
+    if (settings.splitMethod == SPLIT_LBVH || settings.splitMethod == SPLIT_HLBVH)
+    {
+        bvh_root = HLBVHBuild(primitiveInfo, &nodeCount);
+    }
+    else if (settings.splitMethod == SPLIT_SBVH)
+    {
+        // Each split reference adds at most one leaf and one interior node
+        int splitBudget = int(glm::max(settings.spatialSplitBudget, 0.0f) * float(bounds.size()));
+        m_NodeArena.Reset(2 * (bounds.size() + splitBudget) - 1);
+
+        // Leaves are made from copies of the references, which replace primitiveInfo below
+        std::vector<BVHPrimitiveInfo> references = std::move(primitiveInfo);
+        std::vector<BVHPrimitiveInfo> leafReferences;
+        leafReferences.reserve(bounds.size() + splitBudget);
+        AABB rootBounds, rootCentroidBounds;
+        ComputeBounds(references, 0, references.size(), &rootBounds, &rootCentroidBounds);
+        bvh_root = SpatialSplitBuild(references, leafReferences, rootBounds.SurfaceArea(), &splitBudget, &nodeCount);
+        primitiveInfo = std::move(leafReferences);
+        spatialSplits = int(primitiveInfo.size()) - int(bounds.size());
+    }
+    else
+    {
+        bvh_root = RecursiveBuild(primitiveInfo, 0, bounds.size(), 0, &nodeCount);
+    }
+    totalNodes = nodeCount;
+    liveNodes = totalNodes;
+    buildTimes.topology = Elapsed(phaseStart);
+    phaseStart = Clock::now();
+
+    // Leaves reference contiguous ranges of the partitioned primitiveInfo, so the index buffer
+    // is simply its final order. Subtrees only ever reorder their own disjoint range, which keeps
+    // the result identical however many threads took part in the build.
+    primitivesIndexBuffer.resize(primitiveInfo.size());
+    for (size_t i = 0; i < primitiveInfo.size(); i++)
+        primitivesIndexBuffer[i] = (int) primitiveInfo[i].primitiveNumber;
+
+    // Only reallocates when the tree outgrows every previous build
+    m_FlatNodes.resize(totalNodes);
+    flat_root = m_FlatNodes.data();
+    if (settings.nodeOrder == ORDER_TREELET)
+    {
+        FlattenTreelets(bvh_root);
+    }
+    else
+    {
+        int offset = 0;
+        FlattenBVHTree(bvh_root, &offset);
+    }
+
+    m_PrimitiveLeaves.assign(bounds.size(), nullptr);
+    IndexLeaves(bvh_root);
+
+    sahCost = ComputeSAHCost();
+    builtSahCost = sahCost;
+    buildTimes.flatten = Elapsed(phaseStart);
+    phaseStart = Clock::now();
+
+    UpdateLayouts();
+    buildTimes.layouts = Elapsed(phaseStart);
+    buildTimes.total = buildTimes.topology + buildTimes.flatten + buildTimes.layouts;
+}
+
+void BVH::Clear()
+{
+    bvh_root = nullptr;
+    flat_root = nullptr;
+    totalNodes = 0;
+    liveNodes = 0;
+    sahCost = 0.0f;
+    builtSahCost = 0.0f;
+    spatialSplits = 0;
+
+    m_NodeArena.Reset(0);
+    m_FlatNodes.resize(0);
     primitivesIndexBuffer.resize(0);
+    m_PrimitiveLeaves.resize(0);
+    m_FreeFlatSlots.resize(0);
+    m_FreeIndexSlots.resize(0);
+    flatBVH4.resize(0);
+    flatQuantized.resize(0);
+    flatStackless.resize(0);
+    dirtyNodes.Clear();
+    dirtyIndices.Clear();
+    b_Rebuilt = true;
+    b_LayoutChanged = true;
+}
+
+void BVH::Insert(const std::vector<Primitive>& primitives, int primitiveIndex)
+{
+    // Incremental insertion (Bittner et al. 2015, as popularised by Box2D's dynamic tree):
+    // pair the new leaf with the sibling that minimises the total surface area increase,
+    // then refit the ancestors and apply local tree rotations on the way back up.
+    AABB bounds;
+    primitives[primitiveIndex].BoundingBox(&bounds);
+
+    BVH_Node* leaf = m_NodeArena.Allocate();
+    int indexSlot = AllocateIndexSlot();
+    primitivesIndexBuffer[indexSlot] = primitiveIndex;
+    dirtyIndices.Add(indexSlot);
+    CreateLeaf(leaf, indexSlot, indexSlot + 1, bounds);
+    leaf->flatIndex = AllocateFlatSlot();
 
-    if (primitives.size() == 0)
+    if (primitiveIndex >= (int) m_PrimitiveLeaves.size())
+        m_PrimitiveLeaves.resize(primitiveIndex + 1, nullptr);
+    m_PrimitiveLeaves[primitiveIndex] = leaf;
+
+    if (bvh_root == nullptr)
+    {
+        bvh_root = leaf;
+        liveNodes = 1;
+        WriteFlatNode(leaf);
+        sahCost = builtSahCost = ComputeSAHCost();
+        UpdateLayouts();
         return;
+    }
+
+    BVH_Node* sibling = FindBestSibling(bounds);
+    BVH_Node* oldParent = sibling->parent;
 
-    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); i++)
+    BVH_Node* newParent = m_NodeArena.Allocate();
+    InitInterior(newParent, 0, sibling, leaf);
+    newParent->parent = oldParent;
+    liveNodes += 2;
+    if (oldParent == nullptr)
+    {
+        // The root always lives in slot 0, where traversal starts
+        newParent->flatIndex = sibling->flatIndex;
+        sibling->flatIndex = AllocateFlatSlot();
+        bvh_root = newParent;
+    }
+    else
     {
-        AABB bbox;
-        primitives[i].BoundingBox(&bbox);
-        primitiveInfo[i] = {i, bbox};
+        newParent->flatIndex = AllocateFlatSlot();
+        (oldParent->left == sibling ? oldParent->left : oldParent->right) = newParent;
     }
 
-    /*std::vector<Primitive> orderedPrims;
-    orderedPrims.reserve(primitives.size());*/
+    WriteFlatNode(sibling);
+    WriteFlatNode(leaf);
+    RefitAndRotateUp(newParent);
+    sahCost = ComputeSAHCost();
+    UpdateLayouts();
+}
+
+void BVH::Remove(const std::vector<Primitive>& primitives, int primitiveIndex)
+{
+    // Remove the primitive from its leaf, collapsing the leaf and its parent if it
+    // becomes empty. The caller then moves the last primitive into primitiveIndex, as
+    // Scene::RemovePrimitive does, so only the references to that one are renamed.
+    if (primitiveIndex >= (int) m_PrimitiveLeaves.size() || m_PrimitiveLeaves[primitiveIndex] == nullptr)
+        return;
 
-    //std::vector<int> primitivesIndexBuffer;
-    primitivesIndexBuffer.reserve(primitives.size());
+    std::vector<BVH_Node*> leaves;
+    CollectLeaves(primitiveIndex, &leaves);
+    for (BVH_Node* leaf : leaves)
+        RemoveFromLeaf(leaf, primitiveIndex);
+    m_PrimitiveLeaves[primitiveIndex] = nullptr;
 
-    int nodeCount = 0;
-    bvh_root = RecursiveBuild(primitiveInfo, 0, primitives.size(), &nodeCount);
-    totalNodes = nodeCount;
+    int lastIndex = (int) primitives.size() - 1;
+    if (bvh_root == nullptr)
+    {
+        WriteEmptyTree();
+    }
+    else if (primitiveIndex != lastIndex && lastIndex < (int) m_PrimitiveLeaves.size())
+    {
+        leaves.clear();
+        CollectLeaves(lastIndex, &leaves);
+        for (BVH_Node* leaf : leaves)
+        {
+            for (int i = leaf->primitiveOffset; i < leaf->primitiveOffset + leaf->nPrimitives; ++i)
+            {
+                if (primitivesIndexBuffer[i] == lastIndex)
+                {
+                    primitivesIndexBuffer[i] = primitiveIndex;
+                    dirtyIndices.Add(i);
+                    break;
+                }
+            }
+        }
+        m_PrimitiveLeaves[primitiveIndex] = m_PrimitiveLeaves[lastIndex];
+    }
+    if (lastIndex >= 0 && lastIndex < (int) m_PrimitiveLeaves.size())
+        m_PrimitiveLeaves.resize(lastIndex);
 
-    /*primitives.swap(orderedPrims);
-    primitiveInfo.resize(0);*/
+    sahCost = ComputeSAHCost();
+    UpdateLayouts();
+}
 
-    LinearBVH_Node* flatten = new LinearBVH_Node[totalNodes];
-    int offset = 0;
-    FlattenBVHTree(flatten, bvh_root, &offset);
-    flat_root = flatten;
+void BVH::CollectLeaves(int primitiveIndex, std::vector<BVH_Node*>* leaves) const
+{
+    // Spatial splits may have left references to the primitive in several leaves
+    if (spatialSplits > 0)
+        FindLeaves(bvh_root, primitiveIndex, leaves);
+    else if (m_PrimitiveLeaves[primitiveIndex] != nullptr)
+        leaves->push_back(m_PrimitiveLeaves[primitiveIndex]);
+}
+
+void BVH::FindLeaves(BVH_Node* node, int primitiveIndex, std::vector<BVH_Node*>* leaves) const
+{
+    if (node == nullptr)
+        return;
+    if (node->type == node_t::LEAF)
+    {
+        for (int i = 0; i < node->nPrimitives; ++i)
+        {
+            if (primitivesIndexBuffer[node->primitiveOffset + i] == primitiveIndex)
+            {
+                leaves->push_back(node);
+                break;
+            }
+        }
+        return;
+    }
+    FindLeaves(node->left, primitiveIndex, leaves);
+    FindLeaves(node->right, primitiveIndex, leaves);
+}
+
+void BVH::RemoveFromLeaf(BVH_Node* leaf, int primitiveIndex)
+{
+    if (leaf->nPrimitives > 1)
+    {
+        // Swap the last entry of the leaf's range into the removed one's place
+        int first = leaf->primitiveOffset;
+        int last = first + leaf->nPrimitives - 1;
+        for (int i = first; i <= last; ++i)
+        {
+            if (primitivesIndexBuffer[i] == primitiveIndex)
+            {
+                primitivesIndexBuffer[i] = primitivesIndexBuffer[last];
+                dirtyIndices.Add(i);
+                break;
+            }
+        }
+        m_FreeIndexSlots.push_back(last);
+        leaf->nPrimitives--;
+        // The old bounds still enclose the remaining primitives, they tighten on the next refit
+        WriteFlatNode(leaf);
+    }
+    else
+    {
+        m_FreeIndexSlots.push_back(leaf->primitiveOffset);
+        m_FreeFlatSlots.push_back(leaf->flatIndex);
+        m_NodeArena.Free(leaf);
+
+        BVH_Node* parent = leaf->parent;
+        if (parent == nullptr)
+        {
+            bvh_root = nullptr;
+            liveNodes = 0;
+        }
+        else
+        {
+            liveNodes -= 2;
+            BVH_Node* sibling = parent->left == leaf ? parent->right : parent->left;
+            BVH_Node* grandParent = parent->parent;
+            sibling->parent = grandParent;
+            m_NodeArena.Free(parent);
+            if (grandParent == nullptr)
+            {
+                // The sibling becomes the root and moves into slot 0
+                m_FreeFlatSlots.push_back(sibling->flatIndex);
+                sibling->flatIndex = parent->flatIndex;
+                bvh_root = sibling;
+                WriteFlatNode(sibling);
+            }
+            else
+            {
+                m_FreeFlatSlots.push_back(parent->flatIndex);
+                (grandParent->left == parent ? grandParent->left : grandParent->right) = sibling;
+                RefitAndRotateUp(grandParent);
+            }
+        }
+    }
+}
+
+BVH_Node* BVH::FindBestSibling(const AABB& bounds) const
+{
+    // Branch and bound over the tree. The cost of choosing a node as sibling is the area of the
+    // new parent plus the area every ancestor grows by. A subtree is skipped once even a perfect
+    // fit (the leaf's own area plus the inherited growth) cannot beat the best found so far.
+    float leafArea = bounds.SurfaceArea();
+    BVH_Node* bestSibling = bvh_root;
+    float bestCost = Union(bvh_root->bbox, bounds).SurfaceArea();
+
+    std::vector<std::pair<BVH_Node*, float>> stack;
+    stack.push_back({bvh_root, 0.0f});
+    while (!stack.empty())
+    {
+        auto [node, inheritedCost] = stack.back();
+        stack.pop_back();
+
+        float directCost = Union(node->bbox, bounds).SurfaceArea();
+        float cost = directCost + inheritedCost;
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestSibling = node;
+        }
+
+        if (node->type == node_t::PARENT)
+        {
+            float childInheritedCost = inheritedCost + directCost - node->bbox.SurfaceArea();
+            if (leafArea + childInheritedCost < bestCost)
+            {
+                stack.push_back({node->left, childInheritedCost});
+                stack.push_back({node->right, childInheritedCost});
+            }
+        }
+    }
+    return bestSibling;
+}
+
+void BVH::RefitAndRotateUp(BVH_Node* node)
+{
+    while (node != nullptr)
+    {
+        Rotate(node);
+        UpdateInterior(node);
+        WriteFlatNode(node);
+        node = node->parent;
+    }
+}
+
+void BVH::Rotate(BVH_Node* node)
+{
+    // Tree rotations (Kensler 2008): try swapping a child with one of its sibling's children
+    // and keep the swap that shrinks the modified sibling's area the most
+    BVH_Node* b = node->left;
+    BVH_Node* c = node->right;
+
+    enum { NONE, B_F, B_G, C_D, C_E } best = NONE;
+    float bestDelta = 0.0f;
+    if (c->type == node_t::PARENT)
+    {
+        float area = c->bbox.SurfaceArea();
+        float delta = Union(b->bbox, c->right->bbox).SurfaceArea() - area;
+        if (delta < bestDelta) { bestDelta = delta; best = B_F; }
+        delta = Union(b->bbox, c->left->bbox).SurfaceArea() - area;
+        if (delta < bestDelta) { bestDelta = delta; best = B_G; }
+    }
+    if (b->type == node_t::PARENT)
+    {
+        float area = b->bbox.SurfaceArea();
+        float delta = Union(c->bbox, b->right->bbox).SurfaceArea() - area;
+        if (delta < bestDelta) { bestDelta = delta; best = C_D; }
+        delta = Union(c->bbox, b->left->bbox).SurfaceArea() - area;
+        if (delta < bestDelta) { bestDelta = delta; best = C_E; }
+    }
+
+    // Swap _child_ of _node_ with _grandChild_ below _other_
+    auto Swap = [&](BVH_Node* child, BVH_Node* other, BVH_Node*& grandChildSlot)
+    {
+        BVH_Node* grandChild = grandChildSlot;
+        (node->left == child ? node->left : node->right) = grandChild;
+        grandChild->parent = node;
+        grandChildSlot = child;
+        child->parent = other;
+        UpdateInterior(other);
+        WriteFlatNode(other);
+    };
+
+    switch (best)
+    {
+        case NONE: break;
+        case B_F: Swap(b, c, c->left); break;
+        case B_G: Swap(b, c, c->right); break;
+        case C_D: Swap(c, b, b->left); break;
+        case C_E: Swap(c, b, b->right); break;
+    }
+}
+
+void BVH::UpdateInterior(BVH_Node* node)
+{
+    // Recompute the bounds and keep the children ordered along the axis that separates
+    // them best, which the shader relies on to visit the nearer child first
+    node->bbox = Union(node->left->bbox, node->right->bbox);
+    glm::vec3 d = (node->right->bbox.bMin + node->right->bbox.bMax) - (node->left->bbox.bMin + node->left->bbox.bMax);
+    glm::vec3 a = glm::abs(d);
+    node->axis = (a.x > a.y && a.x > a.z) ? 0 : (a.y > a.z ? 1 : 2);
+    if (d[node->axis] < 0.0f)
+        std::swap(node->left, node->right);
+}
+
+void BVH::WriteEmptyTree()
+{
+    // Traversal always starts at slot 0, so an empty tree is a lone leaf without primitives
+    // there. Uploading no nodes at all would leave the previous root on the GPU.
+    m_FlatNodes.assign(1, LinearBVH_Node());
+    flat_root = m_FlatNodes.data();
+    totalNodes = 1;
+    liveNodes = 0;
+    m_FreeFlatSlots.assign(1, 0);
+    primitivesIndexBuffer.clear();
+    m_FreeIndexSlots.clear();
+    dirtyNodes.Clear();
+    dirtyIndices.Clear();
     b_Rebuilt = true;
-    std::cout << "BVH Successfully Rebuilt" << std::endl;
+}
+
+int BVH::AllocateFlatSlot()
+{
+    if (!m_FreeFlatSlots.empty())
+    {
+        int slot = m_FreeFlatSlots.back();
+        m_FreeFlatSlots.pop_back();
+        return slot;
+    }
+
+    m_FlatNodes.emplace_back();
+    flat_root = m_FlatNodes.data();
+    totalNodes = (int) m_FlatNodes.size();
+    return totalNodes - 1;
+}
+
+int BVH::AllocateIndexSlot()
+{
+    if (!m_FreeIndexSlots.empty())
+    {
+        int slot = m_FreeIndexSlots.back();
+        m_FreeIndexSlots.pop_back();
+        return slot;
+    }
+
+    primitivesIndexBuffer.push_back(-1);
+    return (int) primitivesIndexBuffer.size() - 1;
+}
+
+void BVH::IndexLeaves(BVH_Node* node)
+{
+    if (node->type == node_t::LEAF)
+    {
+        for (int i = 0; i < node->nPrimitives; ++i)
+            m_PrimitiveLeaves[primitivesIndexBuffer[node->primitiveOffset + i]] = node;
+        return;
+    }
+    IndexLeaves(node->left);
+    IndexLeaves(node->right);
+}
+
+bool BVH::Refit(const std::vector<Primitive>& primitives)
+{
+    // Recompute bounds bottom-up for primitives that moved, keeping the topology and
+    // primitivesIndexBuffer as they are. Returns true if the tree was rebuilt instead.
+    if (bvh_root == nullptr)
+        return false;
+
+    RefitNode(bvh_root, primitives);
+    sahCost = ComputeSAHCost();
+
+    // Moving primitives far from where they were built around leaves large overlapping
+    // boxes behind, so start over once the tree has degraded too much
+    if (sahCost > settings.refitRebuildRatio * builtSahCost)
+    {
+        RebuildBVH(primitives);
+        return true;
+    }
+    UpdateLayouts();
+    return false;
+}
+
+void BVH::RefitNode(BVH_Node* node, const std::vector<Primitive>& primitives)
+{
+    if (node->type == node_t::LEAF)
+    {
+        // Leaves of spatial splits grow back to the whole primitive, which is conservative
+        // but loosens the tree until the refit falls back to a rebuild
+        AABB bounds;
+        for (int i = 0; i < node->nPrimitives; ++i)
+        {
+            AABB bbox;
+            primitives[primitivesIndexBuffer[node->primitiveOffset + i]].BoundingBox(&bbox);
+            bounds = Union(bounds, bbox);
+        }
+        node->bbox = bounds;
+    }
+    else
+    {
+        RefitNode(node->left, primitives);
+        RefitNode(node->right, primitives);
+        node->bbox = Union(node->left->bbox, node->right->bbox);
+    }
+
+    // Only the bounds change, the links are rewritten with the same values
+    WriteFlatNode(node);
 }
 
 BVH_Node* BVH::RecursiveBuild(
-    std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end, int* nodeCount)
+    std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end, int depth, std::atomic<int>* nodeCount)
 {
-    BVH_Node* node = new BVH_Node();
+    BVH_Node* node = m_NodeArena.Allocate();
     (*nodeCount)++;
 
     // Determine the tightest bounding box to encapsulate all remaining primitives
+    // as well as the bound of their centroids. Only the root has the threads to itself,
+    // deeper nodes may already be running next to their siblings.
     AABB bounds;
-    for (size_t i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    AABB centroidBounds;
+    ComputeBounds(primitiveInfo, start, end, &bounds, &centroidBounds, depth == 0);
 
     size_t primitivesCount = end - start;
+    size_t maxPrimsInNode = size_t(glm::max(settings.maxPrimsInNode, 1));
 
     if (primitivesCount == 1)
     {
         // Node is a leaf
+        CreateLeaf(node, start, end, bounds);
+        return node;
+    }
 
-        int firstPrimOffset = primitivesIndexBuffer.size();
-        for (int i = start; i < end; ++i) 
-        {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            primitivesIndexBuffer.push_back(primNum);
-        }
+    // Node is not a leaf so we must decide on an axis to split along
+    // In this case, we want to split along the longest axis
+    
+    // Choose split dimension from the bound of primitive centroids
+    int axis = centroidBounds.LongestAxis();
 
-        node->type = node_t::LEAF;
-        node->primitiveOffset = firstPrimOffset;
-        node->left = node->right = nullptr;
-        node->bbox = bounds;
+    size_t mid = start + primitivesCount / 2;
+    bool makeLeaf = false;
+    if (centroidBounds.bMax[axis] == centroidBounds.bMin[axis])
+    {
+        // All centroids coincide so no split can separate them spatially
+        makeLeaf = primitivesCount <= maxPrimsInNode;
+    }
+    else if (settings.splitMethod == SPLIT_SAH)
+    {
+        mid = SplitSAH(primitiveInfo, start, end, bounds, centroidBounds, axis, &makeLeaf);
     }
     else
     {
-        // Node is not a leaf so we must decide on an axis to split along
-        // In this case, we want to split along the longest axis
-        
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        AABB centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
-        int axis = centroidBounds.LongestAxis();
-
-        // Partition into equally sized subsets
-        size_t mid = start + primitivesCount / 2;
+        makeLeaf = primitivesCount <= maxPrimsInNode;
+    }
 
-        /*std::sort(
-            primitiveInfo.begin() + start, primitiveInfo.begin() + end, 
-            [axis](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b)
-            {
-                return a.centroid[axis] < b.centroid[axis];
-            }
-        );*/
+    if (makeLeaf)
+    {
+        CreateLeaf(node, start, end, bounds);
+        return node;
+    }
 
+    // Partition into equally sized subsets, also used as a fallback when the SAH
+    // cannot separate the primitives (e.g. all centroids fall into the same bucket)
+    if (settings.splitMethod == SPLIT_EQUAL_COUNTS || mid == start || mid == end)
+    {
+        mid = start + primitivesCount / 2;
         std::nth_element(
             &primitiveInfo[start],
             &primitiveInfo[mid],
@@ -165,39 +790,1151 @@ BVH_Node* BVH::RecursiveBuild(
                 return a.centroid[axis] < b.centroid[axis];
             }
         );
-
-        //std::cout << "Split along axis " << axis << std::endl;
-        node->axis = axis;
-        node->type = node_t::PARENT;
-        node->primitiveOffset = -1;
-        node->left = RecursiveBuild(primitiveInfo, start, mid, nodeCount);
-        node->right = RecursiveBuild(primitiveInfo, mid, end, nodeCount);
-        node->bbox = Union(node->left->bbox, node->right->bbox);
     }
-    return node;
-}
 
-int BVH::FlattenBVHTree(LinearBVH_Node* flatten, BVH_Node* node, int* offset)
-{
-    LinearBVH_Node* linearNode = &flatten[*offset];
+    BVH_Node* left;
+    BVH_Node* right;
+    if (primitivesCount >= size_t(settings.parallelThreshold) && depth < MaxTaskDepth())
+    {
+        // Both halves touch disjoint ranges of primitiveInfo so they can be built concurrently
+        std::future<BVH_Node*> leftTask = std::async(std::launch::async, 
+            [&]() { return RecursiveBuild(primitiveInfo, start, mid, depth + 1, nodeCount); });
+        right = RecursiveBuild(primitiveInfo, mid, end, depth + 1, nodeCount);
+        left = leftTask.get();
+    }
+    else
+    {
+        left = RecursiveBuild(primitiveInfo, start, mid, depth + 1, nodeCount);
+        right = RecursiveBuild(primitiveInfo, mid, end, depth + 1, nodeCount);
+    }
+    InitInterior(node, axis, left, right);
+    return node;
+}
+
+void BVH::CreateLeaf(BVH_Node* node, size_t start, size_t end, const AABB& bounds)
+{
+    node->type = node_t::LEAF;
+    node->parent = nullptr;
+    node->primitiveOffset = (int) start;
+    node->nPrimitives = int(end - start);
+    node->left = node->right = nullptr;
+    node->bbox = bounds;
+}
+
+void BVH::InitInterior(BVH_Node* node, int axis, BVH_Node* left, BVH_Node* right)
+{
+    node->type = node_t::PARENT;
+    node->axis = axis;
+    node->primitiveOffset = -1;
+    node->nPrimitives = 0;
+    node->parent = nullptr;
+    node->left = left;
+    node->right = right;
+    left->parent = node;
+    right->parent = node;
+    node->bbox = Union(left->bbox, right->bbox);
+}
+
+void BVH::ComputeBounds(
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end,
+    AABB* bounds, AABB* centroidBounds, bool parallel) const
+{
+    if (!parallel || end - start < size_t(settings.parallelThreshold))
+    {
+        for (size_t i = start; i < end; ++i)
+        {
+            *bounds = Union(*bounds, primitiveInfo[i].bounds);
+            *centroidBounds = Union(*centroidBounds, primitiveInfo[i].centroid);
+        }
+        return;
+    }
+
+    size_t nThreads = ThreadCount();
+    std::vector<AABB> partialBounds(nThreads);
+    std::vector<AABB> partialCentroidBounds(nThreads);
+
+    ParallelFor(end - start, size_t(settings.parallelThreshold), [&](size_t chunk, size_t begin, size_t last)
+    {
+        AABB b, cb;
+        for (size_t i = start + begin; i < start + last; ++i)
+        {
+            b = Union(b, primitiveInfo[i].bounds);
+            cb = Union(cb, primitiveInfo[i].centroid);
+        }
+        partialBounds[chunk] = b;
+        partialCentroidBounds[chunk] = cb;
+    });
+
+    // Min/max unions are exact, so the reduction does not depend on how the range was split
+    for (size_t i = 0; i < nThreads; ++i)
+    {
+        *bounds = Union(*bounds, partialBounds[i]);
+        *centroidBounds = Union(*centroidBounds, partialCentroidBounds[i]);
+    }
+}
+
+BVH_Node* BVH::HLBVHBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, std::atomic<int>* nodeCount)
+{
+    // Linear BVH construction (PBRT v3, 4.3.3)
+    size_t grain = size_t(settings.parallelThreshold);
+    AABB bounds, centroidBounds;
+    ComputeBounds(primitiveInfo, 0, primitiveInfo.size(), &bounds, &centroidBounds);
+
+    // Quantise each centroid to a 1024^3 grid over the centroid bounds and sort along the Morton curve
+    std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
+    ParallelFor(primitiveInfo.size(), grain, [&](size_t, size_t begin, size_t end)
+    {
+        constexpr int mortonBits = 10;
+        constexpr int mortonScale = 1 << mortonBits;
+        for (size_t i = begin; i < end; ++i)
+        {
+            mortonPrims[i].primitiveIndex = (int) i;
+            glm::vec3 centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+            mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * float(mortonScale));
+        }
+    });
+    RadixSort(&mortonPrims, grain);
+
+    // Leaves reference ranges of the sorted order, so reorder primitiveInfo to match
+    std::vector<BVHPrimitiveInfo> unsortedInfo(primitiveInfo);
+    ParallelFor(primitiveInfo.size(), grain, [&](size_t, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            primitiveInfo[i] = unsortedInfo[mortonPrims[i].primitiveIndex];
+    });
+
+    if (settings.splitMethod == SPLIT_LBVH)
+        return EmitLBVH(primitiveInfo, mortonPrims.data(), 0, mortonPrims.size(), 29, 0, nodeCount);
+
+    // Group primitives sharing the 12 high Morton bits into treelets...
+    std::vector<LBVHTreelet> treeletsToBuild;
+    for (size_t start = 0, end = 1; end <= mortonPrims.size(); ++end)
+    {
+        constexpr uint32_t mask = 0b00111111111111000000000000000000;
+        if (end == mortonPrims.size() || 
+            ((mortonPrims[start].mortonCode & mask) != (mortonPrims[end].mortonCode & mask)))
+        {
+            treeletsToBuild.push_back({start, end - start, nullptr});
+            start = end;
+        }
+    }
+
+    // ...build each treelet on the remaining 18 bits, the treelets already keep every thread busy...
+    size_t treeletGrain = primitiveInfo.size() >= grain ? 1 : treeletsToBuild.size() + 1;
+    ParallelFor(treeletsToBuild.size(), treeletGrain, [&](size_t, size_t begin, size_t end)
+    {
+        constexpr int firstBitIndex = 29 - 12;
+        for (size_t i = begin; i < end; ++i)
+        {
+            LBVHTreelet& tr = treeletsToBuild[i];
+            tr.root = EmitLBVH(primitiveInfo, mortonPrims.data(), tr.startIndex, tr.nPrimitives, firstBitIndex, MaxTaskDepth(), nodeCount);
+        }
+    });
+
+    // ...and join them with the SAH
+    std::vector<BVH_Node*> finishedTreelets;
+    finishedTreelets.reserve(treeletsToBuild.size());
+    for (LBVHTreelet& treelet : treeletsToBuild)
+        finishedTreelets.push_back(treelet.root);
+    return BuildUpperSAH(finishedTreelets, 0, finishedTreelets.size(), nodeCount);
+}
+
+BVH_Node* BVH::EmitLBVH(
+    const std::vector<BVHPrimitiveInfo>& primitiveInfo, const MortonPrimitive* mortonPrims,
+    size_t start, size_t nPrimitives, int bitIndex, int depth, std::atomic<int>* nodeCount)
+{
+    if (bitIndex == -1 || nPrimitives <= size_t(glm::max(settings.maxPrimsInNode, 1)))
+    {
+        BVH_Node* node = m_NodeArena.Allocate();
+        (*nodeCount)++;
+
+        AABB bounds;
+        for (size_t i = start; i < start + nPrimitives; ++i)
+            bounds = Union(bounds, primitiveInfo[i].bounds);
+        CreateLeaf(node, start, start + nPrimitives, bounds);
+        return node;
+    }
+
+    // Skip bits on which every primitive in the range agrees, they do not separate anything
+    const MortonPrimitive* prims = mortonPrims + start;
+    uint32_t mask = 1 << bitIndex;
+    if ((prims[0].mortonCode & mask) == (prims[nPrimitives - 1].mortonCode & mask))
+        return EmitLBVH(primitiveInfo, mortonPrims, start, nPrimitives, bitIndex - 1, depth, nodeCount);
+
+    // Binary search for the first primitive with this bit set
+    size_t searchStart = 0, searchEnd = nPrimitives - 1;
+    while (searchStart + 1 != searchEnd)
+    {
+        size_t mid = (searchStart + searchEnd) / 2;
+        if ((prims[searchStart].mortonCode & mask) == (prims[mid].mortonCode & mask))
+            searchStart = mid;
+        else
+            searchEnd = mid;
+    }
+    size_t splitOffset = searchEnd;
+
+    BVH_Node* node = m_NodeArena.Allocate();
+    (*nodeCount)++;
+
+    BVH_Node* left;
+    BVH_Node* right;
+    if (nPrimitives >= size_t(settings.parallelThreshold) && depth < MaxTaskDepth())
+    {
+        std::future<BVH_Node*> leftTask = std::async(std::launch::async, [&]()
+        {
+            return EmitLBVH(primitiveInfo, mortonPrims, start, splitOffset, bitIndex - 1, depth + 1, nodeCount);
+        });
+        right = EmitLBVH(primitiveInfo, mortonPrims, start + splitOffset, nPrimitives - splitOffset, bitIndex - 1, depth + 1, nodeCount);
+        left = leftTask.get();
+    }
+    else
+    {
+        left = EmitLBVH(primitiveInfo, mortonPrims, start, splitOffset, bitIndex - 1, depth + 1, nodeCount);
+        right = EmitLBVH(primitiveInfo, mortonPrims, start + splitOffset, nPrimitives - splitOffset, bitIndex - 1, depth + 1, nodeCount);
+    }
+
+    InitInterior(node, bitIndex % 3, left, right);
+    return node;
+}
+
+BVH_Node* BVH::BuildUpperSAH(std::vector<BVH_Node*>& treeletRoots, size_t start, size_t end, std::atomic<int>* nodeCount)
+{
+    size_t nNodes = end - start;
+    if (nNodes == 1)
+        return treeletRoots[start];
+
+    BVH_Node* node = m_NodeArena.Allocate();
+    (*nodeCount)++;
+
+    AABB bounds, centroidBounds;
+    for (size_t i = start; i < end; ++i)
+    {
+        const AABB& b = treeletRoots[i]->bbox;
+        bounds = Union(bounds, b);
+        centroidBounds = Union(centroidBounds, .5f * (b.bMin + b.bMax));
+    }
+    int axis = centroidBounds.LongestAxis();
+
+    // Bin the treelet roots as SplitSAH bins primitives
+    struct BucketInfo
+    {
+        int count = 0;
+        AABB bounds;
+    };
+
+    const int nBuckets = glm::max(settings.nBuckets, 2);
+    std::vector<BucketInfo> buckets(nBuckets);
+    auto BucketIndex = [&](const BVH_Node* root)
+    {
+        glm::vec3 centroid = .5f * (root->bbox.bMin + root->bbox.bMax);
+        int b = int(nBuckets * centroidBounds.Offset(centroid)[axis]);
+        return glm::clamp(b, 0, nBuckets - 1);
+    };
+
+    for (size_t i = start; i < end; ++i)
+    {
+        int b = BucketIndex(treeletRoots[i]);
+        buckets[b].count++;
+        buckets[b].bounds = Union(buckets[b].bounds, treeletRoots[i]->bbox);
+    }
+
+    int minCostSplitBucket = 0;
+    float minCost = FLT_MAX;
+    for (int i = 0; i < nBuckets - 1; ++i)
+    {
+        AABB b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j)
+        {
+            b0 = Union(b0, buckets[j].bounds);
+            count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nBuckets; ++j)
+        {
+            b1 = Union(b1, buckets[j].bounds);
+            count1 += buckets[j].count;
+        }
+        float cost = count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea();
+        if (cost < minCost)
+        {
+            minCost = cost;
+            minCostSplitBucket = i;
+        }
+    }
+
+    BVH_Node** pmid = std::partition(
+        &treeletRoots[start], &treeletRoots[end - 1] + 1,
+        [&](const BVH_Node* root)
+        {
+            return BucketIndex(root) <= minCostSplitBucket;
+        }
+    );
+    size_t mid = size_t(pmid - &treeletRoots[0]);
+
+    // Fall back to an equal split if the buckets failed to separate the treelets
+    if (mid == start || mid == end)
+    {
+        mid = (start + end) / 2;
+        std::nth_element(
+            &treeletRoots[start], &treeletRoots[mid], &treeletRoots[end - 1] + 1,
+            [axis](const BVH_Node* a, const BVH_Node* b)
+            {
+                return a->bbox.bMin[axis] + a->bbox.bMax[axis] < b->bbox.bMin[axis] + b->bbox.bMax[axis];
+            }
+        );
+    }
+
+    BVH_Node* left = BuildUpperSAH(treeletRoots, start, mid, nodeCount);
+    BVH_Node* right = BuildUpperSAH(treeletRoots, mid, end, nodeCount);
+    InitInterior(node, axis, left, right);
+    return node;
+}
+
+size_t BVH::SplitSAH(
+    std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end,
+    const AABB& bounds, const AABB& centroidBounds, int axis, bool* makeLeaf)
+{
+    // Binned SAH (PBRT v3, 4.3.2): bin the primitive centroids along _axis_ and evaluate
+    // the cost of splitting at each bucket boundary
+    struct BucketInfo
+    {
+        int count = 0;
+        AABB bounds;
+    };
+
+    const int nBuckets = glm::max(settings.nBuckets, 2);
+    std::vector<BucketInfo> buckets(nBuckets);
+
+    auto BucketIndex = [&](const BVHPrimitiveInfo& info)
+    {
+        int b = int(nBuckets * centroidBounds.Offset(info.centroid)[axis]);
+        return glm::clamp(b, 0, nBuckets - 1);
+    };
+
+    for (size_t i = start; i < end; ++i)
+    {
+        int b = BucketIndex(primitiveInfo[i]);
+        buckets[b].count++;
+        buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+    }
+
+    // Sweep from both ends so every split is evaluated in linear time
+    std::vector<float> costs(nBuckets - 1, 0.0f);
+    AABB bLeft;
+    int countLeft = 0;
+    for (int i = 0; i < nBuckets - 1; ++i)
+    {
+        bLeft = Union(bLeft, buckets[i].bounds);
+        countLeft += buckets[i].count;
+        costs[i] = countLeft * bLeft.SurfaceArea();
+    }
+
+    AABB bRight;
+    int countRight = 0;
+    for (int i = nBuckets - 1; i > 0; --i)
+    {
+        bRight = Union(bRight, buckets[i].bounds);
+        countRight += buckets[i].count;
+        costs[i - 1] += countRight * bRight.SurfaceArea();
+    }
+
+    int minCostSplitBucket = 0;
+    float minCost = costs[0];
+    for (int i = 1; i < nBuckets - 1; ++i)
+    {
+        if (costs[i] < minCost)
+        {
+            minCost = costs[i];
+            minCostSplitBucket = i;
+        }
+    }
+
+    // Compare against the cost of intersecting every primitive in a single leaf
+    size_t primitivesCount = end - start;
+    float leafCost = settings.intersectionCost * float(primitivesCount);
+    float splitCost = settings.traversalCost + settings.intersectionCost * minCost / bounds.SurfaceArea();
+    if (primitivesCount <= size_t(glm::max(settings.maxPrimsInNode, 1)) && leafCost <= splitCost)
+    {
+        *makeLeaf = true;
+        return start;
+    }
+
+    BVHPrimitiveInfo* pmid = std::partition(
+        &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+        [&](const BVHPrimitiveInfo& info)
+        {
+            return BucketIndex(info) <= minCostSplitBucket;
+        }
+    );
+    return size_t(pmid - &primitiveInfo[0]);
+}
+
+BVH_Node* BVH::SpatialSplitBuild(std::vector<BVHPrimitiveInfo>& references, std::vector<BVHPrimitiveInfo>& leafReferences,
+    float rootArea, int* splitBudget, std::atomic<int>* nodeCount)
+{
+    // Split BVH (Stich et al. 2009): besides the binned object split of SplitSAH, bin space
+    // itself along the longest axis and clip every reference to the bins it overlaps. A
+    // spatial split duplicates the references straddling its plane, so it is only taken where
+    // it beats the object split, and only while splitBudget has references left to spend.
+    BVH_Node* node = m_NodeArena.Allocate();
+    (*nodeCount)++;
+
+    AABB bounds;
+    AABB centroidBounds;
+    ComputeBounds(references, 0, references.size(), &bounds, &centroidBounds);
+
+    size_t primitivesCount = references.size();
+    size_t maxPrimsInNode = size_t(glm::max(settings.maxPrimsInNode, 1));
+
+    auto MakeLeaf = [&]()
+    {
+        size_t start = leafReferences.size();
+        leafReferences.insert(leafReferences.end(), references.begin(), references.end());
+        CreateLeaf(node, start, leafReferences.size(), bounds);
+        return node;
+    };
+
+    if (primitivesCount == 1)
+        return MakeLeaf();
+
+    const int nBuckets = glm::max(settings.nBuckets, 2);
+
+    // Object split over the centroids, as in SplitSAH
+    struct BucketInfo
+    {
+        int count = 0;
+        AABB bounds;
+    };
+
+    int objectAxis = centroidBounds.LongestAxis();
+    float objectCost = FLT_MAX;
+    int objectBucket = 0;
+    AABB objectLeft, objectRight;
+    auto BucketIndex = [&](const BVHPrimitiveInfo& info)
+    {
+        int b = int(nBuckets * centroidBounds.Offset(info.centroid)[objectAxis]);
+        return glm::clamp(b, 0, nBuckets - 1);
+    };
+
+    if (centroidBounds.bMax[objectAxis] > centroidBounds.bMin[objectAxis])
+    {
+        std::vector<BucketInfo> buckets(nBuckets);
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            int b = BucketIndex(reference);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, reference.bounds);
+        }
+
+        std::vector<AABB> rightBounds(nBuckets);
+        std::vector<int> rightCounts(nBuckets, 0);
+        for (int i = nBuckets - 1; i > 0; --i)
+        {
+            rightBounds[i - 1] = Union(i < nBuckets - 1 ? rightBounds[i] : AABB(), buckets[i].bounds);
+            rightCounts[i - 1] = (i < nBuckets - 1 ? rightCounts[i] : 0) + buckets[i].count;
+        }
+
+        AABB bLeft;
+        int countLeft = 0;
+        for (int i = 0; i < nBuckets - 1; ++i)
+        {
+            bLeft = Union(bLeft, buckets[i].bounds);
+            countLeft += buckets[i].count;
+            if (countLeft == 0 || rightCounts[i] == 0)
+                continue;
+            float cost = countLeft * bLeft.SurfaceArea() + rightCounts[i] * rightBounds[i].SurfaceArea();
+            if (cost < objectCost)
+            {
+                objectCost = cost;
+                objectBucket = i;
+                objectLeft = bLeft;
+                objectRight = rightBounds[i];
+            }
+        }
+    }
+
+    // Spatial split, only worth evaluating where the object split's children overlap
+    struct SpatialBin
+    {
+        AABB bounds;
+        int entries = 0;
+        int exits = 0;
+    };
+
+    int spatialAxis = bounds.LongestAxis();
+    float spatialCost = FLT_MAX;
+    float splitPosition = 0.0f;
+    AABB overlap;
+    overlap.bMin = glm::max(objectLeft.bMin, objectRight.bMin);
+    overlap.bMax = glm::min(objectLeft.bMax, objectRight.bMax);
+    bool overlapping = objectCost == FLT_MAX ||
+        (glm::all(glm::lessThan(overlap.bMin, overlap.bMax)) && overlap.SurfaceArea() > settings.spatialSplitAlpha * rootArea);
+
+    float binOrigin = bounds.bMin[spatialAxis];
+    float binWidth = (bounds.bMax[spatialAxis] - binOrigin) / float(nBuckets);
+    if (*splitBudget > 0 && overlapping && binWidth > 0.0f)
+    {
+        std::vector<SpatialBin> bins(nBuckets);
+        auto BinIndex = [&](float p)
+        {
+            return glm::clamp(int((p - binOrigin) / binWidth), 0, nBuckets - 1);
+        };
+
+        // Each reference enters the first bin it overlaps and exits the last, and adds its
+        // part clipped to every bin in between
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            int first = BinIndex(reference.bounds.bMin[spatialAxis]);
+            int last = BinIndex(reference.bounds.bMax[spatialAxis]);
+            for (int b = first; b <= last; ++b)
+            {
+                AABB clipped = first == last ? reference.bounds :
+                    ClipReference(reference, spatialAxis, binOrigin + b * binWidth, binOrigin + (b + 1) * binWidth);
+                bins[b].bounds = Union(bins[b].bounds, clipped);
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        std::vector<AABB> rightBounds(nBuckets);
+        std::vector<int> rightCounts(nBuckets, 0);
+        for (int i = nBuckets - 1; i > 0; --i)
+        {
+            rightBounds[i - 1] = Union(i < nBuckets - 1 ? rightBounds[i] : AABB(), bins[i].bounds);
+            rightCounts[i - 1] = (i < nBuckets - 1 ? rightCounts[i] : 0) + bins[i].exits;
+        }
+
+        AABB bLeft;
+        int countLeft = 0;
+        for (int i = 0; i < nBuckets - 1; ++i)
+        {
+            bLeft = Union(bLeft, bins[i].bounds);
+            countLeft += bins[i].entries;
+            if (countLeft == 0 || rightCounts[i] == 0)
+                continue;
+            float cost = countLeft * bLeft.SurfaceArea() + rightCounts[i] * rightBounds[i].SurfaceArea();
+            if (cost < spatialCost)
+            {
+                spatialCost = cost;
+                splitPosition = binOrigin + (i + 1) * binWidth;
+            }
+        }
+    }
+
+    // Compare against the cost of intersecting every reference in a single leaf
+    float minCost = glm::min(objectCost, spatialCost);
+    if (minCost == FLT_MAX)
+    {
+        if (primitivesCount <= maxPrimsInNode)
+            return MakeLeaf();
+    }
+    else
+    {
+        float leafCost = settings.intersectionCost * float(primitivesCount);
+        float splitCost = settings.traversalCost + settings.intersectionCost * minCost / bounds.SurfaceArea();
+        if (primitivesCount <= maxPrimsInNode && leafCost <= splitCost)
+            return MakeLeaf();
+    }
+
+    std::vector<BVHPrimitiveInfo> leftReferences;
+    std::vector<BVHPrimitiveInfo> rightReferences;
+    int axis = objectAxis;
+    if (spatialCost < objectCost)
+    {
+        axis = spatialAxis;
+        for (const BVHPrimitiveInfo& reference : references)
+        {
+            if (reference.bounds.bMax[axis] <= splitPosition)
+            {
+                leftReferences.push_back(reference);
+            }
+            else if (reference.bounds.bMin[axis] >= splitPosition)
+            {
+                rightReferences.push_back(reference);
+            }
+            else if (*splitBudget > 0)
+            {
+                // Straddles the plane, so it is referenced from both sides with clipped bounds.
+                // A side the primitive does not actually reach into is left out.
+                AABB leftBounds = ClipReference(reference, axis, reference.bounds.bMin[axis], splitPosition);
+                AABB rightBounds = ClipReference(reference, axis, splitPosition, reference.bounds.bMax[axis]);
+                bool inLeft = glm::all(glm::lessThanEqual(leftBounds.bMin, leftBounds.bMax));
+                bool inRight = glm::all(glm::lessThanEqual(rightBounds.bMin, rightBounds.bMax));
+                if (inLeft)
+                    leftReferences.push_back({reference.primitiveNumber, leftBounds});
+                if (inRight)
+                    rightReferences.push_back({reference.primitiveNumber, rightBounds});
+                if (inLeft && inRight)
+                    (*splitBudget)--;
+                else if (!inLeft && !inRight)
+                    (reference.centroid[axis] < splitPosition ? leftReferences : rightReferences).push_back(reference);
+            }
+            else
+            {
+                // Out of budget, keep the whole reference on the side of its centroid
+                (reference.centroid[axis] < splitPosition ? leftReferences : rightReferences).push_back(reference);
+            }
+        }
+    }
+
+    if (leftReferences.empty() || rightReferences.empty())
+    {
+        leftReferences.clear();
+        rightReferences.clear();
+        axis = objectAxis;
+        if (objectCost < FLT_MAX)
+        {
+            for (const BVHPrimitiveInfo& reference : references)
+                (BucketIndex(reference) <= objectBucket ? leftReferences : rightReferences).push_back(reference);
+        }
+        else
+        {
+            // Coincident centroids, fall back to splitting into equally sized halves
+            size_t mid = primitivesCount / 2;
+            std::nth_element(references.begin(), references.begin() + mid, references.end(),
+                [axis](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b)
+                {
+                    return a.centroid[axis] < b.centroid[axis];
+                }
+            );
+            leftReferences.assign(references.begin(), references.begin() + mid);
+            rightReferences.assign(references.begin() + mid, references.end());
+        }
+    }
+
+    // The children's references are copies, release this node's before descending
+    std::vector<BVHPrimitiveInfo>().swap(references);
+    BVH_Node* left = SpatialSplitBuild(leftReferences, leafReferences, rootArea, splitBudget, nodeCount);
+    BVH_Node* right = SpatialSplitBuild(rightReferences, leafReferences, rootArea, splitBudget, nodeCount);
+    InitInterior(node, axis, left, right);
+    return node;
+}
+
+AABB BVH::ClipReference(const BVHPrimitiveInfo& reference, int axis, float lo, float hi) const
+{
+    // Without the primitives, e.g. for a TLAS over instance boxes, the boxes themselves are clipped
+    AABB clipped = reference.bounds;
+    if (m_BuildPrimitives != nullptr)
+        (*m_BuildPrimitives)[reference.primitiveNumber].ClippedBoundingBox(axis, lo, hi, &clipped);
+
+    // Never grow past the reference's own bounds, which may already have been clipped
+    clipped.bMin = glm::max(clipped.bMin, reference.bounds.bMin);
+    clipped.bMax = glm::min(clipped.bMax, reference.bounds.bMax);
+    clipped.bMin[axis] = glm::max(clipped.bMin[axis], lo);
+    clipped.bMax[axis] = glm::min(clipped.bMax[axis], hi);
+    return clipped;
+}
+
+float BVH::ComputeSAHCost() const
+{
+    if (bvh_root == nullptr)
+        return 0.0f;
+
+    float rootArea = bvh_root->bbox.SurfaceArea();
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    return NodeSAHCost(bvh_root) / rootArea;
+}
+
+BVHStats BVH::ComputeStats() const
+{
+    BVHStats stats;
+    stats.sahCost = sahCost;
+    stats.totalNodes = liveNodes;
+    stats.buildTimes = buildTimes;
+    stats.loadedFromCache = b_LoadedFromCache;
+    if (bvh_root == nullptr)
+        return stats;
+
+    GatherStats(bvh_root, 0, &stats);
+
+    int depthSum = 0;
+    for (size_t depth = 0; depth < stats.depthHistogram.size(); ++depth)
+        depthSum += int(depth) * stats.depthHistogram[depth];
+    stats.maxDepth = int(stats.depthHistogram.size()) - 1;
+    stats.averageLeafDepth = float(depthSum) / float(stats.leafCount);
+
+    float rootArea = bvh_root->bbox.SurfaceArea();
+    int interiorCount = liveNodes - stats.leafCount;
+    stats.totalOverlap = rootArea > 0.0f ? stats.totalOverlap / rootArea : 0.0f;
+    stats.averageOverlap = interiorCount > 0 ? stats.totalOverlap / float(interiorCount) : 0.0f;
+
+    stats.treeBytes = m_NodeArena.Capacity() * sizeof(BVH_Node);
+    stats.flatBytes = size_t(totalNodes) * sizeof(LinearBVH_Node) + primitivesIndexBuffer.size() * sizeof(int);
+    stats.layoutBytes = flatBVH4.size() * sizeof(LinearBVH4_Node) + flatQuantized.size() * sizeof(LinearQuantizedBVH_Node)
+        + flatStackless.size() * sizeof(LinearStacklessBVH_Node);
+    return stats;
+}
+
+void BVH::GatherStats(const BVH_Node* node, int depth, BVHStats* stats) const
+{
+    if (node->type == node_t::LEAF)
+    {
+        if (depth >= (int) stats->depthHistogram.size())
+            stats->depthHistogram.resize(depth + 1, 0);
+        if (node->nPrimitives >= (int) stats->leafSizeHistogram.size())
+            stats->leafSizeHistogram.resize(node->nPrimitives + 1, 0);
+        stats->depthHistogram[depth]++;
+        stats->leafSizeHistogram[node->nPrimitives]++;
+        stats->leafCount++;
+        return;
+    }
+
+    // Rays through the shared region have to descend into both children
+    AABB overlap;
+    overlap.bMin = glm::max(node->left->bbox.bMin, node->right->bbox.bMin);
+    overlap.bMax = glm::min(node->left->bbox.bMax, node->right->bbox.bMax);
+    if (glm::all(glm::lessThanEqual(overlap.bMin, overlap.bMax)))
+        stats->totalOverlap += overlap.SurfaceArea();
+
+    GatherStats(node->left, depth + 1, stats);
+    GatherStats(node->right, depth + 1, stats);
+}
+
+std::string BVHStats::ToJSON() const
+{
+    auto Histogram = [](const std::vector<int>& values)
+    {
+        std::string list = "[";
+        for (size_t i = 0; i < values.size(); ++i)
+            list += (i > 0 ? ", " : "") + std::to_string(values[i]);
+        return list + "]";
+    };
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"sahCost\": " << sahCost << ",\n"
+         << "  \"totalNodes\": " << totalNodes << ",\n"
+         << "  \"leafCount\": " << leafCount << ",\n"
+         << "  \"maxDepth\": " << maxDepth << ",\n"
+         << "  \"averageLeafDepth\": " << averageLeafDepth << ",\n"
+         << "  \"depthHistogram\": " << Histogram(depthHistogram) << ",\n"
+         << "  \"leafSizeHistogram\": " << Histogram(leafSizeHistogram) << ",\n"
+         << "  \"totalOverlap\": " << totalOverlap << ",\n"
+         << "  \"averageOverlap\": " << averageOverlap << ",\n"
+         << "  \"memory\": { \"treeBytes\": " << treeBytes << ", \"flatBytes\": " << flatBytes
+         << ", \"layoutBytes\": " << layoutBytes << " },\n"
+         << "  \"buildTimeMs\": { \"bounds\": " << buildTimes.bounds << ", \"topology\": " << buildTimes.topology
+         << ", \"flatten\": " << buildTimes.flatten << ", \"layouts\": " << buildTimes.layouts
+         << ", \"total\": " << buildTimes.total << " },\n"
+         << "  \"loadedFromCache\": " << (loadedFromCache ? "true" : "false") << "\n"
+         << "}\n";
+    return json.str();
+}
+
+float BVH::NodeSAHCost(const BVH_Node* node) const
+{
+    // Sum of each node's cost weighted by its surface area, i.e. the probability that a
+    // random ray hitting the root also hits this node
+    if (node->type == node_t::LEAF)
+        return settings.intersectionCost * node->nPrimitives * node->bbox.SurfaceArea();
+
+    return settings.traversalCost * node->bbox.SurfaceArea()
+        + NodeSAHCost(node->left)
+        + NodeSAHCost(node->right);
+}
+
+int BVH::FlattenBVHTree(BVH_Node* node, int* offset)
+{
+    // Depth-first order, the first child directly follows its parent
+    int myOffset = (*offset)++;
+    node->flatIndex = myOffset;
+    if (node->type == node_t::PARENT)
+    {
+        FlattenBVHTree(node->left, offset);
+        FlattenBVHTree(node->right, offset);
+    }
+    WriteFlatNode(node);
+    return myOffset;
+}
+
+void BVH::FlattenTreelets(BVH_Node* root)
+{
+    // Grow each treelet from its root by repeatedly taking the frontier node with the largest
+    // surface area, i.e. the one a ray that entered the treelet most likely visits next.
+    // Frontier nodes left over once the treelet is full become roots of later treelets,
+    // which are laid out breadth first so the top of the tree stays together as well.
+    int offset = 0;
+    std::vector<BVH_Node*> treeletRoots = { root };
+    std::vector<BVH_Node*> frontier;
+    for (size_t t = 0; t < treeletRoots.size(); ++t)
+    {
+        frontier.assign(1, treeletRoots[t]);
+        for (int n = 0; n < settings.treeletSize && !frontier.empty(); ++n)
+        {
+            auto best = std::max_element(frontier.begin(), frontier.end(), [](const BVH_Node* a, const BVH_Node* b)
+            {
+                return a->bbox.SurfaceArea() < b->bbox.SurfaceArea();
+            });
+            BVH_Node* node = *best;
+            *best = frontier.back();
+            frontier.pop_back();
+
+            node->flatIndex = offset++;
+            if (node->type == node_t::PARENT)
+            {
+                frontier.push_back(node->left);
+                frontier.push_back(node->right);
+            }
+        }
+        treeletRoots.insert(treeletRoots.end(), frontier.begin(), frontier.end());
+    }
+    WriteFlatNodes(root);
+}
+
+void BVH::WriteFlatNodes(const BVH_Node* node)
+{
+    WriteFlatNode(node);
+    if (node->type == node_t::PARENT)
+    {
+        WriteFlatNodes(node->left);
+        WriteFlatNodes(node->right);
+    }
+}
+
+void BVH::WriteFlatNode(const BVH_Node* node)
+{
+    LinearBVH_Node* linearNode = &flat_root[node->flatIndex];
+    *linearNode = LinearBVH_Node();
     linearNode->bMin = glm::vec4(node->bbox.bMin, -1);
     linearNode->bMax = glm::vec4(node->bbox.bMax, -1);
-    int myOffset = (*offset)++;
     if (node->type == node_t::LEAF)
     {
         linearNode->primitiveOffset = node->primitiveOffset; 
-		linearNode->primitiveCount = 1; 
-
-	}
-	else
-	{  
+        linearNode->primitiveCount = node->nPrimitives; 
+    }
+    else
+    {  
+        // Child links are stored in the w components
         linearNode->axis = node->axis;
-		linearNode->primitiveCount = 0;
-		int firstChildOffset = FlattenBVHTree(flatten, node->left, offset);
-		linearNode->bMin.w = float(firstChildOffset);
-		linearNode->secondChildOffset = FlattenBVHTree(flatten, node->right, offset);
-		linearNode->bMax.w = float(linearNode->secondChildOffset);
-
-	}
-	return myOffset;
+        linearNode->primitiveCount = 0;
+        linearNode->bMin.w = float(node->left->flatIndex);
+        linearNode->secondChildOffset = node->right->flatIndex;
+        linearNode->bMax.w = float(linearNode->secondChildOffset);
+    }
+    dirtyNodes.Add(node->flatIndex);
+}
+
+void BVH::SetLayout(int layout)
+{
+    // Only the selected layout is kept, so a newly selected one is always derived
+    if (layout == m_Layout)
+        return;
+    m_Layout = layout;
+    DeriveLayout(layout);
+}
+
+bool BVH::SupportsLayout(int layout) const
+{
+    // Every stackless leaf has to be able to address its first primitive reference
+    if (layout == BVH_LAYOUT_STACKLESS)
+        return primitivesIndexBuffer.size() <= size_t(STACKLESS_MAX_PRIMITIVE_OFFSET) + 1;
+    return true;
+}
+
+void BVH::UpdateLayouts()
+{
+    // The layouts are cheap to derive but not free, so after a change to the binary tree only
+    // the one being traversed is regenerated from scratch. The others are dropped and derived
+    // again once they are selected.
+    flatBVH4.clear();
+    flatQuantized.clear();
+    flatStackless.clear();
+    DeriveLayout(m_Layout);
+    revision++;
+}
+
+void BVH::DeriveLayout(int layout)
+{
+    if (layout == BVH_LAYOUT_BINARY)
+        return;
+
+    flatBVH4.clear();
+    flatQuantized.clear();
+    flatStackless.clear();
+    if (bvh_root == nullptr)
+    {
+        // Empty trees in the same sense as WriteEmptyTree: a node whose four slots are all
+        // empty, a leaf without primitives and a node whose miss link ends traversal
+        LinearQuantizedBVH_Node emptyLeaf;
+        emptyLeaf.meta = QUANTIZED_LEAF;
+        if (layout == BVH_LAYOUT_BVH4)
+            flatBVH4.emplace_back();
+        else if (layout == BVH_LAYOUT_QUANTIZED)
+            flatQuantized.push_back(emptyLeaf);
+        else
+            flatStackless.emplace_back();
+    }
+    else if (layout == BVH_LAYOUT_BVH4)
+    {
+        FlattenBVH4(bvh_root);
+    }
+    else if (layout == BVH_LAYOUT_QUANTIZED)
+    {
+        flatQuantized.emplace_back();
+        FlattenQuantized(bvh_root, 0);
+    }
+    else if (SupportsLayout(BVH_LAYOUT_STACKLESS))
+    {
+        FlattenStackless(bvh_root);
+        // Subtrees ending at the last node have nowhere left to go
+        for (LinearStacklessBVH_Node& stacklessNode : flatStackless)
+            if (stacklessNode.missLink == (int) flatStackless.size())
+                stacklessNode.missLink = -1;
+    }
+    else
+    {
+        // A layout the scene is too large for is left empty, the application switches away from it
+        flatStackless.emplace_back();
+    }
+    b_LayoutChanged = true;
+}
+
+int BVH::FlattenBVH4(const BVH_Node* node)
+{
+    // Pull grandchildren up into the node until it has four children, always opening the
+    // interior child with the largest surface area since it is the most likely to be hit
+    const BVH_Node* children[4] = { node };
+    int nChildren = 1;
+    if (node->type == node_t::PARENT)
+    {
+        children[0] = node->left;
+        children[1] = node->right;
+        nChildren = 2;
+    }
+    while (nChildren < 4)
+    {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < nChildren; ++i)
+        {
+            float area = children[i]->bbox.SurfaceArea();
+            if (children[i]->type == node_t::PARENT && area > bestArea)
+            {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1)
+            break;
+
+        const BVH_Node* expanded = children[best];
+        children[best] = expanded->left;
+        children[nChildren++] = expanded->right;
+    }
+
+    // Depth-first order with the root at 0, children are written once their subtrees are placed
+    int myOffset = (int) flatBVH4.size();
+    flatBVH4.emplace_back();
+
+    LinearBVH4_Node wideNode;
+    for (int i = 0; i < nChildren; ++i)
+    {
+        const AABB& bbox = children[i]->bbox;
+        wideNode.bMinX[i] = bbox.bMin.x;
+        wideNode.bMinY[i] = bbox.bMin.y;
+        wideNode.bMinZ[i] = bbox.bMin.z;
+        wideNode.bMaxX[i] = bbox.bMax.x;
+        wideNode.bMaxY[i] = bbox.bMax.y;
+        wideNode.bMaxZ[i] = bbox.bMax.z;
+        if (children[i]->type == node_t::LEAF)
+        {
+            wideNode.child[i] = children[i]->primitiveOffset;
+            wideNode.count[i] = children[i]->nPrimitives;
+        }
+        else
+        {
+            wideNode.child[i] = FlattenBVH4(children[i]);
+            wideNode.count[i] = 0;
+        }
+    }
+    flatBVH4[myOffset] = wideNode;
+    return myOffset;
+}
+
+void BVH::FlattenQuantized(const BVH_Node* node, int slot)
+{
+    // Siblings are stored next to each other so a node only needs the index of its first child
+    LinearQuantizedBVH_Node quantizedNode;
+    if (node->type == node_t::LEAF)
+    {
+        quantizedNode.meta = QUANTIZED_LEAF | uint32_t(node->nPrimitives);
+        quantizedNode.data.w = uint32_t(node->primitiveOffset);
+        flatQuantized[slot] = quantizedNode;
+        return;
+    }
+
+    // The frame spans the node's box with a power-of-two step per axis, so that
+    // 255 steps cover the whole extent and decoding never rounds the scale
+    const AABB& bbox = node->bbox;
+    glm::vec3 origin = bbox.bMin;
+    glm::vec3 scale;
+    uint32_t exponents[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        int e = -126;
+        float extent = bbox.bMax[a] - origin[a];
+        if (extent > 0.0f)
+            e = std::max(e, (int) std::ceil(std::log2(extent / 255.0f)));
+        while (origin[a] + 255.0f * std::ldexp(1.0f, e) < bbox.bMax[a])
+            e++;
+        exponents[a] = uint32_t(e + 127);
+        scale[a] = std::ldexp(1.0f, e);
+    }
+
+    // Round outwards and nudge past any rounding in the decode, origin + q * scale,
+    // so the decoded boxes always enclose the children
+    uint8_t bytes[12];
+    const BVH_Node* children[2] = { node->left, node->right };
+    for (int c = 0; c < 2; ++c)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float lo = children[c]->bbox.bMin[a];
+            float hi = children[c]->bbox.bMax[a];
+            int qMin = (int) glm::clamp(std::floor((lo - origin[a]) / scale[a]), 0.0f, 255.0f);
+            int qMax = (int) glm::clamp(std::ceil((hi - origin[a]) / scale[a]), 0.0f, 255.0f);
+            while (qMin > 0 && origin[a] + float(qMin) * scale[a] > lo)
+                qMin--;
+            while (qMax < 255 && origin[a] + float(qMax) * scale[a] < hi)
+                qMax++;
+            bytes[c * 6 + a] = uint8_t(qMin);
+            bytes[c * 6 + 3 + a] = uint8_t(qMax);
+        }
+    }
+    for (int i = 0; i < 12; ++i)
+        quantizedNode.data[i / 4] |= uint32_t(bytes[i]) << ((i % 4) * 8);
+
+    int firstChild = (int) flatQuantized.size();
+    flatQuantized.resize(firstChild + 2);
+    quantizedNode.origin = origin;
+    quantizedNode.meta = exponents[0] | (exponents[1] << 8) | (exponents[2] << 16) | (uint32_t(node->axis) << 24);
+    quantizedNode.data.w = uint32_t(firstChild);
+    flatQuantized[slot] = quantizedNode;
+
+    FlattenQuantized(node->left, firstChild);
+    FlattenQuantized(node->right, firstChild + 1);
+}
+
+BVHCacheStats BVH::MeasureCacheMisses(int nRays, int cacheLines) const
+{
+    // Traces random rays through the flattened nodes the way the shader does, treating leaf
+    // boxes as the surfaces that end a ray, and feeds every node fetch through a small LRU
+    // cache of 64-byte lines. Deterministic, so two node orders can be compared directly.
+    BVHCacheStats stats;
+    if (bvh_root == nullptr || nRays <= 0)
+        return stats;
+
+    const size_t lineSize = 64;
+    std::vector<size_t> cache;   // Most recently used line at the back
+    size_t fetches = 0, misses = 0;
+    auto Fetch = [&](int nodeIndex)
+    {
+        fetches++;
+        size_t first = nodeIndex * sizeof(LinearBVH_Node) / lineSize;
+        size_t last = ((nodeIndex + 1) * sizeof(LinearBVH_Node) - 1) / lineSize;
+        for (size_t line = first; line <= last; ++line)
+        {
+            auto it = std::find(cache.begin(), cache.end(), line);
+            if (it != cache.end())
+            {
+                cache.erase(it);
+            }
+            else
+            {
+                misses++;
+                if ((int) cache.size() == cacheLines)
+                    cache.erase(cache.begin());
+            }
+            cache.push_back(line);
+        }
+    };
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    const AABB& sceneBounds = bvh_root->bbox;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<int> nodesToVisit;
+    for (int r = 0; r < nRays; ++r)
+    {
+        glm::vec3 origin = glm::mix(sceneBounds.bMin, sceneBounds.bMax, glm::vec3(uniform(rng), uniform(rng), uniform(rng)));
+        float z = 1.0f - 2.0f * uniform(rng);
+        float phi = 2.0f * 3.14159265f * uniform(rng);
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        glm::vec3 invDir = 1.0f / glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), z);
+        int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+        float tMax = FLT_MAX;
+        int currentNodeIndex = 0;
+        nodesToVisit.clear();
+        while (true)
+        {
+            Fetch(currentNodeIndex);
+            const LinearBVH_Node& node = flat_root[currentNodeIndex];
+            glm::vec3 t0 = (glm::vec3(node.bMin) - origin) * invDir;
+            glm::vec3 t1 = (glm::vec3(node.bMax) - origin) * invDir;
+            glm::vec3 tNear3 = glm::min(t0, t1);
+            glm::vec3 tFar3 = glm::max(t0, t1);
+            float tNear = std::max(std::max(tNear3.x, tNear3.y), std::max(tNear3.z, 0.0f));
+            float tFar = std::min(std::min(tFar3.x, tFar3.y), std::min(tFar3.z, tMax));
+
+            if (tNear <= tFar && node.primitiveCount == 0)
+            {
+                int first = int(node.bMin.w);
+                int second = int(node.bMax.w);
+                nodesToVisit.push_back(dirIsNeg[node.axis] ? first : second);
+                currentNodeIndex = dirIsNeg[node.axis] ? second : first;
+                continue;
+            }
+            if (tNear <= tFar)
+                tMax = tNear;
+
+            if (nodesToVisit.empty())
+                break;
+            currentNodeIndex = nodesToVisit.back();
+            nodesToVisit.pop_back();
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    stats.nodeFetchesPerRay = float(fetches) / nRays;
+    stats.cacheMissesPerRay = float(misses) / nRays;
+    stats.milliseconds = std::chrono::duration<float, std::milli>(end - start).count();
+    return stats;
+}
+
+void BVH::FlattenStackless(const BVH_Node* node)
+{
+    // Depth-first, so a node's subtree is the range that follows it and the miss link is
+    // simply the first index past that range
+    LinearStacklessBVH_Node stacklessNode;
+    stacklessNode.bMin = node->bbox.bMin;
+    stacklessNode.bMax = node->bbox.bMax;
+
+    if (node->type == node_t::LEAF)
+    {
+        // The count only has 8 bits, so larger leaves (LBVH leaves that ran out of Morton bits
+        // hold any number of primitives) become a chain of leaves sharing the same box
+        int first = node->primitiveOffset;
+        int remaining = node->nPrimitives;
+        do
+        {
+            int count = glm::min(remaining, STACKLESS_MAX_LEAF_PRIMITIVES);
+            assert(uint32_t(first) <= STACKLESS_MAX_PRIMITIVE_OFFSET);
+            stacklessNode.primitiveData = (uint32_t(first) << 8) | uint32_t(count);
+            stacklessNode.missLink = (int) flatStackless.size() + 1;
+            flatStackless.push_back(stacklessNode);
+            first += count;
+            remaining -= count;
+        } while (remaining > 0);
+        return;
+    }
+
+    int myOffset = (int) flatStackless.size();
+    flatStackless.push_back(stacklessNode);
+    FlattenStackless(node->left);
+    FlattenStackless(node->right);
+    flatStackless[myOffset].missLink = (int) flatStackless.size();
 }
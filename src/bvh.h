@@ -1,16 +1,87 @@
 #pragma once
 
 #include "primitives.h"
+#include "utils.h"
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
 
 // Differentiate between nodes and leaves of BVH tree
 enum node_t { PARENT, LEAF };
 
+// Strategy used to partition primitives at each interior node. The linear builders sort
+// primitives along a Morton curve instead of partitioning top-down; HLBVH additionally
+// joins the resulting treelets with the SAH. SBVH also considers spatial splits, which
+// clip a primitive straddling the split plane and reference it from both sides.
+enum split_t { SPLIT_EQUAL_COUNTS, SPLIT_SAH, SPLIT_LBVH, SPLIT_HLBVH, SPLIT_SBVH };
+
+// Order of the nodes in the flattened array. Treelet order packs each node together with
+// the descendants a ray reaching it is most likely to visit next.
+enum node_order_t { ORDER_DEPTH_FIRST, ORDER_TREELET };
+
+struct BVHBuildSettings
+{
+    split_t splitMethod = SPLIT_SAH;
+    int nBuckets = 12;               // Number of bins the centroid extent is divided into when evaluating the SAH
+    float traversalCost = 0.125f;    // Cost of a ray-box slab test relative to a primitive intersection
+    float intersectionCost = 1.0f;   // Cost of a ray-primitive intersection
+    int maxPrimsInNode = 4;          // Upper bound on leaf size, smaller leaves are still made when the SAH prefers them
+    int parallelThreshold = 4096;    // Subtrees spanning at least this many primitives are built as separate tasks, near the root only
+    float refitRebuildRatio = 1.5f;  // Refit falls back to a full rebuild once the SAH cost exceeds this multiple of the last build's
+    node_order_t nodeOrder = ORDER_DEPTH_FIRST;
+    int treeletSize = 4;             // Nodes per treelet, four 48-byte nodes fill exactly three 64-byte cache lines
+    float spatialSplitBudget = 0.5f; // Extra primitive references spatial splits may create, as a fraction of the primitive count
+    float spatialSplitAlpha = 1e-5f; // Spatial splits are only tried where the object split's children overlap by more than this fraction of the root's area
+};
+
+// Result of tracing random rays against the flattened nodes on the CPU
+struct BVHCacheStats
+{
+    float nodeFetchesPerRay = 0.0f;
+    float cacheMissesPerRay = 0.0f;  // Cache lines missed in a simulated fully associative LRU cache
+    float milliseconds = 0.0f;
+};
+
+// Time spent in each phase of the last build, in milliseconds
+struct BVHBuildTimes
+{
+    float bounds = 0.0f;     // Bounding boxes of the primitives
+    float topology = 0.0f;   // Splitting the primitives into the node tree
+    float flatten = 0.0f;    // Index buffer and binary node array
+    float layouts = 0.0f;    // BVH4, quantized and stackless copies
+    float total = 0.0f;      // Everything, or the whole load for a tree read from the cache
+};
+
+// Quality report of the current tree, see BVH::ComputeStats()
+struct BVHStats
+{
+    float sahCost = 0.0f;
+    int totalNodes = 0;
+    int leafCount = 0;
+    int maxDepth = 0;
+    float averageLeafDepth = 0.0f;
+    std::vector<int> depthHistogram;     // Leaves at each depth, the root being at depth 0
+    std::vector<int> leafSizeHistogram;  // Leaves holding each number of primitives
+    float totalOverlap = 0.0f;           // Surface area shared by sibling boxes, summed over interior nodes, relative to the root's
+    float averageOverlap = 0.0f;         // totalOverlap per interior node
+    size_t treeBytes = 0;                // Pointer tree kept on the CPU
+    size_t flatBytes = 0;                // Binary nodes and index buffer uploaded to the GPU
+    size_t layoutBytes = 0;              // Copy in the selected BVH4, quantized or stackless layout
+    BVHBuildTimes buildTimes;
+    bool loadedFromCache = false;
+
+    std::string ToJSON() const;
+};
+
 struct BVH_Node 
 {
     node_t type;
     int primitiveOffset; // 'Pointer' to the primitive in the corresponding list of primitives
+    int nPrimitives;
     int axis;
+    int flatIndex;       // Position of this node in the flattened array
+    BVH_Node* parent;
     BVH_Node* left;
     BVH_Node* right;
     AABB bbox;
@@ -26,27 +97,211 @@ struct LinearBVH_Node
     int axis = -1;
 };
 
-struct BVHPrimitiveInfo;
+// Node of the collapsed 4-wide BVH. The bounds of all four children are stored as
+// structure-of-arrays so the shader can test them with a single set of vec4 slab tests.
+struct LinearBVH4_Node
+{
+    glm::vec4 bMinX = glm::vec4();
+    glm::vec4 bMinY = glm::vec4();
+    glm::vec4 bMinZ = glm::vec4();
+    glm::vec4 bMaxX = glm::vec4();
+    glm::vec4 bMaxY = glm::vec4();
+    glm::vec4 bMaxZ = glm::vec4();
+    glm::ivec4 child = glm::ivec4(0);     // Node index of an interior child, primitive offset of a leaf child
+    glm::ivec4 count = glm::ivec4(-1);    // Primitives in a leaf child, 0 for an interior child, -1 for an empty slot
+};
+
+// Compressed binary node, 32 bytes instead of the 48 of LinearBVH_Node. An interior node
+// stores the boxes of both children as 8-bit offsets from its own box, whose lower corner
+// and per-axis power-of-two step make up the quantization frame. Children are stored next
+// to each other and links are integers, so they do not lose precision above 2^24 nodes.
+struct LinearQuantizedBVH_Node
+{
+    glm::vec3 origin = glm::vec3();
+    uint32_t meta = 0;                   // Interior: biased exponents x | y << 8 | z << 16 | axis << 24. Leaf: QUANTIZED_LEAF | primitive count
+    glm::uvec4 data = glm::uvec4(0);     // xyz: child min/max bytes, child 0 then child 1. w: first child index or primitive offset
+};
+
+const uint32_t QUANTIZED_LEAF = 0x80000000u;
+
+// Node of the threaded (stackless) layout. Nodes are in depth-first order so a hit always
+// continues with the next node, and a miss, or the end of a leaf, jumps to missLink, the
+// first node after the subtree. Traversal needs no stack but always visits left before right.
+struct LinearStacklessBVH_Node
+{
+    glm::vec3 bMin = glm::vec3();
+    int missLink = -1;               // -1 once there is nothing left to visit
+    glm::vec3 bMax = glm::vec3();
+    uint32_t primitiveData = 0;      // Leaf: primitive offset << 8 | primitive count. Interior: 0
+};
+
+// Limits of the packed primitiveData. Larger leaves are split into chains of leaves, scenes
+// with more primitive references than the offset can address fall back to another layout.
+const int STACKLESS_MAX_LEAF_PRIMITIVES = 0xFF;
+const uint32_t STACKLESS_MAX_PRIMITIVE_OFFSET = 0xFFFFFF;
+
+struct BVHPrimitiveInfo 
+{
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const AABB& bounds)
+        : primitiveNumber(primitiveNumber)
+        , bounds(bounds)
+        , centroid(.5f * bounds.bMin + .5f * bounds.bMax)
+    {};
+    size_t primitiveNumber;
+    AABB bounds;
+    glm::vec3 centroid;
+};
+
+struct MortonPrimitive
+{
+    int primitiveIndex;
+    uint32_t mortonCode;
+};
+
+struct LBVHTreelet
+{
+    size_t startIndex;
+    size_t nPrimitives;
+    BVH_Node* root;
+};
+
+// Hands out BVH_Nodes from fixed-size blocks. Blocks are kept when the arena is reset,
+// so rebuilding a tree of similar size performs no heap allocations. Nodes never move
+// once allocated. Allocate() may be called concurrently as long as the nodes it hands
+// out fit within the capacity passed to Reset() or Reserve() and no node was freed
+// since the last Reset().
+class BVHNodeArena
+{
+public:
+    void Reset(size_t capacity);
+    void Reserve(size_t capacity);
+    BVH_Node* Allocate();
+    // Returns a node unlinked from the tree, the next Allocate() hands it out again
+    void Free(BVH_Node* node);
+    size_t Size() const { return m_Used - m_FreeNodes.size(); }
+    size_t Capacity() const { return m_Blocks.size() * BLOCK_SIZE; }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1024;
+    std::vector<std::unique_ptr<BVH_Node[]>> m_Blocks;
+    std::vector<BVH_Node*> m_FreeNodes;
+    std::atomic<size_t> m_Used = 0;
+};
 
 class BVH
 {
 public:
     BVH() {};
-    BVH(std::vector<Primitive>& primitives);
-    ~BVH();
-    void RebuildBVH(std::vector<Primitive>& primitives);
+    BVH(const std::vector<Primitive>& primitives, const BVHBuildSettings& buildSettings = BVHBuildSettings());
+    BVH(const std::vector<AABB>& bounds, const BVHBuildSettings& buildSettings = BVHBuildSettings());
+    void RebuildBVH(const std::vector<Primitive>& primitives);
+    // Rebuilds over arbitrary boxes, e.g. instance bounds for a TLAS. Leaves index into
+    // bounds. Unlike RebuildBVH it does not log, so it can run every frame.
+    void BuildFromBounds(const std::vector<AABB>& bounds);
+    // Loads the tree written by an earlier build over the same geometry and settings from
+    // cacheDirectory, or builds it and writes it there. Returns true on a cache hit.
+    bool LoadOrBuild(const std::vector<Primitive>& primitives, const std::string& cacheDirectory);
+    bool Refit(const std::vector<Primitive>& primitives);
+    void Insert(const std::vector<Primitive>& primitives, int primitiveIndex);
+    // Call before the scene moves its last primitive into primitiveIndex
+    void Remove(const std::vector<Primitive>& primitives, int primitiveIndex);
+    void Clear();
+    float ComputeSAHCost() const;
+    BVHStats ComputeStats() const;
+    BVHCacheStats MeasureCacheMisses(int nRays, int cacheLines = 64) const;
+    // Selects the layout the renderer traverses, deriving it from the tree if it is out of date
+    void SetLayout(int layout);
+    int GetLayout() const { return m_Layout; }
+    // False for a layout whose packed fields cannot address every primitive reference of the tree
+    bool SupportsLayout(int layout) const;
 
 public:
     BVH_Node* bvh_root = nullptr;
     LinearBVH_Node* flat_root = nullptr;
     bool b_Rebuilt = false;
-    int totalNodes = 0;
+    int totalNodes = 0;              // Slots in flat_root, including the ones Remove freed
+    int liveNodes = 0;               // Nodes actually in the tree
     std::vector<int> primitivesIndexBuffer;
+    BVHBuildSettings settings;
+    float sahCost = 0.0f;
+    float builtSahCost = 0.0f;       // SAH cost straight after the last full build, the baseline for refits
+    int spatialSplits = 0;           // References added by spatial splits in the last build
+    BVHBuildTimes buildTimes;
+
+    // Parts of flat_root and primitivesIndexBuffer patched by Insert/Remove since the last upload.
+    // A full rebuild is signalled through b_Rebuilt instead.
+    DirtyRange dirtyNodes;
+    DirtySet dirtyIndices;
+
+    // Copies of the tree in the alternative GPU layouts. Only the one selected with SetLayout is
+    // kept up to date with the binary tree, the others stay empty until they are selected.
+    std::vector<LinearBVH4_Node> flatBVH4;
+    std::vector<LinearQuantizedBVH_Node> flatQuantized;
+    std::vector<LinearStacklessBVH_Node> flatStackless;
+    bool b_LayoutChanged = false;    // The selected alternative layout was derived again
+    uint32_t revision = 0;           // Bumped on every change to the tree, for caching derived data
+
+    bool b_LoadedFromCache = false;  // The last LoadOrBuild() skipped the build
 
 private:
+    void Build(const std::vector<Primitive>& primitives);
+    void Build(const std::vector<AABB>& bounds);
+    void RefitNode(BVH_Node* node, const std::vector<Primitive>& primitives);
     BVH_Node* RecursiveBuild(
-        std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end, int* nodeCount);
-    void DeleteBVHTree(BVH_Node* node);
-    int FlattenBVHTree(LinearBVH_Node* flatten, BVH_Node* root, int* offset);
+        std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end, int depth, std::atomic<int>* nodeCount);
+    void ComputeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end,
+        AABB* bounds, AABB* centroidBounds, bool parallel = true) const;
+    void CreateLeaf(BVH_Node* node, size_t start, size_t end, const AABB& bounds);
+    void InitInterior(BVH_Node* node, int axis, BVH_Node* left, BVH_Node* right);
+    BVH_Node* HLBVHBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, std::atomic<int>* nodeCount);
+    BVH_Node* EmitLBVH(const std::vector<BVHPrimitiveInfo>& primitiveInfo, const MortonPrimitive* mortonPrims,
+        size_t start, size_t nPrimitives, int bitIndex, int depth, std::atomic<int>* nodeCount);
+    BVH_Node* BuildUpperSAH(std::vector<BVH_Node*>& treeletRoots, size_t start, size_t end, std::atomic<int>* nodeCount);
+    size_t SplitSAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, size_t start, size_t end,
+        const AABB& bounds, const AABB& centroidBounds, int axis, bool* makeLeaf);
+    BVH_Node* SpatialSplitBuild(std::vector<BVHPrimitiveInfo>& references, std::vector<BVHPrimitiveInfo>& leafReferences,
+        float rootArea, int* splitBudget, std::atomic<int>* nodeCount);
+    AABB ClipReference(const BVHPrimitiveInfo& reference, int axis, float lo, float hi) const;
+    int FlattenBVHTree(BVH_Node* node, int* offset);
+    void FlattenTreelets(BVH_Node* root);
+    void WriteFlatNodes(const BVH_Node* node);
+    void WriteFlatNode(const BVH_Node* node);
+    void UpdateLayouts();
+    void DeriveLayout(int layout);
+    int FlattenBVH4(const BVH_Node* node);
+    void FlattenQuantized(const BVH_Node* node, int slot);
+    void FlattenStackless(const BVH_Node* node);
+    void IndexLeaves(BVH_Node* node);
+    void CollectLeaves(int primitiveIndex, std::vector<BVH_Node*>* leaves) const;
+    void FindLeaves(BVH_Node* node, int primitiveIndex, std::vector<BVH_Node*>* leaves) const;
+    void RemoveFromLeaf(BVH_Node* leaf, int primitiveIndex);
+    void WriteEmptyTree();
+    int AllocateFlatSlot();
+    int AllocateIndexSlot();
+    BVH_Node* FindBestSibling(const AABB& bounds) const;
+    void RefitAndRotateUp(BVH_Node* node);
+    void Rotate(BVH_Node* node);
+    void UpdateInterior(BVH_Node* node);
+    float NodeSAHCost(const BVH_Node* node) const;
+    void GatherStats(const BVH_Node* node, int depth, BVHStats* stats) const;
+    uint64_t CacheKey(const std::vector<Primitive>& primitives) const;
+    bool LoadCache(const std::string& path, const std::vector<Primitive>& primitives);
+    bool SaveCache(const std::string& path, const std::vector<Primitive>& primitives) const;
+    BVH_Node* RestoreNode(int flatIndex, std::vector<bool>& visited);
+
+    // Storage kept alive across rebuilds
+    BVHNodeArena m_NodeArena;
+    std::vector<LinearBVH_Node> m_FlatNodes;
+    std::vector<BVHPrimitiveInfo> m_PrimitiveInfo;
+    std::vector<AABB> m_PrimitiveBounds;
+    const std::vector<Primitive>* m_BuildPrimitives = nullptr;   // Geometry spatial splits clip against, if known
+
+    // Bookkeeping for incremental updates
+    std::vector<BVH_Node*> m_PrimitiveLeaves;   // Leaf holding each primitive, unused once spatial splits duplicate references
+    std::vector<int> m_FreeFlatSlots;
+    std::vector<int> m_FreeIndexSlots;
+
+    int m_Layout = BVH_LAYOUT_BINARY;
 };
 
@@ -0,0 +1,278 @@
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bvh.h"
+
+// Bump whenever the file layout, LinearBVH_Node or the builders change what they produce
+static const uint32_t BVH_CACHE_VERSION = 1;
+
+// File header, followed by totalNodes LinearBVH_Nodes and indexCount ints
+struct BVHCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;               // Hash of the primitive geometry and the build settings
+    uint32_t nodeSize;          // sizeof(LinearBVH_Node) of the writer
+    uint32_t primitiveCount;
+    uint32_t totalNodes;
+    uint32_t indexCount;
+};
+
+// Read-only view of a whole file, unmapped on destruction
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+    {
+#ifdef _WIN32
+        m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_File == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+            return;
+        m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_Mapping == nullptr)
+            return;
+        m_Data = MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_Data != nullptr)
+            m_Size = size_t(size.QuadPart);
+#else
+        m_FD = open(path.c_str(), O_RDONLY);
+        if (m_FD < 0)
+            return;
+        struct stat info;
+        if (fstat(m_FD, &info) != 0 || info.st_size == 0)
+            return;
+        void* data = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, m_FD, 0);
+        if (data == MAP_FAILED)
+            return;
+        m_Data = data;
+        m_Size = size_t(info.st_size);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (m_Data != nullptr) UnmapViewOfFile(m_Data);
+        if (m_Mapping != nullptr) CloseHandle(m_Mapping);
+        if (m_File != INVALID_HANDLE_VALUE) CloseHandle(m_File);
+#else
+        if (m_Data != nullptr) munmap(m_Data, m_Size);
+        if (m_FD >= 0) close(m_FD);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* Data() const { return static_cast<const uint8_t*>(m_Data); }
+    size_t Size() const { return m_Size; }
+
+private:
+    void* m_Data = nullptr;
+    size_t m_Size = 0;
+#ifdef _WIN32
+    HANDLE m_File = INVALID_HANDLE_VALUE;
+    HANDLE m_Mapping = nullptr;
+#else
+    int m_FD = -1;
+#endif
+};
+
+uint64_t BVH::CacheKey(const std::vector<Primitive>& primitives) const
+{
+    // Only what the tree depends on: the shape and placement of every primitive and the
+    // settings that change the topology. Materials can be edited without invalidating it.
+    uint64_t hash = HASH_SEED;
+    HashValue(&hash, BVH_CACHE_VERSION);
+    HashValue(&hash, int(settings.splitMethod));
+    HashValue(&hash, settings.nBuckets);
+    HashValue(&hash, settings.traversalCost);
+    HashValue(&hash, settings.intersectionCost);
+    HashValue(&hash, settings.maxPrimsInNode);
+    HashValue(&hash, int(settings.nodeOrder));
+    HashValue(&hash, settings.treeletSize);
+    HashValue(&hash, settings.spatialSplitBudget);
+    HashValue(&hash, settings.spatialSplitAlpha);
+
+    HashValue(&hash, uint64_t(primitives.size()));
+    for (const Primitive& primitive : primitives)
+    {
+        HashValue(&hash, primitive.type);
+        HashValue(&hash, primitive.radius);
+        HashValue(&hash, primitive.position);
+        HashValue(&hash, primitive.rotation);
+        HashValue(&hash, primitive.dimensions);
+    }
+    return hash;
+}
+
+bool BVH::LoadOrBuild(const std::vector<Primitive>& primitives, const std::string& cacheDirectory)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "bvh_%016llx.bin", (unsigned long long) CacheKey(primitives));
+    std::string path = cacheDirectory + name;
+
+    Clear();
+    auto start = std::chrono::high_resolution_clock::now();
+    b_LoadedFromCache = !primitives.empty() && LoadCache(path, primitives);
+    if (b_LoadedFromCache)
+    {
+        buildTimes = BVHBuildTimes();
+        buildTimes.total = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "BVH loaded from " << path << " (SAH cost: " << sahCost << ")" << std::endl;
+        return true;
+    }
+
+    RebuildBVH(primitives);
+    if (!primitives.empty() && !SaveCache(path, primitives))
+        std::cout << "Failed to write BVH cache " << path << std::endl;
+    return false;
+}
+
+bool BVH::LoadCache(const std::string& path, const std::vector<Primitive>& primitives)
+{
+    MappedFile file(path);
+    if (file.Data() == nullptr || file.Size() < sizeof(BVHCacheHeader))
+        return false;
+
+    // Anything that does not match exactly is treated as a miss and overwritten by a fresh build
+    BVHCacheHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    size_t expectedSize = sizeof(BVHCacheHeader) + size_t(header.totalNodes) * sizeof(LinearBVH_Node) + size_t(header.indexCount) * sizeof(int);
+    if (memcmp(header.magic, "BVHC", 4) != 0 ||
+        header.version != BVH_CACHE_VERSION ||
+        header.key != CacheKey(primitives) ||
+        header.nodeSize != sizeof(LinearBVH_Node) ||
+        header.primitiveCount != primitives.size() ||
+        header.totalNodes == 0 ||
+        file.Size() != expectedSize)
+    {
+        std::cout << "Ignoring stale or corrupt BVH cache " << path << std::endl;
+        return false;
+    }
+
+    m_FlatNodes.resize(header.totalNodes);
+    memcpy(m_FlatNodes.data(), file.Data() + sizeof(BVHCacheHeader), header.totalNodes * sizeof(LinearBVH_Node));
+    primitivesIndexBuffer.resize(header.indexCount);
+    memcpy(primitivesIndexBuffer.data(), file.Data() + sizeof(BVHCacheHeader) + header.totalNodes * sizeof(LinearBVH_Node),
+        header.indexCount * sizeof(int));
+    flat_root = m_FlatNodes.data();
+    totalNodes = int(header.totalNodes);
+    liveNodes = totalNodes;
+
+    // The pointer tree backs refits, incremental updates and the other layouts. Restoring it
+    // also checks that the links form a tree and every leaf range lies within the indices.
+    m_NodeArena.Reset(header.totalNodes);
+    std::vector<bool> visited(header.totalNodes, false);
+    bvh_root = RestoreNode(0, visited);
+
+    bool valid = bvh_root != nullptr && std::find(visited.begin(), visited.end(), false) == visited.end();
+    std::vector<bool> referenced(primitives.size(), false);
+    for (size_t i = 0; valid && i < primitivesIndexBuffer.size(); ++i)
+    {
+        int index = primitivesIndexBuffer[i];
+        valid = index >= 0 && index < (int) primitives.size();
+        if (valid)
+            referenced[index] = true;
+    }
+    if (!valid || std::find(referenced.begin(), referenced.end(), false) != referenced.end())
+    {
+        std::cout << "Ignoring stale or corrupt BVH cache " << path << std::endl;
+        Clear();
+        return false;
+    }
+
+    m_PrimitiveBounds.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primitives[i].BoundingBox(&m_PrimitiveBounds[i]);
+    spatialSplits = int(header.indexCount) - int(header.primitiveCount);
+    m_PrimitiveLeaves.assign(primitives.size(), nullptr);
+    IndexLeaves(bvh_root);
+
+    sahCost = ComputeSAHCost();
+    builtSahCost = sahCost;
+    UpdateLayouts();
+    return true;
+}
+
+BVH_Node* BVH::RestoreNode(int flatIndex, std::vector<bool>& visited)
+{
+    if (flatIndex < 0 || flatIndex >= totalNodes || visited[flatIndex])
+        return nullptr;
+    visited[flatIndex] = true;
+
+    const LinearBVH_Node& linearNode = flat_root[flatIndex];
+    BVH_Node* node = m_NodeArena.Allocate();
+    node->flatIndex = flatIndex;
+    AABB bounds;
+    bounds.bMin = glm::vec3(linearNode.bMin);
+    bounds.bMax = glm::vec3(linearNode.bMax);
+
+    if (linearNode.primitiveCount > 0)
+    {
+        int start = linearNode.primitiveOffset;
+        int end = start + linearNode.primitiveCount;
+        if (start < 0 || end > (int) primitivesIndexBuffer.size())
+            return nullptr;
+        CreateLeaf(node, start, end, bounds);
+        return node;
+    }
+
+    BVH_Node* left = RestoreNode(int(linearNode.bMin.w), visited);
+    BVH_Node* right = left != nullptr ? RestoreNode(linearNode.secondChildOffset, visited) : nullptr;
+    if (right == nullptr)
+        return nullptr;
+    InitInterior(node, linearNode.axis, left, right);
+    node->bbox = bounds;
+    return node;
+}
+
+bool BVH::SaveCache(const std::string& path, const std::vector<Primitive>& primitives) const
+{
+    BVHCacheHeader header;
+    memcpy(header.magic, "BVHC", 4);
+    header.version = BVH_CACHE_VERSION;
+    header.key = CacheKey(primitives);
+    header.nodeSize = sizeof(LinearBVH_Node);
+    header.primitiveCount = (uint32_t) primitives.size();
+    header.totalNodes = (uint32_t) totalNodes;
+    header.indexCount = (uint32_t) primitivesIndexBuffer.size();
+
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    // Written next to the target and renamed over it, so a reader never maps a partial file
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(flat_root), std::streamsize(totalNodes) * sizeof(LinearBVH_Node));
+        file.write(reinterpret_cast<const char*>(primitivesIndexBuffer.data()), std::streamsize(primitivesIndexBuffer.size()) * sizeof(int));
+        if (!file)
+            return false;
+    }
+    std::filesystem::rename(tempPath, path, error);
+    return !error;
+}
@@ -0,0 +1,39 @@
+#include <glad/glad.h>
+
+#include "gputimer.h"
+
+void GPUTimer::Create()
+{
+    glGenQueries(2, m_Queries);
+    m_Frame = 0;
+    m_Time = 0.0f;
+}
+
+void GPUTimer::Destroy()
+{
+    glDeleteQueries(2, m_Queries);
+    m_Queries[0] = m_Queries[1] = 0;
+}
+
+void GPUTimer::Begin()
+{
+    // Read back last frame's timing before reusing its query
+    uint32_t previousQuery = m_Queries[(m_Frame + 1) % 2];
+    GLint available = 0;
+    if (m_Frame > 0)
+        glGetQueryObjectiv(previousQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available)
+    {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(previousQuery, GL_QUERY_RESULT, &elapsed);
+        m_Time = float(elapsed) / 1e6f;
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, m_Queries[m_Frame % 2]);
+}
+
+void GPUTimer::End()
+{
+    glEndQuery(GL_TIME_ELAPSED);
+    m_Frame++;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+
+// GPU time of the commands issued between Begin() and End(). Two queries are alternated so
+// the result read back each frame belongs to the previous one and never stalls the pipeline.
+class GPUTimer
+{
+public:
+    GPUTimer() = default;
+    ~GPUTimer() {};
+
+    void Create();
+    void Destroy();
+
+    void Begin();
+    void End();
+
+    // Milliseconds taken by the last measured frame
+    float GetTime() const { return m_Time; }
+
+private:
+    uint32_t m_Queries[2] = {};
+    uint32_t m_Frame = 0;
+    float m_Time = 0.0f;
+};
@@ -1,3 +1,6 @@
+#include <cstring>
+#include <cstdlib>
+
 #include "application.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -6,12 +9,48 @@
 void SetupQuad(uint32_t& VAO, uint32_t& VBO, uint32_t& IBO);
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
-Application app = Application("Path Tracing", 1280, 720);
+std::unique_ptr<Application> app;
 
-int main(void) 
+// Usage: [--wavefront] [--headless <output.png>] [--frames <n>] [--size <width> <height>]
+//   --wavefront   trace with the compute backend instead of the fragment shader
+//   --headless    render without a window and save the image, e.g. under Mesa's llvmpipe
+//   --frames      samples accumulated before saving in headless mode, 64 by default
+int main(int argc, char** argv) 
 {
-    glfwSetKeyCallback(app.m_Window->GetWindow(), keyCallback);
-    app.Run();
+    const char* outputPath = nullptr;
+    uint32_t frames = 64;
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    bool wavefront = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = (uint32_t) atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            width = (uint32_t) atoi(argv[++i]);
+            height = (uint32_t) atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--wavefront") == 0)
+            wavefront = true;
+        else
+            std::cout << "Ignoring unknown argument " << argv[i] << std::endl;
+    }
+
+    app = std::make_unique<Application>("Path Tracing", width, height, outputPath != nullptr);
+    if (wavefront)
+        app->m_Settings.backend = BACKEND_WAVEFRONT;
+    // The renderer has already said what the driver is missing
+    if (!app->m_Renderer->SupportsBackend(app->m_Settings.backend))
+        return 1;
+
+    if (outputPath != nullptr)
+        return app->RunHeadless(outputPath, frames) ? 0 : 1;
+
+    glfwSetKeyCallback(app->m_Window->GetWindow(), keyCallback);
+    app->Run();
 
     return 1;
 }
@@ -19,7 +58,7 @@ int main(void)
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     if (key == GLFW_KEY_G && action == GLFW_PRESS)
-        app.m_Settings.enableGui = !app.m_Settings.enableGui;
+        app->m_Settings.enableGui = !app->m_Settings.enableGui;
 }
 
 void SetupQuad(uint32_t& VAO, uint32_t& VBO, uint32_t& IBO)
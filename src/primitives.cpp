@@ -24,7 +24,7 @@ AABB Union(const AABB& b, const glm::vec3& p)
     return newBounds;
 }
 
-void Primitive::BoundingBox(AABB* out)
+void Primitive::BoundingBox(AABB* out) const
 {
     float pad = 0.0f;
     switch (type)
@@ -41,7 +41,7 @@ void Primitive::BoundingBox(AABB* out)
             if (rotation != glm::mat4(1.0f))
             {
                 glm::vec3 min = glm::vec3(FLT_MAX);
-                glm::vec3 max = glm::vec3(FLT_MIN);
+                glm::vec3 max = glm::vec3(-FLT_MAX);
 
                 for (int i = 0; i < 2; i++) {
                     for (int j = 0; j < 2; j++) {
@@ -50,7 +50,8 @@ void Primitive::BoundingBox(AABB* out)
                             auto y = j*out->bMax.y + (1-j)*out->bMin.y;
                             auto z = k*out->bMax.z + (1-k)*out->bMin.z;
 
-                            glm::vec3 tester = glm::mat3(rotation) * glm::vec3(x, y, z);
+                            // Intersect() takes rays into object space with rotation, so corners come back out with its inverse
+                            glm::vec3 tester = glm::mat3(inverseRotation) * glm::vec3(x, y, z);
 
                             for (int c = 0; c < 3; c++) {
                                 min[c] = glm::min(min[c], tester[c]);
@@ -69,3 +70,69 @@ void Primitive::BoundingBox(AABB* out)
     }
     
 }
+
+void Primitive::ClippedBoundingBox(int axis, float lo, float hi, AABB* out) const
+{
+    // Bounds of the part of the primitive inside the slab lo <= p[axis] <= hi, left
+    // empty (inverted) when the primitive does not reach into it
+    *out = AABB();
+    switch (type)
+    {
+        case PRIM_SPHERE:
+        {
+            float a0 = glm::max(lo, position[axis] - radius);
+            float a1 = glm::min(hi, position[axis] + radius);
+            if (a0 > a1)
+                break;
+
+            // The widest cross-section is at the slab plane closest to the centre
+            float d = 0.0f;
+            if (position[axis] < a0) d = a0 - position[axis];
+            else if (position[axis] > a1) d = position[axis] - a1;
+            float r = glm::sqrt(glm::max(radius * radius - d * d, 0.0f));
+
+            out->bMin = position - r;
+            out->bMax = position + r;
+            out->bMin[axis] = a0;
+            out->bMax[axis] = a1;
+            break;
+        }
+        case PRIM_AABB:
+        {
+            // The clipped box is the hull of the corners inside the slab and of the points
+            // where the box's edges cross the slab planes
+            glm::vec3 a = dimensions * 0.5f;
+            const float planes[2] = { lo, hi };
+            glm::vec3 corners[8];
+            for (int c = 0; c < 8; c++)
+            {
+                glm::vec3 local(c & 1 ? a.x : -a.x, c & 2 ? a.y : -a.y, c & 4 ? a.z : -a.z);
+                corners[c] = position + glm::mat3(inverseRotation) * local;
+                if (corners[c][axis] >= lo && corners[c][axis] <= hi)
+                    *out = Union(*out, corners[c]);
+            }
+
+            for (int c = 0; c < 8; c++)
+            {
+                for (int bit = 1; bit < 8; bit <<= 1)
+                {
+                    if (c & bit)
+                        continue;
+                    const glm::vec3& p0 = corners[c];
+                    const glm::vec3& p1 = corners[c | bit];
+                    for (float plane : planes)
+                    {
+                        if ((p0[axis] - plane) * (p1[axis] - plane) < 0.0f)
+                        {
+                            float t = (plane - p0[axis]) / (p1[axis] - p0[axis]);
+                            glm::vec3 p = p0 + t * (p1 - p0);
+                            p[axis] = plane;
+                            *out = Union(*out, p);
+                        }
+                    }
+                }
+            }
+            break;
+        }
+    }
+}
@@ -13,6 +13,23 @@ enum
     PRIM_AABB = 1
 };
 
+// GPU-side split of a Primitive, matching structs.glsl. Traversal only reads the compact
+// geometry, boxes also read their transform and the material is fetched for the closest hit.
+struct alignas(16) PrimitiveGeometry
+{
+    glm::vec3 position;
+    float radius;
+    glm::vec3 dimensions;
+    int type;
+};
+
+struct alignas(16) PrimitiveTransform
+{
+    glm::mat3x4 rotation;           // std430 mat3, columns padded to vec4
+    glm::mat3x4 inverseRotation;
+};
+
+// Primitive as edited on the CPU. The renderer splits it into the arrays above when uploading.
 struct alignas(16) Primitive
 {
     Primitive()
@@ -77,19 +94,55 @@ struct alignas(16) Primitive
         return Rz;
     }
 
-    void BoundingBox(AABB* out);
+    PrimitiveGeometry Geometry() const
+    {
+        PrimitiveGeometry geometry;
+        geometry.position = position;
+        geometry.radius = radius;
+        geometry.dimensions = dimensions;
+        geometry.type = type;
+        return geometry;
+    }
+
+    PrimitiveTransform Transform() const
+    {
+        PrimitiveTransform transform;
+        transform.rotation = glm::mat3x4(rotation);
+        transform.inverseRotation = glm::mat3x4(inverseRotation);
+        return transform;
+    }
+
+    void BoundingBox(AABB* out) const;
+    void ClippedBoundingBox(int axis, float lo, float hi, AABB* out) const;
 };
 
 struct AABB
 {
     AABB()
         : bMin(glm::vec3(FLT_MAX))
-        , bMax(glm::vec3(FLT_MIN))
+        , bMax(glm::vec3(-FLT_MAX))
     {};
 
     glm::vec3 bMin;
     glm::vec3 bMax;
 
+    float SurfaceArea() const
+    {
+        // An empty (inverted) box contributes no area
+        glm::vec3 d = glm::max(bMax - bMin, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    glm::vec3 Offset(const glm::vec3& p) const
+    {
+        // Position of p relative to the box corners, 0 at bMin and 1 at bMax
+        glm::vec3 o = p - bMin;
+        if (bMax.x > bMin.x) o.x /= bMax.x - bMin.x;
+        if (bMax.y > bMin.y) o.y /= bMax.y - bMin.y;
+        if (bMax.z > bMin.z) o.z /= bMax.z - bMin.z;
+        return o;
+    }
+
     int LongestAxis() const 
     {
         // Get longest axis
@@ -2,17 +2,27 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <stdio.h>
+#include <cstring>
+#include <algorithm>
 
 #include "renderer.h"
 
 void DrawBbox(Shader& shader, BVH_Node node, uint32_t vao);
 void DrawTree(Shader& shader, BVH_Node* node, uint32_t vao, int currentDepth, int terminationDepth);
 
+// Storage blocks one permutation of pt.glsl reads at most (see the USES_* guards in uniforms.glsl),
+// the blocks the wavefront kernels add on top and the bindings each backend spreads them over
+static const int SCENE_STORAGE_BLOCKS = 8;
+static const int SCENE_STORAGE_BINDINGS = 13;
+static const int WAVEFRONT_STORAGE_BLOCKS = 4;
+static const int WAVEFRONT_STORAGE_BINDINGS = 4;
+
 Renderer::Renderer(
     uint32_t ViewportWidth,
     uint32_t ViewportHeight,
     Scene* scene)
     : m_BVH(nullptr)
+    , m_TLAS(nullptr)
     , BVHDepth(0)
     , hasPaused(false)
     , shouldDrawBVH(false)
@@ -20,64 +30,77 @@ Renderer::Renderer(
     , m_ViewportWidth(ViewportWidth)
     , m_ViewportHeight(ViewportHeight)
     , m_SampleIterations(0)
-    , m_CameraBlockBuffer(0)
-    , m_SceneBlockBuffer(0)
-    , m_PrimsBlockBuffer(0)
-    , m_BVHBlockBuffer(0)
+    , m_UploadedSceneData()
+    , m_UploadedCameraParams()
+    , m_BlocksUploaded(false)
     , m_Scene(scene)
     , m_PathTraceShader(nullptr)
-    , m_AccumShader(nullptr)
     , m_FinalOutputShader(nullptr)
     , m_BVHDebugShader(nullptr)
+    , m_AccumulationIndex(0)
     , m_EnvMapTex(0)
 {
-    m_PathTraceFBO = Framebuffer(m_ViewportWidth, m_ViewportHeight);
-    m_PathTraceFBO.Create();
-    m_AccumulationFBO = Framebuffer(m_ViewportWidth, m_ViewportHeight);
-    m_AccumulationFBO.Create();
+    for (Framebuffer& fbo : m_AccumulationFBOs)
+    {
+        fbo = Framebuffer(m_ViewportWidth, m_ViewportHeight);
+        fbo.Create();
+    }
     m_FinalOutputFBO = Framebuffer(m_ViewportWidth, m_ViewportHeight);
     m_FinalOutputFBO.Create();
 
+    // GL 4.3 only guarantees 8 storage blocks per stage and 8 bindings, check what the driver
+    // offers up front instead of failing to link the shaders later on
+    GLint fragmentBlocks = 0, computeBlocks = 0, bindings = 0;
+    glGetIntegerv(GL_MAX_FRAGMENT_SHADER_STORAGE_BLOCKS, &fragmentBlocks);
+    glGetIntegerv(GL_MAX_COMPUTE_SHADER_STORAGE_BLOCKS, &computeBlocks);
+    glGetIntegerv(GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS, &bindings);
+    m_BackendSupported[BACKEND_FRAGMENT] = fragmentBlocks >= SCENE_STORAGE_BLOCKS && bindings >= SCENE_STORAGE_BINDINGS;
+    m_BackendSupported[BACKEND_WAVEFRONT] = computeBlocks >= SCENE_STORAGE_BLOCKS + WAVEFRONT_STORAGE_BLOCKS
+        && bindings >= SCENE_STORAGE_BINDINGS + WAVEFRONT_STORAGE_BINDINGS;
+    if (!m_BackendSupported[BACKEND_FRAGMENT])
+        std::cout << "\033[1;31m[ERROR]\033[0;37m The fragment backend needs " << SCENE_STORAGE_BLOCKS << " fragment shader storage blocks and "
+            << SCENE_STORAGE_BINDINGS << " bindings, the driver offers " << fragmentBlocks << " and " << bindings << std::endl;
+    if (!m_BackendSupported[BACKEND_WAVEFRONT])
+        std::cout << "\033[1;31m[ERROR]\033[0;37m The wavefront backend needs " << SCENE_STORAGE_BLOCKS + WAVEFRONT_STORAGE_BLOCKS
+            << " compute shader storage blocks and " << SCENE_STORAGE_BINDINGS + WAVEFRONT_STORAGE_BINDINGS
+            << " bindings, the driver offers " << computeBlocks << " and " << bindings << std::endl;
+
     m_BVHDebugShader    = std::make_unique<Shader>(PATH_TO_SHADERS + "debugVert.glsl", PATH_TO_SHADERS + "debug.glsl");
-    m_FinalOutputShader = std::make_unique<Shader>(PATH_TO_SHADERS + "vert.glsl", PATH_TO_SHADERS + "post.glsl");
-    m_AccumShader       = std::make_unique<Shader>(PATH_TO_SHADERS + "vert.glsl", PATH_TO_SHADERS + "accumulation.glsl");
-    m_PathTraceShader   = std::make_unique<Shader>(PATH_TO_SHADERS + "vert.glsl", PATH_TO_SHADERS + "pt.glsl");
+    // Start out with the permutations of the default settings, so they are not compiled twice
+    ApplicationSettings defaults;
+    m_FinalOutputShader = std::make_unique<Shader>(PATH_TO_SHADERS + "vert.glsl", PATH_TO_SHADERS + "post.glsl", ShaderDefines{ { "TONEMAP", defaults.tonemap } });
+    m_PathTraceShader   = std::make_unique<Shader>(PATH_TO_SHADERS + "vert.glsl", PATH_TO_SHADERS + "pt.glsl", PathTraceDefines(defaults));
+    SetPathTraceUniformGuards(*m_PathTraceShader);
 
     m_Scene->SelectScene();
-    m_BVH = std::make_unique<BVH>(m_Scene->primitives);
-
-    // Setup BVH UBO
-    int bvhBlockOffset = 1000 * sizeof(LinearBVH_Node);
-    int bvhBlockMem = 1000 * sizeof(LinearBVH_Node) + MAX_PRIMITIVES * sizeof(int);
-    glGenBuffers(1, &m_BVHBlockBuffer); 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_BVHBlockBuffer);
-    glBufferData(GL_UNIFORM_BUFFER, bvhBlockMem, nullptr, GL_STATIC_DRAW);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, m_BVH->totalNodes * sizeof(LinearBVH_Node), m_BVH->flat_root);
-    glBufferSubData(GL_UNIFORM_BUFFER, bvhBlockOffset, m_BVH->primitivesIndexBuffer.size() * sizeof(int), m_BVH->primitivesIndexBuffer.data());
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_BVHBlockBuffer);
-
-    // Setup PrimsBlock UBO
-    int primsBlockMem = sizeof(glm::vec4) + MAX_LIGHTS * sizeof(Light) + MAX_PRIMITIVES * sizeof(Primitive);
-    glGenBuffers(1, &m_PrimsBlockBuffer); 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_PrimsBlockBuffer); 
-    glBufferData(GL_UNIFORM_BUFFER, primsBlockMem, nullptr, GL_DYNAMIC_DRAW); 
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, m_PrimsBlockBuffer); 
-
-    // Setup SceneBlock UBO
-    glGenBuffers(1, &m_SceneBlockBuffer); 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_SceneBlockBuffer); 
-    glBufferData(GL_UNIFORM_BUFFER, sizeof(SceneBlock), nullptr, GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 2, m_SceneBlockBuffer); 
-
-    // Setup CameraBlock UBO
-    glGenBuffers(1, &m_CameraBlockBuffer); 
-    glBindBuffer(GL_UNIFORM_BUFFER, m_CameraBlockBuffer); 
-    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), nullptr, GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 3, m_CameraBlockBuffer); 
+    m_BVH = std::make_unique<BVH>();
+    m_BVH->LoadOrBuild(m_Scene->primitives, PATH_TO_BVH_CACHE);
+    m_TLAS = std::make_unique<TLAS>();
+
+    // Setup the BVH, primitive and light storage buffers. They start out small and are filled
+    // in by UpdateBuffers, growing to whatever the scene needs.
+    m_BVHNodeBuffer.Create(0, 64 * sizeof(LinearBVH_Node));
+    m_BVHIndexBuffer.Create(1, 64 * sizeof(int));
+    m_GeometryBuffer.Create(GL_SHADER_STORAGE_BUFFER, 2, 64 * sizeof(PrimitiveGeometry));
+    m_LightBuffer.Create(3, 16 * sizeof(Light));
+    m_BVH4Buffer.Create(4, 64 * sizeof(LinearBVH4_Node));
+    m_QuantizedBVHBuffer.Create(5, 64 * sizeof(LinearQuantizedBVH_Node));
+    m_StacklessBVHBuffer.Create(6, 64 * sizeof(LinearStacklessBVH_Node));
+    m_TransformBuffer.Create(GL_SHADER_STORAGE_BUFFER, 7, 64 * sizeof(PrimitiveTransform));
+    m_MaterialBuffer.Create(GL_SHADER_STORAGE_BUFFER, 8, 64 * sizeof(Material));
+
+    // The TLAS and BLAS buffers are filled in by UpdateBuffers once instancing is enabled
+    m_TLASNodeBuffer.Create(9, 64 * sizeof(LinearBVH_Node));
+    m_TLASInstanceBuffer.Create(10, 64 * sizeof(Instance));
+    m_BLASNodeBuffer.Create(11, 64 * sizeof(LinearBVH_Node));
+    m_BLASGeometryBuffer.Create(12, 64 * sizeof(PrimitiveGeometry));
+
+    m_PathTraceTimer.Create();
+    m_OutputTimer.Create();
+
+    // Setup SceneBlock and CameraBlock UBOs
+    m_SceneBuffer.Create(GL_UNIFORM_BUFFER, 2, sizeof(SceneBlock));
+    m_CameraBuffer.Create(GL_UNIFORM_BUFFER, 3, sizeof(CameraBlock));
 
     // Send Blue Noise 2d texture to PathTraceShader
     uint32_t BlueNoise;
@@ -107,11 +130,8 @@ Renderer::Renderer(
     // The png LUT is 2304x48 with 48 layers --> 48x48x48
     delete TonyMcMapfaceTex;
 
+    BindSceneBlocks(*m_PathTraceShader);
     m_PathTraceShader->Bind();
-    m_PathTraceShader->SetUBO("BVH", 0);
-    m_PathTraceShader->SetUBO("PrimsBlock", 1);
-    m_PathTraceShader->SetUBO("SceneBlock", 2);
-    m_PathTraceShader->SetUBO("CameraBlock", 3);
     m_PathTraceShader->SetUniformInt("u_BlueNoise", 1);
     m_PathTraceShader->Unbind();
 
@@ -143,58 +163,176 @@ Renderer::Renderer(
 
 Renderer::~Renderer()
 {
-    m_PathTraceFBO.Destroy();
-    m_AccumulationFBO.Destroy();
+    m_AccumulationFBOs[0].Destroy();
+    m_AccumulationFBOs[1].Destroy();
     m_FinalOutputFBO.Destroy();
+    m_SceneBuffer.Destroy();
+    m_CameraBuffer.Destroy();
+    m_GeometryBuffer.Destroy();
+    m_TransformBuffer.Destroy();
+    m_MaterialBuffer.Destroy();
+    m_LightBuffer.Destroy();
+    m_BVHNodeBuffer.Destroy();
+    m_BVHIndexBuffer.Destroy();
+    m_BVH4Buffer.Destroy();
+    m_QuantizedBVHBuffer.Destroy();
+    m_StacklessBVHBuffer.Destroy();
+    m_TLASNodeBuffer.Destroy();
+    m_TLASInstanceBuffer.Destroy();
+    m_BLASNodeBuffer.Destroy();
+    m_BLASGeometryBuffer.Destroy();
+    m_PathTraceTimer.Destroy();
+    m_OutputTimer.Destroy();
+    DestroyWavefront();
+}
+
+void Renderer::BindSceneBlocks(Shader& shader)
+{
+    shader.Bind();
+    shader.SetSSBO("BVH", 0);
+    shader.SetSSBO("BVHIndices", 1);
+    shader.SetSSBO("PrimsBlock", 2);
+    shader.SetSSBO("LightsBlock", 3);
+    shader.SetSSBO("BVH4", 4);
+    shader.SetSSBO("QuantizedBVH", 5);
+    shader.SetSSBO("StacklessBVH", 6);
+    shader.SetSSBO("TransformsBlock", 7);
+    shader.SetSSBO("MaterialsBlock", 8);
+    shader.SetSSBO("TLAS", 9);
+    shader.SetSSBO("TLASInstances", 10);
+    shader.SetSSBO("BLAS", 11);
+    shader.SetSSBO("BLASGeometry", 12);
+    shader.SetUBO("SceneBlock", 2);
+    shader.SetUBO("CameraBlock", 3);
+    shader.Unbind();
+}
+
+std::vector<Shader*> Renderer::Shaders() const
+{
+    std::vector<Shader*> shaders = { m_PathTraceShader.get(), m_FinalOutputShader.get(), m_BVHDebugShader.get() };
+    if (m_QueueKernel)
+    {
+        shaders.insert(shaders.end(), { m_GenerateKernel.get(), m_ExtendKernel.get(), m_ShadeKernel.get(),
+            m_ConnectKernel.get(), m_ResolveKernel.get(), m_QueueKernel.get() });
+    }
+    return shaders;
+}
+
+void Renderer::ReloadShaders()
+{
+    std::cout << "Reloading Shaders..." << std::endl;
+    for (Shader* shader : Shaders())
+        shader->ReloadShader();
+    ResetSamples();
+}
+
+int Renderer::TracedLayout(const ApplicationSettings& settings)
+{
+    // The layout does not matter without a scene BVH, which saves building those permutations
+    bool instancing = settings.enableBVH && settings.enableInstancing;
+    return settings.enableBVH && !instancing ? settings.bvhLayout : int(BVH_LAYOUT_BINARY);
+}
+
+// Settings that only pick code paths are compiled into the path tracing shaders
+ShaderDefines Renderer::PathTraceDefines(const ApplicationSettings& settings)
+{
+    bool instancing = settings.enableBVH && settings.enableInstancing;
+    return {
+        { "BVH_ENABLED", int(settings.enableBVH) },
+        { "BVH_LAYOUT", TracedLayout(settings) },
+        { "DEBUG_BVH_VISUALISATION", int(settings.enableDebugBVHVisualisation) },
+        { "USE_BLUE_NOISE", int(settings.enableBlueNoise) },
+        { "INSTANCING_ENABLED", int(instancing) },
+    };
+}
+
+void Renderer::SetPathTraceUniformGuards(Shader& shader)
+{
+    // Without blue noise the kernels past generate.glsl have no use for the path's pixel
+    shader.SetUniformGuard("u_BlueNoise", "USE_BLUE_NOISE");
+    shader.SetUniformGuard("u_FirstPixel", "USE_BLUE_NOISE");
+    shader.SetUniformGuard("u_Resolution", "USE_BLUE_NOISE");
+    shader.SetUniformGuard("u_TotalNodes", "DEBUG_BVH_VISUALISATION");
 }
 
 void Renderer::UpdateBuffers()
 {
+    // A reloaded program only lacks its bindings, the buffers behind them still hold the
+    // scene and the BVH, so nothing has to be rebuilt or uploaded again
     if (m_PathTraceShader->hasReloaded)
     {
-        m_BVH->RebuildBVH(m_Scene->primitives);
-        
-        // Reallocate memory for PrimsBlock
-        int mem = sizeof(glm::vec4) + MAX_LIGHTS * sizeof(Light) + MAX_PRIMITIVES * sizeof(Primitive);
-        glBindBuffer(GL_UNIFORM_BUFFER, m_PrimsBlockBuffer);
-        glBufferData(GL_UNIFORM_BUFFER, mem, nullptr, GL_DYNAMIC_DRAW); 
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 1, m_PrimsBlockBuffer); 
-
-        // Setup SceneBlock UBO
-        glBindBuffer(GL_UNIFORM_BUFFER, m_SceneBlockBuffer); 
-        glBufferData(GL_UNIFORM_BUFFER, sizeof(SceneBlock), nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 2, m_SceneBlockBuffer); 
-
-        // Setup CameraBlock UBO
-        glBindBuffer(GL_UNIFORM_BUFFER, m_CameraBlockBuffer); 
-        glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 3, m_CameraBlockBuffer); 
-
-        m_PathTraceShader->SetUBO("PrimsBlock", 1);
-        m_PathTraceShader->SetUBO("SceneBlock", 2);
-        m_PathTraceShader->SetUBO("CameraBlock", 3);
+        BindSceneBlocks(*m_PathTraceShader);
+        m_PathTraceShader->Bind();
         m_PathTraceShader->SetUniformInt("u_BlueNoise", 1);
+        m_PathTraceShader->Unbind();
         m_PathTraceShader->hasReloaded = false;
     }
 
     // Update BVH Block only if rebuilt
     if (m_BVH->b_Rebuilt)
     {
-        // Reallocate memory for BVH Block
-        int bvhBlockOffset = 1000 * sizeof(LinearBVH_Node);
-        int bvhBlockMem = 1000 * sizeof(LinearBVH_Node) + MAX_PRIMITIVES * sizeof(int);
-        glBindBuffer(GL_UNIFORM_BUFFER, m_BVHBlockBuffer);
-        glBufferData(GL_UNIFORM_BUFFER, bvhBlockMem, nullptr, GL_STATIC_DRAW);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, m_BVH->totalNodes * sizeof(LinearBVH_Node), m_BVH->flat_root);
-        glBufferSubData(GL_UNIFORM_BUFFER, bvhBlockOffset, m_BVH->primitivesIndexBuffer.size() * sizeof(int), m_BVH->primitivesIndexBuffer.data());
-        glBindBuffer(GL_UNIFORM_BUFFER, 0); 
-        glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_BVHBlockBuffer); 
-
-        m_PathTraceShader->SetUBO("BVH", 0);
+        m_BVHNodeBuffer.Upload(0, m_BVH->flat_root, m_BVH->totalNodes * sizeof(LinearBVH_Node));
+        m_BVHIndexBuffer.Upload(0, m_BVH->primitivesIndexBuffer.data(), m_BVH->primitivesIndexBuffer.size() * sizeof(int));
+
+        m_PathTraceShader->SetSSBO("BVH", 0);
+        m_PathTraceShader->SetSSBO("BVHIndices", 1);
         m_BVH->b_Rebuilt = false;
+        m_BVH->dirtyNodes.Clear();
+        m_BVH->dirtyIndices.Clear();
+    }
+    else if (!m_BVH->dirtyNodes.Empty() || !m_BVH->dirtyIndices.Empty())
+    {
+        // Only upload the nodes and indices patched by refits and incremental inserts/removals
+        const DirtyRange& nodes = m_BVH->dirtyNodes;
+        if (!nodes.Empty())
+            m_BVHNodeBuffer.Upload(nodes.begin * sizeof(LinearBVH_Node), 
+                m_BVH->flat_root + nodes.begin, (nodes.end - nodes.begin) * sizeof(LinearBVH_Node));
+        // A removal touches slots far apart from each other, so the indices go up as a few ranges
+        const size_t maxGap = 8;
+        for (const DirtyRange& indices : m_BVH->dirtyIndices.Coalesce(maxGap))
+            m_BVHIndexBuffer.Upload(indices.begin * sizeof(int), 
+                m_BVH->primitivesIndexBuffer.data() + indices.begin, (indices.end - indices.begin) * sizeof(int));
+        m_BVH->dirtyNodes.Clear();
+        m_BVH->dirtyIndices.Clear();
+    }
+
+    // Update the block of the alternative layout in use whenever it was derived again, the
+    // blocks of the other layouts are not read by the current permutation
+    if (m_BVH->b_LayoutChanged)
+    {
+        if (m_BVH->GetLayout() == BVH_LAYOUT_BVH4)
+            m_BVH4Buffer.Upload(0, m_BVH->flatBVH4.data(), m_BVH->flatBVH4.size() * sizeof(LinearBVH4_Node));
+        else if (m_BVH->GetLayout() == BVH_LAYOUT_QUANTIZED)
+            m_QuantizedBVHBuffer.Upload(0, m_BVH->flatQuantized.data(), m_BVH->flatQuantized.size() * sizeof(LinearQuantizedBVH_Node));
+        else if (m_BVH->GetLayout() == BVH_LAYOUT_STACKLESS)
+            m_StacklessBVHBuffer.Upload(0, m_BVH->flatStackless.data(), m_BVH->flatStackless.size() * sizeof(LinearStacklessBVH_Node));
+
+        m_PathTraceShader->SetSSBO("BVH4", 4);
+        m_PathTraceShader->SetSSBO("QuantizedBVH", 5);
+        m_PathTraceShader->SetSSBO("StacklessBVH", 6);
+        m_BVH->b_LayoutChanged = false;
+    }
+
+    // Update the TLAS blocks after instances moved, and the BLAS blocks after new shapes appeared.
+    // Both grow with the scene, so the whole structure is always uploaded.
+    if (m_TLAS->b_TLASChanged)
+    {
+        const BVH& tlas = m_TLAS->tlas;
+        m_TLASNodeBuffer.Upload(0, tlas.flat_root, tlas.totalNodes * sizeof(LinearBVH_Node));
+        m_TLASInstanceBuffer.Upload(0, m_TLAS->leafInstances.data(), m_TLAS->leafInstances.size() * sizeof(Instance));
+
+        m_PathTraceShader->SetSSBO("TLAS", 9);
+        m_PathTraceShader->SetSSBO("TLASInstances", 10);
+        m_TLAS->b_TLASChanged = false;
+    }
+    if (m_TLAS->b_BLASChanged)
+    {
+        m_BLASNodeBuffer.Upload(0, m_TLAS->blasNodes.data(), m_TLAS->blasNodes.size() * sizeof(LinearBVH_Node));
+        m_BLASGeometryBuffer.Upload(0, m_TLAS->blasGeometry.data(), m_TLAS->blasGeometry.size() * sizeof(PrimitiveGeometry));
+
+        m_PathTraceShader->SetSSBO("BLAS", 11);
+        m_PathTraceShader->SetSSBO("BLASGeometry", 12);
+        m_TLAS->b_BLASChanged = false;
     }
 
     // Update Env Map Texture
@@ -218,103 +356,172 @@ void Renderer::UpdateBuffers()
         }
     }
 
-    // Update Scene Block
-    glBindBuffer(GL_UNIFORM_BUFFER, m_SceneBlockBuffer);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(SceneBlock), &m_Scene->Data);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-    // Update Camera Block
-    glBindBuffer(GL_UNIFORM_BUFFER, m_CameraBlockBuffer);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraBlock), &m_Scene->Eye->params);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-    // Update Prims Block
-    int offset = 0;
-    int n_Lights = (int) m_Scene->lights.size();
-    int n_Primitives = (int) m_Scene->primitives.size();
-    glBindBuffer(GL_UNIFORM_BUFFER, m_PrimsBlockBuffer);
-    glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(int), &n_Lights); 
-    offset += sizeof(int);
-    glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(int), &n_Primitives); 
-    offset += 3 * sizeof(int);
-    glBufferSubData(GL_UNIFORM_BUFFER, offset, n_Lights * sizeof(Light), m_Scene->lights.data()); 
-    offset += (MAX_LIGHTS) * sizeof(Light);
-    glBufferSubData(GL_UNIFORM_BUFFER, offset, n_Primitives * sizeof(Primitive), m_Scene->primitives.data()); 
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    // The ring buffers only move on to a fresh region when something was marked as changed,
+    // so unchanged blocks cost neither a copy nor a wait
+    m_Scene->Data.n_Lights = (int) m_Scene->lights.size();
+    m_Scene->Data.n_Primitives = (int) m_Scene->primitives.size();
+    if (!m_BlocksUploaded || memcmp(&m_UploadedSceneData, &m_Scene->Data, sizeof(SceneBlock)) != 0)
+    {
+        m_SceneBuffer.Invalidate(0, sizeof(SceneBlock));
+        m_UploadedSceneData = m_Scene->Data;
+    }
+    if (!m_BlocksUploaded || memcmp(&m_UploadedCameraParams, &m_Scene->Eye->params, sizeof(CameraBlock)) != 0)
+    {
+        m_CameraBuffer.Invalidate(0, sizeof(CameraBlock));
+        m_UploadedCameraParams = m_Scene->Eye->params;
+    }
+    m_BlocksUploaded = true;
+    m_SceneBuffer.Update(&m_Scene->Data, sizeof(SceneBlock));
+    m_CameraBuffer.Update(&m_Scene->Eye->params, sizeof(CameraBlock));
+
+    // Only the primitives and lights edited since the last frame are sent. Edits a few elements
+    // apart share one copy, anything past the end was removed from the scene in the meantime.
+    const size_t maxGap = 8;
+    size_t n_Primitives = m_Scene->primitives.size();
+    m_Geometry.resize(n_Primitives);
+    m_Transforms.resize(n_Primitives);
+    m_Materials.resize(n_Primitives);
+    if (!m_Scene->dirtyPrimitives.Empty())
+    {
+        for (const DirtyRange& range : m_Scene->dirtyPrimitives.Coalesce(maxGap))
+        {
+            int end = std::min(range.end, m_Scene->Data.n_Primitives);
+            if (range.begin >= end)
+                continue;
+            for (int i = range.begin; i < end; ++i)
+            {
+                const Primitive& primitive = m_Scene->primitives[i];
+                m_Geometry[i] = primitive.Geometry();
+                m_Transforms[i] = primitive.Transform();
+                m_Materials[i] = primitive.mat;
+            }
+            size_t count = end - range.begin;
+            m_GeometryBuffer.Invalidate(range.begin * sizeof(PrimitiveGeometry), count * sizeof(PrimitiveGeometry));
+            m_TransformBuffer.Invalidate(range.begin * sizeof(PrimitiveTransform), count * sizeof(PrimitiveTransform));
+            m_MaterialBuffer.Invalidate(range.begin * sizeof(Material), count * sizeof(Material));
+        }
+        m_Scene->dirtyPrimitives.Clear();
+    }
+    m_GeometryBuffer.Update(m_Geometry.data(), n_Primitives * sizeof(PrimitiveGeometry));
+    m_TransformBuffer.Update(m_Transforms.data(), n_Primitives * sizeof(PrimitiveTransform));
+    m_MaterialBuffer.Update(m_Materials.data(), n_Primitives * sizeof(Material));
+
+    if (!m_Scene->dirtyLights.Empty())
+    {
+        for (const DirtyRange& range : m_Scene->dirtyLights.Coalesce(maxGap))
+        {
+            int end = std::min(range.end, m_Scene->Data.n_Lights);
+            if (range.begin < end)
+                m_LightBuffer.Upload(range.begin * sizeof(Light), m_Scene->lights.data() + range.begin, (end - range.begin) * sizeof(Light));
+        }
+        m_Scene->dirtyLights.Clear();
+    }
 }
 
 void Renderer::Render(uint32_t VAO, const ApplicationSettings& settings)
 {
     glClearColor(1.0f, 0.0f, 1.0f, 1.0f); 
 
-    // First pass:
-    // Render current frame to m_PathTraceFBO using m_AccumulationFBO's texture to continue accumulating samples
-    // For first frame the texture will be empty and will not affect the output
-    glActiveTexture(GL_TEXTURE0); 
-    glBindTexture(GL_TEXTURE_2D, m_AccumulationFBO.GetTextureID());
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, m_EnvMapTex);
-
-    m_PathTraceShader->Bind(); 
-    m_PathTraceShader->SetUniformInt("u_EnvMapTex", 2);
-    m_PathTraceShader->SetUniformInt("u_AccumulationTexture", 0); 
-    m_PathTraceShader->SetUniformInt("u_SampleIterations", m_SampleIterations); 
-    m_PathTraceShader->SetUniformInt("u_SamplesPerPixel", m_Scene->samplesPerPixel); 
-    m_PathTraceShader->SetUniformVec2("u_Resolution", float(m_ViewportWidth), float(m_ViewportHeight)); 
-    m_PathTraceShader->SetUniformInt("u_BVHEnabled", int(settings.enableBVH));
-    m_PathTraceShader->SetUniformInt("u_DebugBVHVisualisation", int(settings.enableDebugBVHVisualisation));
-    m_PathTraceShader->SetUniformInt("u_TotalNodes", m_BVH->totalNodes);
-    m_PathTraceShader->SetUniformInt("u_UseBlueNoise", int(settings.enableBlueNoise));
-    m_PathTraceShader->SetUniformFloat("u_EnvMapRotation", m_Scene->envMapRotation);
+    // The render targets are sized to the viewport, not to the window (there may be none)
+    glViewport(0, 0, m_ViewportWidth, m_ViewportHeight);
 
-    UpdateBuffers();
+    // Reloaded programs replace the old ones once the driver has finished building them,
+    // until then the frame is rendered with the previous version
+    for (Shader* shader : Shaders())
+    {
+        if (shader->PollReload())
+            ResetSamples();
+    }
 
-    m_PathTraceFBO.Bind(); 
+    // Instances are diffed against the scene every frame, which only costs a rebuild when something moved
+    if (settings.enableBVH && settings.enableInstancing)
+        m_TLAS->Update(m_Scene->primitives);
 
-    glClear(GL_COLOR_BUFFER_BIT); 
-    glBindVertexArray(VAO); 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
-    glBindVertexArray(0); 
+    // Only the layout being traversed is derived from the tree and uploaded
+    m_BVH->SetLayout(TracedLayout(settings));
+    UpdateBuffers();
 
-    m_PathTraceFBO.Unbind(); 
-    m_PathTraceShader->Unbind();
+    // First pass:
+    // Render the current frame into one accumulation target, reading the samples accumulated so far
+    // from the other one. For the first frame the weight of the previous texture is zero.
+    Framebuffer& previousFBO = m_AccumulationFBOs[m_AccumulationIndex];
+    Framebuffer& currentFBO = m_AccumulationFBOs[1 - m_AccumulationIndex];
+    glActiveTexture(GL_TEXTURE0); 
+    glBindTexture(GL_TEXTURE_2D, previousFBO.GetTextureID());
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, m_EnvMapTex);
 
-    // Second Pass:
-    // This pass is used to copy the previous pass' output (m_PathTraceFBO) onto m_AccumulationFBO which will hold the data 
-    // until used again for the first pass of the next frame
-    m_AccumShader->Bind(); 
-    m_AccumulationFBO.Bind(); 
+    if (settings.backend == BACKEND_WAVEFRONT)
+    {
+        m_PathTraceTimer.Begin();
+        RenderWavefront(settings, currentFBO);
+        m_PathTraceTimer.End();
+    }
+    else
+    {
+        // A permutation built for the first time has none of the bindings made at startup
+        if (m_PathTraceShader->SetPermutation(PathTraceDefines(settings)))
+        {
+            BindSceneBlocks(*m_PathTraceShader);
+            m_PathTraceShader->Bind();
+            m_PathTraceShader->SetUniformInt("u_BlueNoise", 1);
+        }
 
-    glActiveTexture(GL_TEXTURE0); 
-    glBindTexture(GL_TEXTURE_2D, m_PathTraceFBO.GetTextureID()); 
+        m_PathTraceShader->Bind(); 
+        m_PathTraceShader->SetUniformInt("u_EnvMapTex", 2);
+        m_PathTraceShader->SetUniformInt("u_AccumulationTexture", 0); 
+        m_PathTraceShader->SetUniformInt("u_SampleIterations", m_SampleIterations); 
+        m_PathTraceShader->SetUniformInt("u_SamplesPerPixel", m_Scene->samplesPerPixel); 
+        m_PathTraceShader->SetUniformVec2("u_Resolution", float(m_ViewportWidth), float(m_ViewportHeight)); 
+        m_PathTraceShader->SetUniformInt("u_TotalNodes", m_BVH->liveNodes);
+        m_PathTraceShader->SetUniformFloat("u_EnvMapRotation", m_Scene->envMapRotation);
+
+        currentFBO.Bind(); 
+
+        // Every pixel is written by the quad, so the target is not cleared first
+        m_PathTraceTimer.Begin();
+        glBindVertexArray(VAO); 
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
+        glBindVertexArray(0); 
+        m_PathTraceTimer.End();
+
+        currentFBO.Unbind(); 
+        m_PathTraceShader->Unbind();
+    }
 
-    m_AccumShader->SetUniformInt("u_PathTraceTexture", 0); 
-    m_AccumShader->SetUniformVec2("u_Resolution", float(m_ViewportWidth), float(m_ViewportHeight)); 
+    m_SceneBuffer.Fence();
+    m_CameraBuffer.Fence();
+    m_GeometryBuffer.Fence();
+    m_TransformBuffer.Fence();
+    m_MaterialBuffer.Fence();
 
-    glClear(GL_COLOR_BUFFER_BIT); 
-    glBindVertexArray(VAO); 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
-    glBindVertexArray(0); 
+    // The target just written holds the new average, next frame reads from it
+    m_AccumulationIndex = 1 - m_AccumulationIndex;
 
+    // Final pass:
+    // Tonemap the accumulated image into the viewport
     glActiveTexture(GL_TEXTURE0); 
-    glBindTexture(GL_TEXTURE_2D, m_AccumulationFBO.GetTextureID()); 
+    glBindTexture(GL_TEXTURE_2D, currentFBO.GetTextureID()); 
 
-    m_AccumulationFBO.Unbind(); 
-    m_AccumShader->Unbind();
+    if (m_FinalOutputShader->SetPermutation({ { "TONEMAP", settings.tonemap } }) || m_FinalOutputShader->hasReloaded)
+    {
+        m_FinalOutputShader->Bind();
+        m_FinalOutputShader->SetUniformInt("u_TonyMcMapfaceLUT", 1);
+        m_FinalOutputShader->hasReloaded = false;
+    }
 
-    // Final pass:
-    // Now use the texture from either of the previously used FBO and divide by the frame count
     m_FinalOutputShader->Bind(); 
     m_FinalOutputFBO.Bind(); 
     m_FinalOutputShader->SetUniformInt("u_PT_Texture", 0); 
     m_FinalOutputShader->SetUniformVec2("u_Resolution", float(m_ViewportWidth), float(m_ViewportHeight)); 
-    m_FinalOutputShader->SetUniformInt("u_Tonemap", settings.tonemap);
     m_FinalOutputShader->SetUniformInt("u_EnableCrosshair", int(settings.enableCrosshair));
 
+    m_OutputTimer.Begin();
     glClear(GL_COLOR_BUFFER_BIT);
     glBindVertexArray(VAO); 
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); 
     glBindVertexArray(0); 
+    m_OutputTimer.End();
 
     m_FinalOutputFBO.Unbind(); 
     m_FinalOutputShader->Unbind();
@@ -345,13 +552,32 @@ void Renderer::OnResize(uint32_t width, uint32_t height)
     m_ViewportWidth = width;
     m_ViewportHeight = height;
 
-    m_AccumulationFBO.OnResize(m_ViewportWidth, m_ViewportHeight);
-    m_PathTraceFBO.OnResize(m_ViewportWidth, m_ViewportHeight);
+    m_AccumulationFBOs[0].OnResize(m_ViewportWidth, m_ViewportHeight);
+    m_AccumulationFBOs[1].OnResize(m_ViewportWidth, m_ViewportHeight);
     m_FinalOutputFBO.OnResize(m_ViewportWidth, m_ViewportHeight);
     hasPaused = false;
     ResetSamples();
 }
 
+std::vector<uint8_t> Renderer::ReadViewportPixels()
+{
+    size_t rowSize = size_t(m_ViewportWidth) * 4;
+    std::vector<uint8_t> pixels(rowSize * m_ViewportHeight);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_FinalOutputFBO.GetTextureID());
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // GL stores the bottom row first, images are written top down
+    for (uint32_t y = 0; y < m_ViewportHeight / 2; ++y)
+        std::swap_ranges(pixels.begin() + y * rowSize, pixels.begin() + (y + 1) * rowSize,
+            pixels.begin() + (m_ViewportHeight - 1 - y) * rowSize);
+    for (size_t i = 3; i < pixels.size(); i += 4)
+        pixels[i] = 255;
+    return pixels;
+}
+
 void DrawBbox(Shader& shader, BVH_Node node, uint32_t vao)
 {
     glm::vec3 scale = node.bbox.bMax - node.bbox.bMin;
@@ -3,9 +3,13 @@
 #include <memory>
 #include "shader.h"
 #include "framebuffer.h"
+#include "gputimer.h"
+#include "storagebuffer.h"
+#include "streambuffer.h"
 #include "scene.h"
 #include "camera.h"
 #include "bvh.h"
+#include "tlas.h"
 #include "utils.h"
 #include "lodepng.h"
 #include "texture.h"
@@ -22,13 +26,27 @@ public:
 
     Framebuffer GetViewportFramebuffer() const { return m_FinalOutputFBO; }
     uint32_t GetIterations() const { return m_SampleIterations; }
+    float GetPathTraceTime() const { return m_PathTraceTimer.GetTime(); }
+    float GetOutputTime() const { return m_OutputTimer.GetTime(); }
+    uint32_t GetFenceWaits() const
+    {
+        return m_SceneBuffer.fenceWaits + m_CameraBuffer.fenceWaits +
+            m_GeometryBuffer.fenceWaits + m_TransformBuffer.fenceWaits + m_MaterialBuffer.fenceWaits;
+    }
     Shader& GetShader() const { return *m_PathTraceShader; }
+    // False when the driver has too few storage blocks or bindings for the backend's shaders
+    bool SupportsBackend(int backend) const { return m_BackendSupported[backend]; }
 
     void UpdateBuffers();
     void Render(uint32_t VAO, const ApplicationSettings& settings);
+    // Rebuilds every shader from its sources in the background, see Shader::ReloadShader
+    void ReloadShaders();
     void ResetSamples() { m_SampleIterations = 0; }
+    // Image shown in the viewport, read back as 8-bit RGBA rows from top to bottom
+    std::vector<uint8_t> ReadViewportPixels();
 public:
     std::unique_ptr<BVH> m_BVH;
+    std::unique_ptr<TLAS> m_TLAS;
 
     int BVHDepth;
     bool hasPaused;
@@ -36,22 +54,78 @@ public:
     uint32_t debugVAO;
 
 private:
+    void BindSceneBlocks(Shader& shader);
+    std::vector<Shader*> Shaders() const;
+    static int TracedLayout(const ApplicationSettings& settings);
+    static ShaderDefines PathTraceDefines(const ApplicationSettings& settings);
+    static void SetPathTraceUniformGuards(Shader& shader);
+
+    // Compute backend, see renderer_wavefront.cpp
+    void CreateWavefront(const ApplicationSettings& settings);
+    void DestroyWavefront();
+    void BindWavefrontBlocks(Shader& kernel);
+    void RenderWavefront(const ApplicationSettings& settings, Framebuffer& currentFBO);
+
     uint32_t m_ViewportWidth;
     uint32_t m_ViewportHeight;
     uint32_t m_SampleIterations;
-    uint32_t m_CameraBlockBuffer;
-    uint32_t m_SceneBlockBuffer;
-    uint32_t m_PrimsBlockBuffer;
-    uint32_t m_BVHBlockBuffer; 
+    bool m_BackendSupported[2];
+
+    // Contents of the small blocks as last uploaded, they are only sent again once they differ
+    SceneBlock m_UploadedSceneData;
+    CameraBlock m_UploadedCameraParams;
+    bool m_BlocksUploaded;
 
-    std::unique_ptr<Scene> m_Scene;
+    GPUTimer m_PathTraceTimer;
+    GPUTimer m_OutputTimer;
+
+    Scene* m_Scene;             // Owned by the application
     std::unique_ptr<Shader> m_PathTraceShader;
-    std::unique_ptr<Shader> m_AccumShader;
     std::unique_ptr<Shader> m_FinalOutputShader;
     std::unique_ptr<Shader> m_BVHDebugShader;
 
-    Framebuffer m_PathTraceFBO;
-    Framebuffer m_AccumulationFBO;
+    // Kernels of the wavefront backend, compiled the first time it is selected
+    std::unique_ptr<Shader> m_GenerateKernel;
+    std::unique_ptr<Shader> m_ExtendKernel;
+    std::unique_ptr<Shader> m_ShadeKernel;
+    std::unique_ptr<Shader> m_ConnectKernel;
+    std::unique_ptr<Shader> m_ResolveKernel;
+    std::unique_ptr<Shader> m_QueueKernel;
+
+    // Data edited from frame to frame is streamed through persistently mapped rings
+    StreamBuffer m_SceneBuffer;
+    StreamBuffer m_CameraBuffer;
+    StreamBuffer m_GeometryBuffer;
+    StreamBuffer m_TransformBuffer;
+    StreamBuffer m_MaterialBuffer;
+
+    // Scene primitives split into the arrays the shaders read, kept in step through dirtyPrimitives
+    std::vector<PrimitiveGeometry> m_Geometry;
+    std::vector<PrimitiveTransform> m_Transforms;
+    std::vector<Material> m_Materials;
+
+    // Storage buffers sized to the scene, see uniforms.glsl for their bindings
+    StorageBuffer m_LightBuffer;
+    StorageBuffer m_BVHNodeBuffer;
+    StorageBuffer m_BVHIndexBuffer;
+    StorageBuffer m_BVH4Buffer;
+    StorageBuffer m_QuantizedBVHBuffer;
+    StorageBuffer m_StacklessBVHBuffer;
+    StorageBuffer m_TLASNodeBuffer;
+    StorageBuffer m_TLASInstanceBuffer;
+    StorageBuffer m_BLASNodeBuffer;
+    StorageBuffer m_BLASGeometryBuffer;
+
+    // Paths in flight, their shadow rays, the work queues and the queue lengths of the wavefront backend
+    StorageBuffer m_PathBuffer;
+    StorageBuffer m_ShadowRayBuffer;
+    StorageBuffer m_QueueBuffer;
+    StorageBuffer m_CounterBuffer;
+
+    // The path tracer reads the running average from one target and writes the updated one to
+    // the other, they swap roles every frame
+    Framebuffer m_AccumulationFBOs[2];
+    int m_AccumulationIndex;
     Framebuffer m_FinalOutputFBO;
 
     uint32_t m_EnvMapTex;
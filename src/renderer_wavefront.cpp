@@ -0,0 +1,203 @@
+#include <glad/glad.h>
+#include <algorithm>
+
+#include "renderer.h"
+
+// Wavefront path tracing: instead of one fragment invocation running a whole path, every bounce
+// is split into compute kernels connected by queues in storage buffers (see wavefront.glsl):
+//
+//   generate  camera rays for a chunk of pixels, all queued for extend
+//   extend    closest hit, finishes paths that miss or end on a light, sorts the rest by material
+//   shade     one dispatch per material class, queues shadow rays and the next bounce
+//   connect   traces the shadow rays and adds the light that got through
+//   resolve   averages the samples into the accumulation target
+//
+// Threads of a dispatch then run the same kind of work, rather than diffuse, glass and metal
+// hits and their light loops diverging within every warp. Queue lengths never leave the GPU,
+// queues.glsl turns them into the sizes of the indirect dispatches that follow.
+
+// Must match wavefront.glsl
+static const uint32_t WAVEFRONT_GROUP_SIZE = 64;
+enum { QUEUE_EXTEND = 0, QUEUE_SHADE_DIFFUSE, QUEUE_SHADE_METAL, QUEUE_SHADE_GLASS, QUEUE_CONNECT, QUEUE_COUNT };
+enum { STAGE_EXTEND = 0, STAGE_SHADE, STAGE_CONNECT };
+static const size_t PATH_STATE_SIZE = 96;
+static const size_t SHADOW_RAY_SIZE = 32;
+static const size_t SHADOW_RAYS_PER_PATH = 2;
+
+// Paths in flight at once, larger viewports are traced in several chunks
+static const uint32_t MAX_WAVEFRONT_PATHS = 1 << 20;
+
+void Renderer::CreateWavefront(const ApplicationSettings& settings)
+{
+    ShaderDefines defines = PathTraceDefines(settings);
+    m_GenerateKernel = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/generate.glsl", defines);
+    m_ExtendKernel   = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/extend.glsl", defines);
+    m_ShadeKernel    = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/shade.glsl", defines);
+    m_ConnectKernel  = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/connect.glsl", defines);
+    m_ResolveKernel  = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/resolve.glsl");
+    m_QueueKernel    = std::make_unique<Shader>(PATH_TO_SHADERS + "wavefront/queues.glsl");
+
+    m_PathBuffer.Create(13, 64 * PATH_STATE_SIZE);
+    m_ShadowRayBuffer.Create(14, 64 * SHADOW_RAYS_PER_PATH * SHADOW_RAY_SIZE);
+    m_QueueBuffer.Create(15, 64 * QUEUE_COUNT * sizeof(uint32_t));
+    m_CounterBuffer.Create(16, QUEUE_COUNT * 4 * sizeof(uint32_t));
+
+    Shader* kernels[] = { m_GenerateKernel.get(), m_ExtendKernel.get(), m_ShadeKernel.get(),
+        m_ConnectKernel.get(), m_ResolveKernel.get(), m_QueueKernel.get() };
+    for (Shader* kernel : kernels)
+    {
+        BindWavefrontBlocks(*kernel);
+        SetPathTraceUniformGuards(*kernel);
+    }
+
+    // Only the kernels drawing random numbers read the blue noise
+    for (Shader* kernel : { m_GenerateKernel.get(), m_ExtendKernel.get(), m_ShadeKernel.get() })
+    {
+        kernel->Bind();
+        kernel->SetUniformInt("u_BlueNoise", 1);
+    }
+    m_GenerateKernel->Unbind();
+}
+
+void Renderer::BindWavefrontBlocks(Shader& kernel)
+{
+    BindSceneBlocks(kernel);
+    kernel.SetSSBO("WavefrontPaths", 13);
+    kernel.SetSSBO("WavefrontShadowRays", 14);
+    kernel.SetSSBO("WavefrontQueues", 15);
+    kernel.SetSSBO("WavefrontCounters", 16);
+}
+
+void Renderer::DestroyWavefront()
+{
+    m_GenerateKernel.reset();
+    m_ExtendKernel.reset();
+    m_ShadeKernel.reset();
+    m_ConnectKernel.reset();
+    m_ResolveKernel.reset();
+    m_QueueKernel.reset();
+    m_PathBuffer.Destroy();
+    m_ShadowRayBuffer.Destroy();
+    m_QueueBuffer.Destroy();
+    m_CounterBuffer.Destroy();
+}
+
+void Renderer::RenderWavefront(const ApplicationSettings& settings, Framebuffer& currentFBO)
+{
+    if (!m_QueueKernel)
+        CreateWavefront(settings);
+
+    // The kernels tracing and shading rays are compiled for the current settings like pt.glsl.
+    // New permutations and reloaded programs start out without any bindings.
+    ShaderDefines defines = PathTraceDefines(settings);
+    for (Shader* kernel : { m_GenerateKernel.get(), m_ExtendKernel.get(), m_ShadeKernel.get(), m_ConnectKernel.get() })
+    {
+        if (kernel->SetPermutation(defines) || kernel->hasReloaded)
+        {
+            BindWavefrontBlocks(*kernel);
+            kernel->Bind();
+            kernel->SetUniformInt("u_BlueNoise", 1);
+            kernel->hasReloaded = false;
+        }
+    }
+    for (Shader* kernel : { m_ResolveKernel.get(), m_QueueKernel.get() })
+    {
+        if (kernel->hasReloaded)
+        {
+            BindWavefrontBlocks(*kernel);
+            kernel->hasReloaded = false;
+        }
+    }
+
+    uint32_t pixels = m_ViewportWidth * m_ViewportHeight;
+    uint32_t pathCapacity = std::min(pixels, MAX_WAVEFRONT_PATHS);
+    m_PathBuffer.Reserve(pathCapacity * PATH_STATE_SIZE);
+    m_ShadowRayBuffer.Reserve(pathCapacity * SHADOW_RAYS_PER_PATH * SHADOW_RAY_SIZE);
+    m_QueueBuffer.Reserve(pathCapacity * QUEUE_COUNT * sizeof(uint32_t));
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_CounterBuffer.GetID());
+    glBindImageTexture(0, currentFBO.GetTextureID(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+    int samples = std::max(m_Scene->samplesPerPixel, 1);
+    const GLbitfield queueBarrier = GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT;
+
+    auto dispatchQueue = [](int queue)
+    {
+        glDispatchComputeIndirect(queue * 3 * sizeof(uint32_t));
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    };
+    auto prepareStage = [this, queueBarrier](int stage)
+    {
+        m_QueueKernel->Bind();
+        m_QueueKernel->SetUniformInt("u_Stage", stage);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(queueBarrier);
+    };
+
+    for (uint32_t firstPixel = 0; firstPixel < pixels; firstPixel += pathCapacity)
+    {
+        int pathCount = (int) std::min(pathCapacity, pixels - firstPixel);
+        uint32_t groups = (pathCount + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+
+        // Chunk uniforms are read by the queue helpers in wavefront.glsl, connect.glsl needs no pixel
+        for (Shader* kernel : { m_GenerateKernel.get(), m_ExtendKernel.get(), m_ShadeKernel.get(), m_ResolveKernel.get() })
+        {
+            kernel->Bind();
+            kernel->SetUniformInt("u_PathCount", pathCount);
+            kernel->SetUniformInt("u_FirstPixel", (int) firstPixel);
+            kernel->SetUniformVec2("u_Resolution", float(m_ViewportWidth), float(m_ViewportHeight));
+        }
+        m_ConnectKernel->Bind();
+        m_ConnectKernel->SetUniformInt("u_PathCount", pathCount);
+
+        m_GenerateKernel->Bind();
+        m_GenerateKernel->SetUniformInt("u_SampleIterations", m_SampleIterations);
+
+        m_ExtendKernel->Bind();
+        m_ExtendKernel->SetUniformInt("u_TotalNodes", m_BVH->liveNodes);
+        m_ExtendKernel->SetUniformInt("u_EnvMapTex", 2);
+        m_ExtendKernel->SetUniformFloat("u_EnvMapRotation", m_Scene->envMapRotation);
+
+        for (int sample = 0; sample < samples; sample++)
+        {
+            m_GenerateKernel->Bind();
+            m_GenerateKernel->SetUniformInt("u_Sample", sample);
+            glDispatchCompute(groups, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            // Paths end early through misses, lights and Russian roulette, the dispatches
+            // for bounces nobody reaches any more come out empty
+            for (int bounce = 0; bounce < m_Scene->maxRayDepth; bounce++)
+            {
+                prepareStage(STAGE_EXTEND);
+                m_ExtendKernel->Bind();
+                dispatchQueue(QUEUE_EXTEND);
+
+                prepareStage(STAGE_SHADE);
+                m_ShadeKernel->Bind();
+                for (int queue = QUEUE_SHADE_DIFFUSE; queue <= QUEUE_SHADE_GLASS; queue++)
+                {
+                    m_ShadeKernel->SetUniformInt("u_Queue", queue);
+                    dispatchQueue(queue);
+                }
+
+                prepareStage(STAGE_CONNECT);
+                m_ConnectKernel->Bind();
+                dispatchQueue(QUEUE_CONNECT);
+            }
+        }
+
+        m_ResolveKernel->Bind();
+        m_ResolveKernel->SetUniformInt("u_AccumulationTexture", 0);
+        m_ResolveKernel->SetUniformInt("u_AccumulationImage", 0);
+        m_ResolveKernel->SetUniformInt("u_SamplesPerPixel", samples);
+        m_ResolveKernel->SetUniformInt("u_SampleIterations", m_SampleIterations);
+        glDispatchCompute(groups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    // The output pass samples the image written by resolve.glsl
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+    m_ResolveKernel->Unbind();
+}
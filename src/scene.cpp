@@ -27,6 +27,8 @@ void Scene::EmptyScene()
 {
     primitives.clear();
     lights.clear();
+    dirtyPrimitives.Clear();
+    dirtyLights.Clear();
 }
 
 void Scene::Init()
@@ -35,6 +37,7 @@ void Scene::Init()
     for (size_t n = 0; n < n_Primitives; n++)
     {
         primitives[n].id = (int) n;
+        dirtyPrimitives.Add(n);
         if (primitives[n].mat.emissive != glm::vec3(0.0f))
         {
             AddLight(primitives[n].id, primitives[n].mat.emissive);
@@ -51,6 +54,7 @@ void Scene::AddDefaultSphere()
     sphere.radius = 1.0f;
     sphere.mat.albedo = glm::vec3(1.0f);
     primitives.push_back(sphere);
+    dirtyPrimitives.Add(primitives.size() - 1);
 }
 
 void Scene::AddDefaultCube()
@@ -62,6 +66,7 @@ void Scene::AddDefaultCube()
     cube.dimensions = glm::vec3(2.0f);
     cube.mat.albedo = glm::vec3(1.0f);
     primitives.push_back(cube);
+    dirtyPrimitives.Add(primitives.size() - 1);
 }
 
 void Scene::AddSphere(glm::vec3 position, float radius, Material mat)
@@ -72,6 +77,7 @@ void Scene::AddSphere(glm::vec3 position, float radius, Material mat)
     sphere.radius = radius;
     sphere.mat = mat;
     primitives.push_back(sphere);
+    dirtyPrimitives.Add(primitives.size() - 1);
 }
 
 void Scene::AddCube(glm::vec3 position, glm::vec3 dimensions, glm::vec3 rotation, Material mat)
@@ -84,6 +90,7 @@ void Scene::AddCube(glm::vec3 position, glm::vec3 dimensions, glm::vec3 rotation
     cube.UpdateRotation();
     cube.mat = mat;
     primitives.push_back(cube);
+    dirtyPrimitives.Add(primitives.size() - 1);
 }
 
 void Scene::AddLight(size_t id, glm::vec3 le)
@@ -92,6 +99,36 @@ void Scene::AddLight(size_t id, glm::vec3 le)
     light.id = (int) id;
     light.le = le;
     lights.push_back(light);
+    dirtyLights.Add(lights.size() - 1);
+}
+
+void Scene::RemovePrimitive(size_t id)
+{
+    // Move the last primitive into the freed slot so no other index changes and only
+    // that slot has to be uploaded again
+    size_t last = primitives.size() - 1;
+    primitives[id] = primitives[last];
+    primitives[id].id = (int) id;
+    primitives.pop_back();
+    if (id < primitives.size())
+        dirtyPrimitives.Add(id);
+
+    // Drop lights attached to the primitive and follow the moved one
+    for (size_t n = 0; n < lights.size();)
+    {
+        if (lights[n].id == (int) id)
+        {
+            lights.erase(lights.begin() + n);
+            continue;
+        }
+        if (lights[n].id == (int) last)
+            lights[n].id = (int) id;
+        n++;
+    }
+    dirtyLights.Add(0, lights.size());
+
+    PrimitiveIdx = glm::min(PrimitiveIdx, glm::max(int(primitives.size()) - 1, 0));
+    LightIdx = glm::min(LightIdx, glm::max(int(lights.size()) - 1, 0));
 }
 
 void Scene::AddEnvMap(std::string filepath)
@@ -12,6 +12,7 @@
 #include "materials.h"
 #include "camera.h"
 #include "hdri.h"
+#include "utils.h"
 
 struct alignas(16) Light
 {
@@ -28,11 +29,10 @@ struct SceneBlock
     int Depth;
     int SelectedPrimIdx;
     int Day;
+    int n_Lights;
+    int n_Primitives;
 };
 
-const uint32_t MAX_PRIMITIVES = 100;
-const uint32_t MAX_LIGHTS = 100;
-
 class Scene
 {
 public:
@@ -77,11 +77,16 @@ public:
     std::vector<Light> lights;
     std::vector<Primitive> primitives;
 
+    // Elements of primitives and lights edited since the renderer last uploaded them
+    DirtySet dirtyPrimitives;
+    DirtySet dirtyLights;
+
     void AddDefaultSphere();
     void AddDefaultCube();
     void AddSphere(glm::vec3 position, float radius, Material mat);
     void AddCube(glm::vec3 position, glm::vec3 dimensions, glm::vec3 rotation, Material mat);
     void AddLight(size_t id, glm::vec3 le);
+    void RemovePrimitive(size_t id);
     void AddEnvMap(std::string filepath);
 
     Material CreateGlassMat(glm::vec3 absorption, float roughness);
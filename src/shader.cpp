@@ -1,36 +1,378 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
 #include "shader.h"
 
-Shader::Shader(std::string vs_path, std::string fs_path)
+// Bump whenever the layout of the program cache files changes
+static const uint32_t SHADER_CACHE_VERSION = 1;
+
+// File header, followed by length bytes of the binary returned by glGetProgramBinary
+struct ProgramCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;               // Hash of the expanded sources and the driver that built them
+    uint32_t format;            // Driver specific binary format
+    uint32_t length;
+};
+
+// From GL_KHR_parallel_shader_compile, which glad was generated without
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Without it, asking whether a program is linked waits for the compiler
+static bool ParallelCompileSupported()
+{
+    static const bool supported = []()
+    {
+        int count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (int i = 0; i < count; i++)
+        {
+            std::string extension = (const char*) glGetStringi(GL_EXTENSIONS, i);
+            if (extension == "GL_KHR_parallel_shader_compile" || extension == "GL_ARB_parallel_shader_compile")
+                return true;
+        }
+        return false;
+    }();
+    return supported;
+}
+
+static const char* StageName(uint32_t type)
+{
+    if (type == GL_VERTEX_SHADER) return "Vertex";
+    if (type == GL_COMPUTE_SHADER) return "Compute";
+    return "Frag";
+}
+
+static std::string PermutationKey(const ShaderDefines& defines)
+{
+    std::string key;
+    for (const auto& [name, value] : defines)
+        key += name + "=" + std::to_string(value) + ";";
+    return key;
+}
+
+// Binaries are only valid for the exact sources and the driver that produced them
+static uint64_t ProgramCacheKey(const std::vector<std::string>& sources)
+{
+    uint64_t hash = HASH_SEED;
+    HashValue(&hash, SHADER_CACHE_VERSION);
+    for (const std::string& source : sources)
+    {
+        HashValue(&hash, uint64_t(source.size()));
+        HashBytes(&hash, source.data(), source.size());
+    }
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+    {
+        const char* driver = (const char*) glGetString(name);
+        if (driver != nullptr)
+            HashBytes(&hash, driver, strlen(driver));
+    }
+    return hash;
+}
+
+static std::string ProgramCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "program_%016llx.bin", (unsigned long long) key);
+    return PATH_TO_SHADER_CACHE + name;
+}
+
+static bool BinaryFormatSupported(uint32_t format)
+{
+    int count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &count);
+    if (count <= 0)
+        return false;
+    std::vector<int> formats(count);
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+    return std::find(formats.begin(), formats.end(), int(format)) != formats.end();
+}
+
+Shader::Shader(std::string vs_path, std::string fs_path, const ShaderDefines& defines)
     : hasReloaded(false)
     , m_ID(0)
     , m_VSPath("")
     , m_FSPath("")
+    , m_Defines(defines)
+    , m_PermutationKey(PermutationKey(defines))
 {
     m_VSPath = vs_path.c_str();
     m_FSPath = fs_path.c_str();
-    std::string vs = ParseShader(vs_path);
-    std::string fs = ParseShader(fs_path);
-    m_ID = CreateShader(vs, fs);
+    m_ID = BuildProgram();
+    m_Permutations[m_PermutationKey] = m_ID;
+    std::cout << std::endl;
+}
+
+Shader::Shader(std::string cs_path, const ShaderDefines& defines)
+    : hasReloaded(false)
+    , m_ID(0)
+    , m_CSPath(cs_path)
+    , m_Defines(defines)
+    , m_PermutationKey(PermutationKey(defines))
+{
+    m_ID = BuildProgram();
+    m_Permutations[m_PermutationKey] = m_ID;
     std::cout << std::endl;
 }
 
 Shader::~Shader()
 {
-    glDeleteProgram(m_ID); 
+    CancelReload();
+    for (auto& [key, id] : m_Permutations)
+        glDeleteProgram(id);
     m_ID = 0;
 }
 
 void Shader::ReloadShader()
 {
-    std::string vs_path = std::string(m_VSPath);
-    std::string fs_path = std::string(m_FSPath);
-    std::string vs = ParseShader(vs_path);
-    std::string fs = ParseShader(fs_path);
-    uint32_t tempID = CreateShader(vs, fs);
-    glDeleteProgram(m_ID); 
-    m_ID = tempID;
+    CancelReload();
+
+    // An unchanged shader comes straight out of the program cache
+    std::vector<std::string> sources = ExpandSources();
+    uint64_t key = ProgramCacheKey(sources);
+    if (uint32_t programID = LoadProgramBinary(key))
+    {
+        SwapProgram(programID);
+        std::cout << std::endl;
+        return;
+    }
+
+    // Compile and link are only issued here, nothing asks for their results until PollReload
+    std::vector<uint32_t> types = StageTypes();
+    m_PendingID = glCreateProgram();
+    m_PendingKey = key;
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        uint32_t id = SubmitShader(types[i], sources[i]);
+        glAttachShader(m_PendingID, id);
+        m_PendingShaders.push_back(id);
+    }
+    glProgramParameteri(m_PendingID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(m_PendingID);
+}
+
+bool Shader::PollReload()
+{
+    if (!m_PendingID)
+        return false;
+
+    if (ParallelCompileSupported())
+    {
+        int completed = GL_FALSE;
+        glGetProgramiv(m_PendingID, GL_COMPLETION_STATUS_KHR, &completed);
+        if (completed == GL_FALSE)
+            return false;
+    }
+
+    std::vector<uint32_t> types = StageTypes();
+    bool compiled = true;
+    for (size_t i = 0; i < m_PendingShaders.size(); i++)
+        compiled = CheckShader(types[i], m_PendingShaders[i]) && compiled;
+
+    uint32_t programID = m_PendingID;
+    uint64_t key = m_PendingKey;
+    for (uint32_t id : m_PendingShaders)
+    {
+        glDetachShader(programID, id);
+        glDeleteShader(id);
+    }
+    m_PendingShaders.clear();
+    m_PendingID = 0;
+
+    if (compiled)
+        programID = CheckProgram(programID);
+    else
+    {
+        glDeleteProgram(programID);
+        programID = 0;
+    }
+
+    if (!programID)
+    {
+        std::cout << "Reload failed, keeping the previous program" << std::endl << std::endl;
+        return false;
+    }
+
+    SaveProgramBinary(programID, key);
+    SwapProgram(programID);
+    std::cout << std::endl;
+    return true;
+}
+
+void Shader::SwapProgram(uint32_t programID)
+{
+    // The other permutations were built from the old sources, they are rebuilt on their next use
+    for (auto& [key, id] : m_Permutations)
+        glDeleteProgram(id);
+    m_Permutations.clear();
+
+    m_ID = programID;
+    m_Permutations[m_PermutationKey] = m_ID;
+    m_UniformLocationCache.clear();
     hasReloaded = true;
+}
+
+void Shader::CancelReload()
+{
+    for (uint32_t id : m_PendingShaders)
+        glDeleteShader(id);
+    m_PendingShaders.clear();
+    if (m_PendingID)
+        glDeleteProgram(m_PendingID);
+    m_PendingID = 0;
+}
+
+bool Shader::SetPermutation(const ShaderDefines& defines)
+{
+    std::string key = PermutationKey(defines);
+    if (key == m_PermutationKey)
+        return false;
+
+    // A reload still in flight was for the old permutation. Its sources are read again for the
+    // new one below, but the programs cached for other permutations may be out of date.
+    if (m_PendingID)
+    {
+        CancelReload();
+        for (auto& [name, id] : m_Permutations)
+            glDeleteProgram(id);
+        m_Permutations.clear();
+    }
+
+    m_Defines = defines;
+    m_PermutationKey = key;
+    m_UniformLocationCache.clear();
+
+    auto it = m_Permutations.find(key);
+    if (it != m_Permutations.end())
+    {
+        m_ID = it->second;
+        return false;
+    }
+
+    m_ID = BuildProgram();
+    m_Permutations[key] = m_ID;
     std::cout << std::endl;
+    return true;
+}
+
+std::vector<std::string> Shader::ExpandSources()
+{
+    if (!m_CSPath.empty())
+        return { InjectDefines(ParseShader(m_CSPath)) };
+    return { InjectDefines(ParseShader(m_VSPath)), InjectDefines(ParseShader(m_FSPath)) };
+}
+
+// In the order of ExpandSources
+std::vector<uint32_t> Shader::StageTypes() const
+{
+    if (!m_CSPath.empty())
+        return { GL_COMPUTE_SHADER };
+    return { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+}
+
+uint32_t Shader::BuildProgram()
+{
+    std::vector<std::string> sources = ExpandSources();
+
+    // Compiling the expanded sources is the slow part, skip it when a matching binary was cached
+    uint64_t key = ProgramCacheKey(sources);
+    uint32_t programID = LoadProgramBinary(key);
+    if (programID)
+        return programID;
+
+    programID = m_CSPath.empty() ? CreateShader(sources[0], sources[1]) : CreateComputeShader(sources[0]);
+    if (programID)
+        SaveProgramBinary(programID, key);
+    return programID;
+}
+
+uint32_t Shader::LoadProgramBinary(uint64_t key)
+{
+    std::string path = ProgramCachePath(key);
+    std::error_code error;
+    uintmax_t fileSize = std::filesystem::file_size(path, error);
+    if (error)
+        return 0;
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return 0;
+
+    // The length is checked against the file before anything is allocated for it, so a
+    // truncated or corrupt file is a miss rather than a huge allocation
+    ProgramCacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, "PRGC", 4) != 0
+        || header.version != SHADER_CACHE_VERSION || header.key != key || header.length == 0
+        || fileSize != sizeof(ProgramCacheHeader) + uintmax_t(header.length) || !BinaryFormatSupported(header.format))
+    {
+        std::cout << "Ignoring stale or corrupt program cache " << path << std::endl;
+        return 0;
+    }
+
+    std::vector<char> binary(header.length);
+    if (!file.read(binary.data(), header.length))
+        return 0;
+
+    uint32_t programID = glCreateProgram();
+    glProgramBinary(programID, header.format, binary.data(), (GLsizei) header.length);
+
+    // Drivers refuse binaries they can no longer run, those programs are compiled from source again
+    int result;
+    glGetProgramiv(programID, GL_LINK_STATUS, &result);
+    if (result == GL_FALSE)
+    {
+        glDeleteProgram(programID);
+        return 0;
+    }
+
+    uint32_t type = m_CSPath.empty() ? GL_FRAGMENT_SHADER : GL_COMPUTE_SHADER;
+    std::cout << "\033[1;32m[CACHED]\033[0;37m " << StageName(type) << " Program Loaded - ";
+    std::cout << StagePath(type) << std::endl;
+
+    return programID;
+}
+
+void Shader::SaveProgramBinary(uint32_t programID, uint64_t key) const
+{
+    int length = 0;
+    glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(programID, length, &length, &format, binary.data());
+    if (length <= 0)
+        return;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, "PRGC", 4);
+    header.version = SHADER_CACHE_VERSION;
+    header.key = key;
+    header.format = format;
+    header.length = (uint32_t) length;
+
+    std::string path = ProgramCachePath(key);
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    // Written next to the target and renamed over it, so a reader never sees a partial file
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(binary.data(), length);
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(tempPath, path, error);
+    if (error)
+        std::cout << "Failed to write program cache " << path << std::endl;
 }
 
 std::string Shader::ParseShader(const std::string& filepath)
@@ -58,13 +400,50 @@ std::string Shader::ParseShader(const std::string& filepath)
     return ss.str();
 }
 
+std::string Shader::InjectDefines(const std::string& source) const
+{
+    if (m_Defines.empty())
+        return source;
+
+    std::stringstream ss;
+    for (const auto& [name, value] : m_Defines)
+        ss << "#define " << name << " " << value << "\n";
+
+    // Nothing but comments may come before #version
+    size_t version = source.find("#version");
+    size_t insert = version == std::string::npos ? 0 : source.find('\n', version) + 1;
+    return source.substr(0, insert) + ss.str() + source.substr(insert);
+}
+
+const std::string& Shader::StagePath(uint32_t type) const
+{
+    if (type == GL_VERTEX_SHADER) return m_VSPath;
+    if (type == GL_COMPUTE_SHADER) return m_CSPath;
+    return m_FSPath;
+}
+
 uint32_t Shader::CompileShader(uint32_t type, const std::string& source)
+{
+    uint32_t id = SubmitShader(type, source);
+    if (!CheckShader(type, id))
+    {
+        glDeleteShader(id); 
+        return 0;
+    }
+    return id;
+}
+
+uint32_t Shader::SubmitShader(uint32_t type, const std::string& source)
 {
     uint32_t id = glCreateShader(type); 
     const char* src = source.c_str();
     glShaderSource(id, 1, &src, NULL); 
     glCompileShader(id); 
+    return id;
+}
 
+bool Shader::CheckShader(uint32_t type, uint32_t id)
+{
     int result;
     glGetShaderiv(id, GL_COMPILE_STATUS, &result); 
     if (result == GL_FALSE)
@@ -73,18 +452,17 @@ uint32_t Shader::CompileShader(uint32_t type, const std::string& source)
         glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length); 
         char* message = (char*)alloca(length * sizeof(char));
         glGetShaderInfoLog(id, length, &length, message); 
-        std::cout << "\033[1;31m[ERROR]\033[0;37m " << (type == GL_VERTEX_SHADER ? "Vertex" : "Frag") << " Shader Did Not Compile - ";
-        std::cout << (type == GL_VERTEX_SHADER ? m_VSPath : m_FSPath) << std::endl;
+        std::cout << "\033[1;31m[ERROR]\033[0;37m " << StageName(type) << " Shader Did Not Compile - ";
+        std::cout << StagePath(type) << std::endl;
         std::cout << message << std::endl;
-        glDeleteShader(id); 
 
-        return 0;
+        return false;
     }
 
-    std::cout << "\033[1;32m[SUCCESS]\033[0;37m " << (type == GL_VERTEX_SHADER ? "Vertex" : "Frag") << " Shader Compiled - ";
-    std::cout << (type == GL_VERTEX_SHADER ? m_VSPath : m_FSPath) << std::endl;
+    std::cout << "\033[1;32m[SUCCESS]\033[0;37m " << StageName(type) << " Shader Compiled - ";
+    std::cout << StagePath(type) << std::endl;
 
-    return id;
+    return true;
 }
 
 uint32_t Shader::CreateShader(const std::string& vertexShader, const std::string& fragmentShader)
@@ -100,9 +478,41 @@ uint32_t Shader::CreateShader(const std::string& vertexShader, const std::string
     // link shaders into one program
     glAttachShader(programID, vs); 
     glAttachShader(programID, fs); 
+    programID = LinkProgram(programID);
+
+    glDeleteShader(vs); 
+    glDeleteShader(fs); 
+
+    return programID;
+}
+
+uint32_t Shader::CreateComputeShader(const std::string& computeShader)
+{
+    uint32_t programID = glCreateProgram();
+    uint32_t cs = CompileShader(GL_COMPUTE_SHADER, computeShader);
+
+    if (!cs)
+        return 0;
+
+    glAttachShader(programID, cs);
+    programID = LinkProgram(programID);
+    glDeleteShader(cs);
+
+    return programID;
+}
+
+uint32_t Shader::LinkProgram(uint32_t programID)
+{
+    // Lets the driver keep what glGetProgramBinary needs for the program cache
+    glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(programID); 
     glValidateProgram(programID); 
 
+    return CheckProgram(programID);
+}
+
+uint32_t Shader::CheckProgram(uint32_t programID)
+{
     int result;
     glGetProgramiv(programID, GL_LINK_STATUS, &result); 
     if (result == GL_FALSE)
@@ -119,9 +529,6 @@ uint32_t Shader::CreateShader(const std::string& vertexShader, const std::string
 
     // std::cout << "Successfully linked shaders" << std::endl; 
 
-    glDeleteShader(vs); 
-    glDeleteShader(fs); 
-
     return programID;
 }
 
@@ -168,7 +575,31 @@ void Shader::SetUniformMat4(const std::string& name, const glm::mat4& matrix)
 void Shader::SetUBO(const std::string& name, uint32_t bind)
 {
     uint32_t block = glGetUniformBlockIndex(m_ID, name.c_str());
-    glUniformBlockBinding(m_ID, block, bind);
+    if (block != GL_INVALID_INDEX)
+        glUniformBlockBinding(m_ID, block, bind);
+}
+
+void Shader::SetSSBO(const std::string& name, uint32_t bind)
+{
+    uint32_t block = glGetProgramResourceIndex(m_ID, GL_SHADER_STORAGE_BLOCK, name.c_str());
+    if (block != GL_INVALID_INDEX)
+        glShaderStorageBlockBinding(m_ID, block, bind);
+}
+
+void Shader::SetUniformGuard(const std::string& uniform, const std::string& define)
+{
+    m_UniformGuards[uniform] = define;
+}
+
+bool Shader::IsCompiledOut(const std::string& uniform) const
+{
+    auto guard = m_UniformGuards.find(uniform);
+    if (guard == m_UniformGuards.end())
+        return false;
+    for (const auto& [name, value] : m_Defines)
+        if (name == guard->second)
+            return value == 0;
+    return false;
 }
 
 uint32_t Shader::GetUniformLocation(const std::string &name)
@@ -177,7 +608,7 @@ uint32_t Shader::GetUniformLocation(const std::string &name)
         return m_UniformLocationCache[name];
 
     uint32_t location = glGetUniformLocation(m_ID, name.c_str());
-    if (location == -1)
+    if (location == -1 && !IsCompiledOut(name))
         std::cout << "[Warning] Uniform '" << name << "' doesn't exist!" << std::endl;
     
     m_UniformLocationCache[name] = location;
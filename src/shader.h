@@ -8,18 +8,33 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
 #include "utils.h"
 
+// #define NAME VALUE lines that select a compile-time permutation of a shader
+typedef std::vector<std::pair<std::string, int>> ShaderDefines;
+
 class Shader
 {
 public:
     // Constructor reads and builds shader
-    Shader(std::string vs_path, std::string fs_path);
+    Shader(std::string vs_path, std::string fs_path, const ShaderDefines& defines = {});
+    // Compute shader program
+    Shader(std::string cs_path, const ShaderDefines& defines = {});
     ~Shader();
 
     void Bind() const;
     void Unbind() const;
+    // Rebuilds the program from the current sources in the background, the old program keeps
+    // being used until PollReload finds the new one linked
     void ReloadShader();
+    // Swaps in the reloaded program once the driver is done with it, returns true when it did.
+    // A program that failed to compile or link is dropped and the old one kept.
+    bool PollReload();
+    bool IsReloading() const { return m_PendingID != 0; }
+    // Switches to the program built with these defines, compiling and caching it on first use.
+    // Returns true for a freshly built program, whose blocks and samplers are still unbound.
+    bool SetPermutation(const ShaderDefines& defines);
     uint32_t GetID() { return m_ID; }
 
     void SetUniformInt(const std::string& name, int val);
@@ -28,18 +43,47 @@ public:
     void SetUniformVec3(const std::string& name, float val0, float val1, float val2);
     void SetUniformVec4(const std::string& name, float val0, float val1, float val2, float val3);
     void SetUniformMat4(const std::string& name, const glm::mat4& matrix);
+    // Marks _uniform_ as read only by code the permutation compiles out while _define_ is 0,
+    // so it missing from such a program is not warned about
+    void SetUniformGuard(const std::string& uniform, const std::string& define);
     void SetUBO(const std::string& name, uint32_t bind);
+    void SetSSBO(const std::string& name, uint32_t bind);
 
     bool hasReloaded;
 
 private:
     std::string ParseShader(const std::string& filepath);
+    std::string InjectDefines(const std::string& source) const;
+    std::vector<std::string> ExpandSources();
+    std::vector<uint32_t> StageTypes() const;
+    uint32_t BuildProgram();
+    void SwapProgram(uint32_t programID);
+    void CancelReload();
+    uint32_t LoadProgramBinary(uint64_t key);
+    void SaveProgramBinary(uint32_t programID, uint64_t key) const;
     uint32_t CreateShader(const std::string& vertexShader, const std::string& fragmentShader);
+    uint32_t CreateComputeShader(const std::string& computeShader);
+    uint32_t LinkProgram(uint32_t programID);
     uint32_t CompileShader(uint32_t type, const std::string& source);
+    uint32_t SubmitShader(uint32_t type, const std::string& source);
+    bool CheckShader(uint32_t type, uint32_t id);
+    uint32_t CheckProgram(uint32_t programID);
     uint32_t GetUniformLocation(const std::string& name);
+    bool IsCompiledOut(const std::string& uniform) const;
+    const std::string& StagePath(uint32_t type) const;
 
     uint32_t m_ID;
     std::unordered_map<std::string, uint32_t> m_UniformLocationCache;
     std::string m_FSPath;
     std::string m_VSPath;
+    std::string m_CSPath;
+    ShaderDefines m_Defines;
+    std::string m_PermutationKey;
+    std::unordered_map<std::string, uint32_t> m_Permutations;
+    std::unordered_map<std::string, std::string> m_UniformGuards;
+
+    // Program being built by ReloadShader, with the shaders still attached to it
+    uint32_t m_PendingID = 0;
+    std::vector<uint32_t> m_PendingShaders;
+    uint64_t m_PendingKey = 0;
 };
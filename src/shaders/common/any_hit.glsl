@@ -1,4 +1,5 @@
-bool AnyHitBVHTraversal(in Ray r, float tNear, float tFar, inout Payload payload)
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BINARY)
+bool AnyHitBVHTraversal(in Ray r, inout Payload payload)
 {
     bool hit = false;
     vec3 invDir = 1.0 / r.direction;
@@ -9,24 +10,25 @@ bool AnyHitBVHTraversal(in Ray r, float tNear, float tFar, inout Payload payload
 	int toVisitOffset = 0;
     int currentNodeIndex = 0;
 
-    tNear = FLT_MIN;
-
 	while (true) 
 	{
 		LinearBVHNode node = bvh.bvh[currentNodeIndex];
-        // Check if ray intersects the node's bounding box
+        // Check if ray intersects the node's bounding box before the occluder distance
+        float tNear = 0.0, tFar = payload.t;
 		if (Slabs(node.bMin.xyz, node.bMax.xyz, r, tNear, tFar, invDir))
 		{
 			if (node.n_Primitives > 0)
 			{
-                int i = node.primitiveOffset;
-                Primitive p = Prims.Primitives[bvh.PrimitiveIndexBuffer[i]];
-                if (Intersect(r, p, payload))
-                {   
-                    // payload returned with closest intersection point so far
-                    hit = true;
-                    payload.primID = p.id;
-                    return hit;
+                for (int i = 0; i < node.n_Primitives; i++)
+                {
+                    int primIdx = bvhIndices.PrimitiveIndexBuffer[node.primitiveOffset + i];
+                    if (Intersect(r, primIdx, payload))
+                    {   
+                        // payload returned with closest intersection point so far
+                        hit = true;
+                        payload.primID = primIdx;
+                        return hit;
+                    }
                 }
 
                 if (toVisitOffset == 0) break;
@@ -36,13 +38,13 @@ bool AnyHitBVHTraversal(in Ray r, float tNear, float tFar, inout Payload payload
             {
                 if (dirIsNeg[node.axis] == 1)
                 {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    nodesToVisit[toVisitOffset++] = int(node.bMin.w); // first child
                     currentNodeIndex = int(node.bMax.w); // node.secondChildOffset;
                 }
                 else
                 {
                     nodesToVisit[toVisitOffset++] = int(node.bMax.w); // node.secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    currentNodeIndex = int(node.bMin.w); // first child
                 }
             }
         }
@@ -54,26 +56,196 @@ bool AnyHitBVHTraversal(in Ray r, float tNear, float tFar, inout Payload payload
 	}
     return hit;
 }
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BVH4)
+bool AnyHitBVH4Traversal(in Ray r, inout Payload payload)
+{
+    vec3 invDir = 1.0 / r.direction;
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+	while (true) 
+	{
+		LinearBVH4Node node = bvh4.nodes[currentNodeIndex];
+
+        // Nearer children are more likely to hold an occluder, so visit them first
+        vec4 tNear = Slabs4(node, r, invDir, payload.t);
+        ivec4 order = ivec4(0, 1, 2, 3);
+        SortChildren(tNear, order);
+
+        for (int i = 0; i < 4; i++)
+        {
+            int c = order[i];
+            if (tNear[i] == INF) break;
+            for (int j = 0; j < node.count[c]; j++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[node.child[c] + j];
+                if (Intersect(r, primIdx, payload))
+                {
+                    payload.primID = primIdx;
+                    return true;
+                }
+            }
+        }
+
+        for (int i = 3; i >= 0; i--)
+        {
+            int c = order[i];
+            if (tNear[i] != INF && node.count[c] == 0)
+                nodesToVisit[toVisitOffset++] = node.child[c];
+        }
+
+        if (toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+	}
+    return false;
+}
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_QUANTIZED)
+bool AnyHitQuantizedTraversal(in Ray r, inout Payload payload)
+{
+    vec3 invDir = 1.0 / r.direction;
+    int dirIsNeg[3] = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+	while (true) 
+	{
+		QuantizedBVHNode node = qbvh.nodes[currentNodeIndex];
+        if ((node.meta & QUANTIZED_LEAF) != 0u)
+        {
+            int count = int(node.meta & ~QUANTIZED_LEAF);
+            for (int i = 0; i < count; i++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[int(node.data.w) + i];
+                if (Intersect(r, primIdx, payload))
+                {
+                    payload.primID = primIdx;
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            // Children are stored next to each other, test both boxes and descend into the nearer one
+            vec3 bMin0, bMax0, bMin1, bMax1;
+            DecodeChildBounds(node, 0, bMin0, bMax0);
+            DecodeChildBounds(node, 1, bMin1, bMax1);
+            float tNear0 = 0.0, tFar0 = payload.t;
+            float tNear1 = 0.0, tFar1 = payload.t;
+            bool hit0 = Slabs(bMin0, bMax0, r, tNear0, tFar0, invDir);
+            bool hit1 = Slabs(bMin1, bMax1, r, tNear1, tFar1, invDir);
+
+            int firstChild = int(node.data.w);
+            int axis = int((node.meta >> 24) & 3u);
+            int nearChild = firstChild + dirIsNeg[axis];
+            int farChild = firstChild + 1 - dirIsNeg[axis];
+            bool hitNear = dirIsNeg[axis] == 1 ? hit1 : hit0;
+            bool hitFar = dirIsNeg[axis] == 1 ? hit0 : hit1;
+
+            if (hitNear)
+            {
+                if (hitFar) nodesToVisit[toVisitOffset++] = farChild;
+                currentNodeIndex = nearChild;
+                continue;
+            }
+            if (hitFar)
+            {
+                currentNodeIndex = farChild;
+                continue;
+            }
+        }
+
+        if (toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+	}
+    return false;
+}
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_STACKLESS)
+bool AnyHitStacklessTraversal(in Ray r, inout Payload payload)
+{
+    vec3 invDir = 1.0 / r.direction;
+
+    // Follows the precomputed links instead of keeping a stack of nodes to visit
+    int currentNodeIndex = 0;
+    while (currentNodeIndex != -1)
+    {
+        StacklessBVHNode node = sbvh.nodes[currentNodeIndex];
+        float tNear = 0.0, tFar = payload.t;
+        if (Slabs(node.bMin, node.bMax, r, tNear, tFar, invDir))
+        {
+            int count = int(node.primitiveData & 0xFFu);
+            for (int i = 0; i < count; i++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[int(node.primitiveData >> 8) + i];
+                if (Intersect(r, primIdx, payload))
+                {
+                        payload.primID = primIdx;
+                        return true;
+                }
+            }
+            // Descend into the first child, or move past a finished leaf
+            currentNodeIndex = count > 0 ? node.missLink : currentNodeIndex + 1;
+        }
+        else
+        {
+            currentNodeIndex = node.missLink;
+        }
+    }
+    return false;
+}
+#endif
 
 bool AnyHit(Ray ray, inout Payload payload, float dist)
 {
     payload.t = dist;
-    float tNear = FLT_MIN;
-    float tFar = INF;
-    if (u_BVHEnabled == 1)
+    // Only the traversals whose blocks the permutation declares are compiled in. The tree of an
+    // empty scene is a lone leaf without primitives, which is not worth traversing.
+    bool useBVH = u_BVHEnabled == 1 && Scene.n_Primitives > 0;
+    if (useBVH && u_InstancingEnabled == 1)
+    {
+#if USES_TLAS
+        float nodeVisits = 0.0;
+        return TLASTraversal(ray, payload, nodeVisits, true);
+#endif
+    }
+    else if (useBVH)
     {  
-       return AnyHitBVHTraversal(ray, tNear, tFar, payload);
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BVH4)
+        if (u_BVHLayout == BVH_LAYOUT_BVH4)
+            return AnyHitBVH4Traversal(ray, payload);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_QUANTIZED)
+        if (u_BVHLayout == BVH_LAYOUT_QUANTIZED)
+            return AnyHitQuantizedTraversal(ray, payload);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_STACKLESS)
+        if (u_BVHLayout == BVH_LAYOUT_STACKLESS)
+            return AnyHitStacklessTraversal(ray, payload);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BINARY)
+        if (u_BVHLayout == BVH_LAYOUT_BINARY)
+            return AnyHitBVHTraversal(ray, payload);
+#endif
     }
     else
     {
-        for (int k = 0; k < Prims.n_Primitives; k++)
+        for (int k = 0; k < Scene.n_Primitives; k++)
         {
-            if (Intersect(ray, Prims.Primitives[k], payload))
+            if (Intersect(ray, k, payload))
             {
-                payload.primID = Prims.Primitives[k].id;
+                payload.primID = k;
                 return true;
             }
         }
-        return false;
     }
+    return false;
 }
@@ -1,81 +1,285 @@
-void ClosestHitBVHTraversal(in Ray r, float tNear, float tFar, inout Payload payload, inout float nodeVisits)
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BINARY)
+void ClosestHitBVHTraversal(in Ray r, inout Payload payload, inout float nodeVisits)
 {
-    bool hit = false;
     vec3 invDir = 1.0 / r.direction;
-    int dirIsNeg[3] = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
 
-	// PBRT v3 BVH Traversal
+	// Both children are tested before descending, so the nearer one is visited first and
+	// the farther one is deferred along with its entry distance. By the time it is popped
+	// a closer hit may have been found, in which case it is skipped without being fetched.
 	int nodesToVisit[STACK_SIZE];	
+	float nodeDistances[STACK_SIZE];
 	int toVisitOffset = 0;
     int currentNodeIndex = 0;
 
-    tNear = FLT_MIN;
+    float tNear = 0.0;
+    float tFar = payload.t;
+    if (!Slabs(bvh.bvh[0].bMin.xyz, bvh.bvh[0].bMax.xyz, r, tNear, tFar, invDir))
+        return;
 
 	while (true) 
 	{
 		LinearBVHNode node = bvh.bvh[currentNodeIndex];
-        // Check if ray intersects the node's bounding box
-		if (Slabs(node.bMin.xyz, node.bMax.xyz, r, tNear, tFar, invDir))
-		{
-            nodeVisits += 1.;
-
-			if (node.n_Primitives > 0)
-			{
-                int i = node.primitiveOffset;
-                Primitive p = Prims.Primitives[bvh.PrimitiveIndexBuffer[i]];
-                if (Intersect(r, p, payload))
+        nodeVisits += 1.;
+
+        if (node.n_Primitives > 0)
+        {
+            for (int i = 0; i < node.n_Primitives; i++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[node.primitiveOffset + i];
+                if (Intersect(r, primIdx, payload))
                 {   
                     // payload returned with closest intersection point so far
-                    hit = true;
-                    payload.primID = p.id;
+                    payload.primID = primIdx;
                 }
+            }
+        }
+        else
+        {
+            int nearChild = int(node.bMin.w); // first child
+            int farChild = int(node.bMax.w); // node.secondChildOffset;
+            LinearBVHNode child0 = bvh.bvh[nearChild];
+            LinearBVHNode child1 = bvh.bvh[farChild];
 
-                if (toVisitOffset == 0) break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
-			}
-            else
+            // Children entered behind the closest hit so far are culled by clipping to payload.t
+            float tNear0 = 0.0, tFar0 = payload.t;
+            float tNear1 = 0.0, tFar1 = payload.t;
+            bool hitNear = Slabs(child0.bMin.xyz, child0.bMax.xyz, r, tNear0, tFar0, invDir);
+            bool hitFar = Slabs(child1.bMin.xyz, child1.bMax.xyz, r, tNear1, tFar1, invDir);
+
+            if (hitNear && hitFar && tNear1 < tNear0)
+            {
+                int c = nearChild; nearChild = farChild; farChild = c;
+                float t = tNear0; tNear0 = tNear1; tNear1 = t;
+            }
+            else if (!hitNear)
             {
-                if (dirIsNeg[node.axis] == 1)
+                nearChild = farChild;
+                tNear0 = tNear1;
+                hitNear = hitFar;
+                hitFar = false;
+            }
+
+            if (hitNear)
+            {
+                if (hitFar)
                 {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = int(node.bMax.w); // node.secondChildOffset;
+                    nodesToVisit[toVisitOffset] = farChild;
+                    nodeDistances[toVisitOffset++] = tNear1;
                 }
-                else
+                currentNodeIndex = nearChild;
+                continue;
+            }
+        }
+
+        // Pop the nearest deferred node that still lies in front of the closest hit
+        currentNodeIndex = -1;
+        while (toVisitOffset > 0)
+        {
+            toVisitOffset--;
+            if (nodeDistances[toVisitOffset] <= payload.t)
+            {
+                currentNodeIndex = nodesToVisit[toVisitOffset];
+                break;
+            }
+        }
+        if (currentNodeIndex == -1) break;
+	}
+}
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BVH4)
+void ClosestHitBVH4Traversal(in Ray r, inout Payload payload, inout float nodeVisits)
+{
+    vec3 invDir = 1.0 / r.direction;
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+	while (true) 
+	{
+		LinearBVH4Node node = bvh4.nodes[currentNodeIndex];
+        nodeVisits += 1.;
+
+        // Test all four children, then visit the ones that were hit front to back
+        vec4 tNear = Slabs4(node, r, invDir, payload.t);
+        ivec4 order = ivec4(0, 1, 2, 3);
+        SortChildren(tNear, order);
+
+        // Leaves are intersected straight away so payload.t shrinks before the
+        // remaining children are culled against it
+        for (int i = 0; i < 4; i++)
+        {
+            int c = order[i];
+            if (tNear[i] == INF || tNear[i] > payload.t) break;
+            for (int j = 0; j < node.count[c]; j++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[node.child[c] + j];
+                if (Intersect(r, primIdx, payload))
+                {
+                    payload.primID = primIdx;
+                }
+            }
+        }
+
+        // Push interior children far to near so the nearest is popped first
+        for (int i = 3; i >= 0; i--)
+        {
+            int c = order[i];
+            if (tNear[i] != INF && tNear[i] <= payload.t && node.count[c] == 0)
+                nodesToVisit[toVisitOffset++] = node.child[c];
+        }
+
+        if (toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+	}
+}
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_QUANTIZED)
+void ClosestHitQuantizedTraversal(in Ray r, inout Payload payload, inout float nodeVisits)
+{
+    vec3 invDir = 1.0 / r.direction;
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+	while (true) 
+	{
+		QuantizedBVHNode node = qbvh.nodes[currentNodeIndex];
+        nodeVisits += 1.;
+        if ((node.meta & QUANTIZED_LEAF) != 0u)
+        {
+            int count = int(node.meta & ~QUANTIZED_LEAF);
+            for (int i = 0; i < count; i++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[int(node.data.w) + i];
+                if (Intersect(r, primIdx, payload))
                 {
-                    nodesToVisit[toVisitOffset++] = int(node.bMax.w); // node.secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    payload.primID = primIdx;
                 }
             }
         }
-        else 
+        else
         {
-            if (toVisitOffset == 0) break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
+            // Children are stored next to each other, test both boxes and descend into the nearer one
+            vec3 bMin0, bMax0, bMin1, bMax1;
+            DecodeChildBounds(node, 0, bMin0, bMax0);
+            DecodeChildBounds(node, 1, bMin1, bMax1);
+            float tNear0 = 0.0, tFar0 = payload.t;
+            float tNear1 = 0.0, tFar1 = payload.t;
+            bool hit0 = Slabs(bMin0, bMax0, r, tNear0, tFar0, invDir);
+            bool hit1 = Slabs(bMin1, bMax1, r, tNear1, tFar1, invDir);
+
+            // The nearer child is the one the ray enters first
+            int firstChild = int(node.data.w);
+            int order = int(hit1 && (!hit0 || tNear1 < tNear0));
+            int nearChild = firstChild + order;
+            int farChild = firstChild + 1 - order;
+            bool hitNear = order == 1 ? hit1 : hit0;
+            bool hitFar = order == 1 ? hit0 : hit1;
+
+            if (hitNear)
+            {
+                if (hitFar) nodesToVisit[toVisitOffset++] = farChild;
+                currentNodeIndex = nearChild;
+                continue;
+            }
+            if (hitFar)
+            {
+                currentNodeIndex = farChild;
+                continue;
+            }
         }
+
+        if (toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
 	}
 }
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_STACKLESS)
+void ClosestHitStacklessTraversal(in Ray r, inout Payload payload, inout float nodeVisits)
+{
+    vec3 invDir = 1.0 / r.direction;
+
+    // Follows the precomputed links instead of keeping a stack of nodes to visit
+    int currentNodeIndex = 0;
+    while (currentNodeIndex != -1)
+    {
+        StacklessBVHNode node = sbvh.nodes[currentNodeIndex];
+        nodeVisits += 1.;
+        float tNear = 0.0, tFar = payload.t;
+        if (Slabs(node.bMin, node.bMax, r, tNear, tFar, invDir))
+        {
+            int count = int(node.primitiveData & 0xFFu);
+            for (int i = 0; i < count; i++)
+            {
+                int primIdx = bvhIndices.PrimitiveIndexBuffer[int(node.primitiveData >> 8) + i];
+                if (Intersect(r, primIdx, payload))
+                {
+                        payload.primID = primIdx;
+                }
+            }
+            // Descend into the first child, or move past a finished leaf
+            currentNodeIndex = count > 0 ? node.missLink : currentNodeIndex + 1;
+        }
+        else
+        {
+            currentNodeIndex = node.missLink;
+        }
+    }
+}
+#endif
 
 Payload ClosestHit(Ray ray, float dist, inout float nodeVisits)
 {
     Payload payload;
     payload.t = dist;
-    float tNear = FLT_MIN;
-    float tFar = INF;
+    payload.primID = -1;
 
-    if (u_BVHEnabled == 1)
+    // Only the traversals whose blocks the permutation declares are compiled in. The tree of an
+    // empty scene is a lone leaf without primitives, which is not worth traversing.
+    bool useBVH = u_BVHEnabled == 1 && Scene.n_Primitives > 0;
+    if (useBVH && u_InstancingEnabled == 1)
+    {
+#if USES_TLAS
+        TLASTraversal(ray, payload, nodeVisits, false);
+#endif
+    }
+    else if (useBVH)
     {
-        ClosestHitBVHTraversal(ray, tNear, tFar, payload, nodeVisits);
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BVH4)
+        if (u_BVHLayout == BVH_LAYOUT_BVH4)
+            ClosestHitBVH4Traversal(ray, payload, nodeVisits);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_QUANTIZED)
+        if (u_BVHLayout == BVH_LAYOUT_QUANTIZED)
+            ClosestHitQuantizedTraversal(ray, payload, nodeVisits);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_STACKLESS)
+        if (u_BVHLayout == BVH_LAYOUT_STACKLESS)
+            ClosestHitStacklessTraversal(ray, payload, nodeVisits);
+#endif
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BINARY)
+        if (u_BVHLayout == BVH_LAYOUT_BINARY)
+            ClosestHitBVHTraversal(ray, payload, nodeVisits);
+#endif
     }
     else
     {
-        for (int k = 0; k < Prims.n_Primitives; k++)
+        for (int k = 0; k < Scene.n_Primitives; k++)
         {
-            if (Intersect(ray, Prims.Primitives[k], payload))
+            if (Intersect(ray, k, payload))
             {
-                payload.primID = Prims.Primitives[k].id;
+                payload.primID = k;
             }
         }
     }      
 
+    // Traversal only tracks which primitive is closest, its material is read just once here
+    if (payload.primID >= 0)
+        payload.mat = PrimMaterials.Materials[payload.primID];
     return payload;
 }
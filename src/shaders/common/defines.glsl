@@ -0,0 +1,15 @@
+#define LIGHT_SPHERE 0
+#define LIGHT_AREA 1
+#define PRIM_SPHERE 0
+#define PRIM_AABB 1
+#define BVH_LAYOUT_BINARY 0
+#define BVH_LAYOUT_BVH4 1
+#define BVH_LAYOUT_QUANTIZED 2
+#define BVH_LAYOUT_STACKLESS 3
+#define QUANTIZED_LEAF 0x80000000u
+#define SUN_ENABLED
+#define SUN_COLOUR vec3(.992156862745098, .8862745098039216, .6862745098039216)
+#define SUN_SUNSET vec3(182, 126, 91) / 255.0
+#define SUN_INTENSITY 25.0
+#define ENABLE_RUSSIAN_ROULETTE 1
+#define RUSSIAN_ROULETTE_MIN_BOUNCES 5
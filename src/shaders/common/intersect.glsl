@@ -53,7 +53,9 @@ bool IntersectSphere(vec3 position, float radius, Ray ray, inout float tNear, in
     return tNear <= tFar;
 }
 
-bool Slabs(in vec3 bMin, in vec3 bMax, in Ray ray, in float tNear, in float tFar, vec3 invDir) 
+// Clips the ray interval [tNear, tFar] to the box. On a hit tNear is where the ray
+// enters the box, or stays where it was if it starts inside it.
+bool Slabs(in vec3 bMin, in vec3 bMax, in Ray ray, inout float tNear, inout float tFar, vec3 invDir) 
 {
     vec3 tMin = (bMin - ray.origin) * invDir;
     vec3 tMax = (bMax - ray.origin) * invDir;
@@ -61,13 +63,72 @@ bool Slabs(in vec3 bMin, in vec3 bMax, in Ray ray, in float tNear, in float tFar
     vec3 t1 = min(tMin, tMax);
     vec3 t2 = max(tMin, tMax);
 
-    tNear = max(t1.x, max(t1.y, t1.z));
-    tFar = min(t2.x, min(t2.y, t2.z));
+    tNear = max(tNear, max(t1.x, max(t1.y, t1.z)));
+    tFar = min(tFar, min(t2.x, min(t2.y, t2.z)));
 
     return tNear <= tFar;
 }
 
-bool Intersect(Ray ray, Primitive prim, inout Payload payload)
+// Slab test against all four children of a BVH4 node at once, clipped to [0, tMax].
+// Returns the entry distance of each child, INF for children that are missed or empty.
+vec4 Slabs4(in LinearBVH4Node node, in Ray ray, vec3 invDir, float tMax)
+{
+    vec4 tx0 = (node.bMinX - ray.origin.x) * invDir.x;
+    vec4 tx1 = (node.bMaxX - ray.origin.x) * invDir.x;
+    vec4 ty0 = (node.bMinY - ray.origin.y) * invDir.y;
+    vec4 ty1 = (node.bMaxY - ray.origin.y) * invDir.y;
+    vec4 tz0 = (node.bMinZ - ray.origin.z) * invDir.z;
+    vec4 tz1 = (node.bMaxZ - ray.origin.z) * invDir.z;
+
+    vec4 tNear = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), vec4(0.0)));
+    vec4 tFar = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), vec4(tMax)));
+
+    ivec4 hit = ivec4(lessThanEqual(tNear, tFar)) & ivec4(greaterThanEqual(node.count, ivec4(0)));
+    return mix(vec4(INF), tNear, bvec4(hit));
+}
+
+void CompareSwap(inout float ta, inout float tb, inout int a, inout int b)
+{
+    if (tb < ta)
+    {
+        float t = ta; ta = tb; tb = t;
+        int i = a; a = b; b = i;
+    }
+}
+
+// Sorting network ordering the children of a BVH4 node front to back
+void SortChildren(inout vec4 t, inout ivec4 order)
+{
+    CompareSwap(t.x, t.y, order.x, order.y);
+    CompareSwap(t.z, t.w, order.z, order.w);
+    CompareSwap(t.x, t.z, order.x, order.z);
+    CompareSwap(t.y, t.w, order.y, order.w);
+    CompareSwap(t.y, t.z, order.y, order.z);
+}
+
+uint QuantizedByte(uvec4 data, int i)
+{
+    return (data[i >> 2] >> ((i & 3) * 8)) & 0xFFu;
+}
+
+// Decodes the box of child c of a quantized node. The steps are exact powers of two built
+// from the stored exponents, and the CPU rounds outwards, so the box always encloses the child.
+void DecodeChildBounds(in QuantizedBVHNode node, int c, out vec3 bMin, out vec3 bMax)
+{
+    vec3 scale = vec3(
+        uintBitsToFloat((node.meta & 0xFFu) << 23),
+        uintBitsToFloat(((node.meta >> 8) & 0xFFu) << 23),
+        uintBitsToFloat(((node.meta >> 16) & 0xFFu) << 23));
+    vec3 qMin = vec3(QuantizedByte(node.data, c * 6), QuantizedByte(node.data, c * 6 + 1), QuantizedByte(node.data, c * 6 + 2));
+    vec3 qMax = vec3(QuantizedByte(node.data, c * 6 + 3), QuantizedByte(node.data, c * 6 + 4), QuantizedByte(node.data, c * 6 + 5));
+    bMin = node.origin + qMin * scale;
+    bMax = node.origin + qMax * scale;
+}
+
+// Intersects a single shape, updating payload with the hit if it is the closest so far. Boxes
+// with a transform index are rotated about their centre, -1 stands for an axis-aligned box.
+// The material is not touched, ClosestHit() fetches it once traversal has settled on a hit.
+bool IntersectPrimitive(Ray ray, PrimitiveGeometry prim, int transformIdx, inout Payload payload)
 {
     float tNear, tFar;
     switch (prim.type)
@@ -80,7 +141,6 @@ bool Intersect(Ray ray, Primitive prim, inout Payload payload)
             {
                 payload.t = tNear < 0 ? tFar : tNear;
                 payload.position = ray.origin + ray.direction * payload.t;
-                payload.mat = prim.mat; 
                 payload.fromInside = payload.t == tFar;
                 vec3 outward_normal = (payload.position - prim.position) / prim.radius;
                 payload.normal = payload.fromInside ? -outward_normal : outward_normal;
@@ -88,17 +148,21 @@ bool Intersect(Ray ray, Primitive prim, inout Payload payload)
             }
             break;
         case PRIM_AABB: // AABB
+            // Only boxes read their orientation
+            PrimitiveTransform transform = PrimitiveTransform(mat3(1.0), mat3(1.0));
+            if (transformIdx >= 0)
+                transform = PrimTransforms.Transforms[transformIdx];
+
             // Transform ray into object space
-            Ray rotatedRay = Ray(vec3(prim.rotation * vec4(ray.origin - prim.position, 1.0)), vec3(prim.rotation * vec4(ray.direction, 1.0)));
+            Ray rotatedRay = Ray(transform.rotation * (ray.origin - prim.position), transform.rotation * ray.direction);
             if (IntersectAABB(vec3(0.0), prim.dimensions, rotatedRay, tNear, tFar) && tFar > EPS && tNear < payload.t)
             {
                 payload.t = tNear < 0 ? tFar : tNear;
                 payload.position = ray.origin + ray.direction * payload.t;
                 // Hit position in object space
                 vec3 p = rotatedRay.origin + rotatedRay.direction * payload.t;
-                payload.mat = prim.mat;
                 // Rotate normal to world space orientation
-                vec3 outward_normal = vec3(prim.inverseRotation * vec4(GetAABBNormal(prim.position, prim.dimensions, p + prim.position), 1.0));
+                vec3 outward_normal = transform.inverseRotation * GetAABBNormal(prim.position, prim.dimensions, p + prim.position);
                 payload.fromInside = payload.t == tFar;
                 payload.normal = payload.fromInside ? -outward_normal : outward_normal;
                 return true;
@@ -106,4 +170,9 @@ bool Intersect(Ray ray, Primitive prim, inout Payload payload)
             break;
     }
     return false;
-}
\ No newline at end of file
+}
+
+bool Intersect(Ray ray, int primIdx, inout Payload payload)
+{
+    return IntersectPrimitive(ray, Prims.Primitives[primIdx], primIdx, payload);
+}
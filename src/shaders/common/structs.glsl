@@ -20,17 +20,57 @@ struct LinearBVHNode
     int axis;
 };
 
-struct Primitive
+struct LinearBVH4Node
+{
+    vec4 bMinX;
+    vec4 bMinY;
+    vec4 bMinZ;
+    vec4 bMaxX;
+    vec4 bMaxY;
+    vec4 bMaxZ;
+    ivec4 child;
+    ivec4 count;
+};
+
+struct QuantizedBVHNode
+{
+    vec3 origin;
+    uint meta;
+    uvec4 data;
+};
+
+// What traversal needs to intersect a primitive. Its orientation and material are kept in
+// separate arrays, read only for boxes and only once for the closest hit respectively.
+struct PrimitiveGeometry
 {
-    int id;
-    int type;
-    float radius;
     vec3 position;
-    mat4 rotation;
-    mat4 inverseRotation;
+    float radius;
     vec3 dimensions;
-    Material mat;
-    vec3 euler;
+    int type;
+};
+
+struct PrimitiveTransform
+{
+    mat3 rotation;          // World to object space
+    mat3 inverseRotation;
+};
+
+struct StacklessBVHNode
+{
+    vec3 bMin;
+    int missLink;
+    vec3 bMax;
+    uint primitiveData;
+};
+
+struct Instance
+{
+    mat4 worldToObject;
+    mat4 objectToWorld;
+    int blasRoot;
+    int geometryIndex;
+    int materialIndex;
+    int pad;
 };
 
 struct Light
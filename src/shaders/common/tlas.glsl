@@ -0,0 +1,132 @@
+// Traversal of the two-level acceleration structure. The TLAS is built over instance bounds
+// in world space, each instance then moves the ray into its geometry's frame and continues
+// down the geometry's BLAS, which is shared by every instance of the same shape.
+#if USES_TLAS
+
+bool BLASTraversal(in Ray r, int rootNodeIndex, inout Payload payload, inout float nodeVisits, bool anyHit)
+{
+    bool hit = false;
+    vec3 invDir = 1.0 / r.direction;
+    int dirIsNeg[3] = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = rootNodeIndex;
+
+	while (true) 
+	{
+		LinearBVHNode node = blas.nodes[currentNodeIndex];
+        float tNear = 0.0, tFar = payload.t;
+		if (Slabs(node.bMin.xyz, node.bMax.xyz, r, tNear, tFar, invDir))
+		{
+            nodeVisits += 1.;
+
+			if (node.n_Primitives > 0)
+			{
+                for (int i = 0; i < node.n_Primitives; i++)
+                {
+                    PrimitiveGeometry p = blasGeometry.Geometry[node.primitiveOffset + i];
+                    if (IntersectPrimitive(r, p, -1, payload))
+                    {   
+                        hit = true;
+                        if (anyHit) return true;
+                    }
+                }
+
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+            else
+            {
+                if (dirIsNeg[node.axis] == 1)
+                {
+                    nodesToVisit[toVisitOffset++] = int(node.bMin.w);
+                    currentNodeIndex = int(node.bMax.w);
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = int(node.bMax.w);
+                    currentNodeIndex = int(node.bMin.w);
+                }
+            }
+        }
+        else 
+        {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+	}
+    return hit;
+}
+
+bool IntersectInstance(in Ray r, in Instance instance, inout Payload payload, inout float nodeVisits, bool anyHit)
+{
+    // Transform the ray into the instance's frame. The direction is not renormalised so
+    // distances along the ray, and with them payload.t, are the same in both spaces.
+    Ray objectRay = Ray(vec3(instance.worldToObject * vec4(r.origin, 1.0)), vec3(instance.worldToObject * vec4(r.direction, 0.0)));
+    if (!BLASTraversal(objectRay, instance.blasRoot, payload, nodeVisits, anyHit))
+        return false;
+
+    // The BLAS hit is in object space, the material is that of the instance's primitive
+    payload.position = r.origin + r.direction * payload.t;
+    payload.normal = normalize(mat3(instance.objectToWorld) * payload.normal);
+    payload.primID = instance.materialIndex;
+    return true;
+}
+
+bool TLASTraversal(in Ray r, inout Payload payload, inout float nodeVisits, bool anyHit)
+{
+    bool hit = false;
+    vec3 invDir = 1.0 / r.direction;
+    int dirIsNeg[3] = { int(invDir.x < 0), int(invDir.y < 0), int(invDir.z < 0) };
+
+	int nodesToVisit[STACK_SIZE];	
+	int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+
+	while (true) 
+	{
+		LinearBVHNode node = tlas.nodes[currentNodeIndex];
+        float tNear = 0.0, tFar = payload.t;
+		if (Slabs(node.bMin.xyz, node.bMax.xyz, r, tNear, tFar, invDir))
+		{
+            nodeVisits += 1.;
+
+			if (node.n_Primitives > 0)
+			{
+                for (int i = 0; i < node.n_Primitives; i++)
+                {
+                    Instance instance = tlasInstances.Instances[node.primitiveOffset + i];
+                    if (IntersectInstance(r, instance, payload, nodeVisits, anyHit))
+                    {   
+                        hit = true;
+                        if (anyHit) return true;
+                    }
+                }
+
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+            else
+            {
+                if (dirIsNeg[node.axis] == 1)
+                {
+                    nodesToVisit[toVisitOffset++] = int(node.bMin.w);
+                    currentNodeIndex = int(node.bMax.w);
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = int(node.bMax.w);
+                    currentNodeIndex = int(node.bMin.w);
+                }
+            }
+        }
+        else 
+        {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+	}
+    return hit;
+}
+#endif
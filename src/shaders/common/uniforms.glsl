@@ -11,19 +11,70 @@ uniform float u_EnvMapTotalSum;
 uniform float u_EnvMapRotation;
 
 uniform vec2 u_Resolution;
+uniform int u_TotalNodes;
+
+// Settings the renderer compiles into a shader permutation arrive as #defines, so their
+// branches fold away. Shaders built without them still read the settings as uniforms.
+#ifdef BVH_ENABLED
+const int u_BVHEnabled = BVH_ENABLED;
+#else
 uniform int u_BVHEnabled;
+#endif
+#ifdef BVH_LAYOUT
+const int u_BVHLayout = BVH_LAYOUT;
+#else
+uniform int u_BVHLayout;
+#endif
+#ifdef DEBUG_BVH_VISUALISATION
+const int u_DebugBVHVisualisation = DEBUG_BVH_VISUALISATION;
+#else
 uniform int u_DebugBVHVisualisation;
-uniform int u_TotalNodes;
+#endif
+#ifdef USE_BLUE_NOISE
+const int u_UseBlueNoise = USE_BLUE_NOISE;
+#else
 uniform int u_UseBlueNoise;
+#endif
+#ifdef INSTANCING_ENABLED
+const int u_InstancingEnabled = INSTANCING_ENABLED;
+#else
+uniform int u_InstancingEnabled;
+#endif
+
+// A permutation only declares the storage blocks its traversal reads, so a fragment shader stays
+// within the 8 blocks every driver has to offer. Shaders built without the defines trace no rays
+// and see none of them.
+#if defined(INSTANCING_ENABLED) && defined(BVH_LAYOUT)
+#define USES_TLAS (INSTANCING_ENABLED == 1)
+#define USES_SCENE_BVH (INSTANCING_ENABLED == 0)
+#define USES_BVH_LAYOUT(layout) (INSTANCING_ENABLED == 0 && BVH_LAYOUT == (layout))
+#else
+#define USES_TLAS 0
+#define USES_SCENE_BVH 0
+#define USES_BVH_LAYOUT(layout) 0
+#endif
 
-layout (std140) uniform PrimsBlock
+// Scene data and the BVH live in storage buffers that grow with the scene
+layout (std430) readonly buffer PrimsBlock
 {
-    int n_Lights;
-    int n_Primitives;
-    Light Lights[100];
-    Primitive Primitives[100];
+    PrimitiveGeometry Primitives[];
 } Prims;
 
+layout (std430) readonly buffer TransformsBlock
+{
+    PrimitiveTransform Transforms[];
+} PrimTransforms;
+
+layout (std430) readonly buffer MaterialsBlock
+{
+    Material Materials[];
+} PrimMaterials;
+
+layout (std430) readonly buffer LightsBlock
+{
+    Light Lights[];
+} SceneLights;
+
 layout (std140) uniform SceneBlock
 {
     vec3 SunDirection;
@@ -33,6 +84,8 @@ layout (std140) uniform SceneBlock
     int Depth;
     int SelectedPrimIdx;
     int Day;
+    int n_Lights;
+    int n_Primitives;
 } Scene;
 
 layout (std140) uniform CameraBlock
@@ -45,8 +98,61 @@ layout (std140) uniform CameraBlock
     float focalLength;
 } Camera;
 
-layout (std430) uniform BVH
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BINARY)
+layout (std430) readonly buffer BVH
 {
-    LinearBVHNode bvh[1000];
-    int PrimitiveIndexBuffer[100];
+    LinearBVHNode bvh[];
 } bvh;
+#endif
+
+#if USES_SCENE_BVH
+layout (std430) readonly buffer BVHIndices
+{
+    int PrimitiveIndexBuffer[];
+} bvhIndices;
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_BVH4)
+layout (std430) readonly buffer BVH4
+{
+    LinearBVH4Node nodes[];
+} bvh4;
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_QUANTIZED)
+layout (std430) readonly buffer QuantizedBVH
+{
+    QuantizedBVHNode nodes[];
+} qbvh;
+#endif
+
+#if USES_TLAS
+// Instances and BLAS primitives are stored in the order the leaves reference them, so the two
+// levels need no index buffers of their own
+layout (std430) readonly buffer TLAS
+{
+    LinearBVHNode nodes[];
+} tlas;
+
+layout (std430) readonly buffer TLASInstances
+{
+    Instance Instances[];
+} tlasInstances;
+
+layout (std430) readonly buffer BLAS
+{
+    LinearBVHNode nodes[];
+} blas;
+
+layout (std430) readonly buffer BLASGeometry
+{
+    PrimitiveGeometry Geometry[];
+} blasGeometry;
+#endif
+
+#if USES_BVH_LAYOUT(BVH_LAYOUT_STACKLESS)
+layout (std430) readonly buffer StacklessBVH
+{
+    StacklessBVHNode nodes[];
+} sbvh;
+#endif
@@ -9,10 +9,13 @@
 
 uint g_Seed;
 vec2 uv;
+vec2 g_PixelCoord;  // gl_FragCoord.xy of the pixel being traced, also set by the compute kernels
+
+float Saturate( float x ) { return clamp( x, 0.001, 1.0 ); }
 
 uint GenerateSeed()
 {
-    return uint(uint(gl_FragCoord.x) * uint(1973) + uint(gl_FragCoord.y) * uint(9277) + uint(u_SampleIterations+1) * uint(26699)) | uint(1);
+    return uint(uint(g_PixelCoord.x) * uint(1973) + uint(g_PixelCoord.y) * uint(9277) + uint(u_SampleIterations+1) * uint(26699)) | uint(1);
 }
 
 uint PCGHash()
@@ -29,7 +32,7 @@ float Randf01()
     {
         vec2 tc = (uv + 1.0) / 2.0;
         vec2 ts = textureSize(u_BlueNoise, 0);
-        float blueNoise = texelFetch(u_BlueNoise, ivec2(mod(gl_FragCoord.x, ts.x), mod(gl_FragCoord.y, ts.y)), 0).r;
+        float blueNoise = texelFetch(u_BlueNoise, ivec2(mod(g_PixelCoord.x, ts.x), mod(g_PixelCoord.y, ts.y)), 0).r;
         return fract(float(PCGHash()) / float(uint(0xffffffff)) + blueNoise);
 //        return fract(blueNoise + (GOLDEN_RATIO * u_SampleIterations));
     }
@@ -41,6 +44,17 @@ float Randf()
     return float(PCGHash());
 }
 
+vec3 InfernoQuintic(float x)
+{
+	x = Saturate( x );
+	vec4 x1 = vec4( 1.0, x, x * x, x * x * x ); // 1 x x2 x3
+	vec4 x2 = x1 * x1.w * x; // x4 x5 x6 x7
+	return vec3(
+		dot( x1.xyzw, vec4( -0.027780558, +1.228188385, +0.278906882, +3.892783760 ) ) + dot( x2.xy, vec2( -8.490712758, +4.069046086 ) ),
+		dot( x1.xyzw, vec4( +0.014065206, +0.015360518, +1.605395918, -4.821108251 ) ) + dot( x2.xy, vec2( +8.389314011, -4.193858954 ) ),
+		dot( x1.xyzw, vec4( -0.019628385, +3.122510347, -5.893222355, +2.798380308 ) ) + dot( x2.xy, vec2( -3.608884658, +4.324996022 ) ) );
+}
+
 float Luminance(vec3 c)
 {
     return 0.212671 * c.x + 0.715160 * c.y + 0.072169 * c.z;
@@ -228,7 +242,7 @@ vec3 SampleCube(vec3 position, vec3 dimensions, out float pdf)
     return position + sampledPoint;
 }
 
-vec3 SamplePointOnPrimitive(Primitive primitive, inout float pdf, vec3 hitpos)
+vec3 SamplePointOnPrimitive(PrimitiveGeometry primitive, inout float pdf, vec3 hitpos)
 {
     switch (primitive.type)
     {
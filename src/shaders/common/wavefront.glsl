@@ -0,0 +1,105 @@
+// Path state and work queues shared by the wavefront kernels in wavefront/. Every path of the
+// current chunk of pixels lives in Paths, each kernel works through one queue of path indices
+// and appends the paths that need more work to the queue of the kernel that runs next.
+#define WAVEFRONT_GROUP_SIZE 64
+
+#define QUEUE_EXTEND 0
+#define QUEUE_SHADE_DIFFUSE 1
+#define QUEUE_SHADE_METAL 2
+#define QUEUE_SHADE_GLASS 3
+#define QUEUE_CONNECT 4
+#define QUEUE_COUNT 5
+
+#define PATH_SPECULAR_BOUNCE 1
+#define PATH_FROM_INSIDE 2
+#define PATH_SHADOW_LIGHT 4
+#define PATH_SHADOW_SUN 8
+
+struct PathState
+{
+    vec3 origin;
+    uint seed;
+    vec3 direction;
+    int bounce;
+    vec3 throughput;
+    int flags;
+    vec3 radiance;          // Summed over the samples of the current frame
+    int hitPrim;
+    vec3 hitPosition;
+    float hitT;
+    vec3 hitNormal;
+    int pad;
+};
+
+// Shadow ray from the hit point of a path, whose contribution counts if nothing blocks it
+struct ShadowRay
+{
+    vec3 direction;
+    float maxDistance;
+    vec3 contribution;
+    int lightPrim;          // Primitive sampled on the light, -1 for the sun
+};
+
+layout (std430) buffer WavefrontPaths
+{
+    PathState paths[];
+} Paths;
+
+// Two per path: the sampled light and the sun
+layout (std430) buffer WavefrontShadowRays
+{
+    ShadowRay rays[];
+} ShadowRays;
+
+// QUEUE_COUNT queues of u_PathCount entries each
+layout (std430) buffer WavefrontQueues
+{
+    uint items[];
+} Queues;
+
+layout (std430) buffer WavefrontCounters
+{
+    uint dispatchArgs[QUEUE_COUNT * 3];     // glDispatchComputeIndirect arguments per queue
+    uint counts[QUEUE_COUNT];
+} Counters;
+
+uniform int u_PathCount;        // Paths in flight, one per pixel of the current chunk
+uniform int u_FirstPixel;       // Pixel the first path belongs to
+
+void PushQueue(int queue, uint path)
+{
+    uint slot = atomicAdd(Counters.counts[queue], 1u);
+    Queues.items[queue * u_PathCount + int(slot)] = path;
+}
+
+// Path index of the invocation's entry in queue, or -1 past its end
+int PopQueue(int queue)
+{
+    uint item = gl_GlobalInvocationID.x;
+    if (item >= Counters.counts[queue])
+        return -1;
+    return int(Queues.items[queue * u_PathCount + int(item)]);
+}
+
+// Points the per-pixel random state of utils.glsl at the pixel of a path
+ivec2 SetPixel(int path)
+{
+    int pixel = u_FirstPixel + path;
+    int width = int(u_Resolution.x);
+    ivec2 coord = ivec2(pixel % width, pixel / width);
+    g_PixelCoord = vec2(coord) + 0.5;
+    uv = g_PixelCoord / u_Resolution * 2.0 - 1.0;
+    return coord;
+}
+
+Payload LoadHit(PathState state)
+{
+    Payload payload;
+    payload.t = state.hitT;
+    payload.position = state.hitPosition;
+    payload.normal = state.hitNormal;
+    payload.fromInside = (state.flags & PATH_FROM_INSIDE) != 0;
+    payload.mat = PrimMaterials.Materials[state.hitPrim];
+    payload.primID = state.hitPrim;
+    return payload;
+}
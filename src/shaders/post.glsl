@@ -1,11 +1,16 @@
-#version 460 core
+#version 450 core
 
 out vec4 colour;
 
 uniform vec2 u_Resolution;
 uniform sampler2D u_PT_Texture;
 uniform sampler3D u_TonyMcMapfaceLUT;
+// Compiled in by the renderer, see uniforms.glsl
+#ifdef TONEMAP
+const int u_Tonemap = TONEMAP;
+#else
 uniform int u_Tonemap;
+#endif
 uniform int u_EnableCrosshair;
 
 #define sat(x) clamp(x, 0., 1.)
@@ -54,7 +59,7 @@ vec3 TonyMcMapface(vec3 stimulus) {
     const float LUT_DIMS = 48.0;
     vec3 uv = encoded * ((LUT_DIMS - 1.0) / LUT_DIMS) + 0.5 / LUT_DIMS;
 
-    return texture3D(u_TonyMcMapfaceLUT, uv).rbg;
+    return texture(u_TonyMcMapfaceLUT, uv).rbg;
 }
 
 // Sources:
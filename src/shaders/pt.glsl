@@ -1,25 +1,13 @@
-#version 460 core
-#extension GL_EXT_scalar_block_layout: require
-
-float Saturate( float x ) { return clamp( x, 0.001, 1.0 ); }
-
-#define LIGHT_SPHERE 0
-#define LIGHT_AREA 1
-#define PRIM_SPHERE 0
-#define PRIM_AABB 1
-#define SUN_ENABLED
-#define SUN_COLOUR vec3(.992156862745098, .8862745098039216, .6862745098039216)
-#define SUN_SUNSET vec3(182, 126, 91) / 255.0
-#define SUN_INTENSITY 25.0
-#define ENABLE_RUSSIAN_ROULETTE 1
-#define RUSSIAN_ROULETTE_MIN_BOUNCES 5
+#version 450 core
 
+#include <common/defines.glsl>
 #include <common/structs.glsl>
 #include <common/uniforms.glsl>
 #include <common/utils.glsl>
 #include <common/ray_gen.glsl>
 #include <common/miss.glsl>
 #include <common/intersect.glsl>
+#include <common/tlas.glsl>
 #include <common/closest_hit.glsl>
 #include <common/any_hit.glsl>
 #include <common/bsdf.glsl>
@@ -27,22 +15,12 @@ float Saturate( float x ) { return clamp( x, 0.001, 1.0 ); }
 
 out vec4 FragColour;
 
-vec3 InfernoQuintic(float x)
-{
-	x = Saturate( x );
-	vec4 x1 = vec4( 1.0, x, x * x, x * x * x ); // 1 x x2 x3
-	vec4 x2 = x1 * x1.w * x; // x4 x5 x6 x7
-	return vec3(
-		dot( x1.xyzw, vec4( -0.027780558, +1.228188385, +0.278906882, +3.892783760 ) ) + dot( x2.xy, vec2( -8.490712758, +4.069046086 ) ),
-		dot( x1.xyzw, vec4( +0.014065206, +0.015360518, +1.605395918, -4.821108251 ) ) + dot( x2.xy, vec2( +8.389314011, -4.193858954 ) ),
-		dot( x1.xyzw, vec4( -0.019628385, +3.122510347, -5.893222355, +2.798380308 ) ) + dot( x2.xy, vec2( -3.608884658, +4.324996022 ) ) );
-}
-
 vec3 EstimateDirect(Light light, Payload payload, Ray ray)
 {
     vec3 directIlluminance = vec3(0.0);
-    Primitive primitive = Prims.Primitives[light.id];
-    if (!all(greaterThan(primitive.mat.emissive, vec3(0.0)))) return directIlluminance;
+    PrimitiveGeometry primitive = Prims.Primitives[light.id];
+    Material mat = PrimMaterials.Materials[light.id];
+    if (!all(greaterThan(mat.emissive, vec3(0.0)))) return directIlluminance;
 
     // Sample a point on the primitive
     float pdf;
@@ -65,7 +43,7 @@ vec3 EstimateDirect(Light light, Payload payload, Ray ray)
         pdf = (r*r) / cos_term * pdf;
         if (pdf < 0.01) return directIlluminance;
         float brdf_pdf;
-        directIlluminance += (EvalBSDF(ray, payload, wi, brdf_pdf) * cos_term * primitive.mat.emissive * primitive.mat.intensity) / pdf;
+        directIlluminance += (EvalBSDF(ray, payload, wi, brdf_pdf) * cos_term * mat.emissive * mat.intensity) / pdf;
     }
 
     return directIlluminance;
@@ -76,9 +54,9 @@ vec3 SampleLights(Payload hitrec, Ray ray, bool lastBounceSpecular)
 {
     vec3 directIlluminance = vec3(0.0);
 
-    for (int i = 0; i < Prims.n_Lights; i++)
+    for (int i = 0; i < Scene.n_Lights; i++)
     {
-        Light light = Prims.Lights[i];
+        Light light = SceneLights.Lights[i];
 
         // If the light and the surface interaction are the same we skip
         // so we don't double dip
@@ -199,6 +177,7 @@ vec4 PathTrace(Ray ray)
 void main()
 {
     // Pixel coord in NDC [-1, 1]
+    g_PixelCoord = gl_FragCoord.xy;
     uv = gl_FragCoord.xy / u_Resolution.xy;
     uv = (uv * 2.0) - 1.0;
 
@@ -0,0 +1,46 @@
+#version 450 core
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+#include <common/intersect.glsl>
+#include <common/tlas.glsl>
+#include <common/any_hit.glsl>
+
+layout (local_size_x = WAVEFRONT_GROUP_SIZE) in;
+
+// Traces the shadow rays queued by shade.glsl and adds the contribution of the unblocked ones.
+// Both rays of a path are handled by the same invocation, so the radiance needs no atomics.
+void main()
+{
+    int path = PopQueue(QUEUE_CONNECT);
+    if (path < 0)
+        return;
+
+    PathState state = Paths.paths[path];
+    vec3 origin = state.hitPosition + state.hitNormal * EPS;
+    vec3 radiance = state.radiance;
+
+    if ((state.flags & PATH_SHADOW_LIGHT) != 0)
+    {
+        // Visible only if the first thing hit is the sampled light, right where it was sampled
+        ShadowRay shadowRay = ShadowRays.rays[path * 2];
+        Ray SR = Ray(origin, shadowRay.direction);
+        vec3 sampledPos = origin + shadowRay.direction * shadowRay.maxDistance;
+        Payload shadowInfo;
+        if (AnyHit(SR, shadowInfo, shadowRay.maxDistance)
+            && shadowInfo.primID == shadowRay.lightPrim && distance(shadowInfo.position, sampledPos) < 0.1)
+            radiance += shadowRay.contribution;
+    }
+    if ((state.flags & PATH_SHADOW_SUN) != 0)
+    {
+        ShadowRay shadowRay = ShadowRays.rays[path * 2 + 1];
+        Payload shadowInfo;
+        if (!AnyHit(Ray(origin, shadowRay.direction), shadowInfo, INF))
+            radiance += shadowRay.contribution;
+    }
+
+    Paths.paths[path].radiance = radiance;
+}
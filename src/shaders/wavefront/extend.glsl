@@ -0,0 +1,74 @@
+#version 450 core
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+#include <common/miss.glsl>
+#include <common/intersect.glsl>
+#include <common/tlas.glsl>
+#include <common/closest_hit.glsl>
+
+layout (local_size_x = WAVEFRONT_GROUP_SIZE) in;
+
+// Finds the closest hit of every queued ray. Paths that leave the scene or end on a light are
+// finished here, the others are sorted into one shading queue per material class.
+void main()
+{
+    int path = PopQueue(QUEUE_EXTEND);
+    if (path < 0)
+        return;
+
+    SetPixel(path);
+    PathState state = Paths.paths[path];
+    g_Seed = state.seed;
+
+#if ENABLE_RUSSIAN_ROULETTE
+    if (state.bounce >= RUSSIAN_ROULETTE_MIN_BOUNCES)
+    {
+        float rrp = min(0.95, max(Luminance(state.throughput), EPS));
+        if (Randf01() > rrp)
+        {
+            Paths.paths[path].seed = g_Seed;
+            return;
+        }
+        state.throughput /= rrp;
+    }
+#endif
+
+    Ray ray = Ray(state.origin, state.direction);
+    float nodeVisits = 0.0;
+    Payload hit = ClosestHit(ray, INF, nodeVisits);
+
+    bool finished = true;
+    if (u_DebugBVHVisualisation == 1 && hit.t < INF)
+        state.radiance += nodeVisits > 0 ? InfernoQuintic(nodeVisits / u_TotalNodes) : vec3(0.0);
+    else if (hit.t == INF)
+        state.radiance += Miss(ray.direction) * state.throughput;
+    else if ((state.bounce == 0 || (state.flags & PATH_SPECULAR_BOUNCE) != 0) && any(greaterThan(hit.mat.emissive, vec3(0.0))))
+        state.radiance += hit.mat.emissive * hit.mat.intensity * state.throughput;
+    else
+        finished = false;
+
+    state.seed = g_Seed;
+    if (!finished)
+    {
+        state.hitT = hit.t;
+        state.hitPosition = hit.position;
+        state.hitNormal = hit.normal;
+        state.hitPrim = hit.primID;
+        state.flags = hit.fromInside ? state.flags | PATH_FROM_INSIDE : state.flags & ~PATH_FROM_INSIDE;
+    }
+    Paths.paths[path] = state;
+
+    if (!finished)
+    {
+        int queue = QUEUE_SHADE_DIFFUSE;
+        if (hit.mat.transmission > 0.0)
+            queue = QUEUE_SHADE_GLASS;
+        else if (hit.mat.metallic > 0.0)
+            queue = QUEUE_SHADE_METAL;
+        PushQueue(queue, uint(path));
+    }
+}
@@ -0,0 +1,56 @@
+#version 450 core
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+#include <common/ray_gen.glsl>
+
+layout (local_size_x = WAVEFRONT_GROUP_SIZE) in;
+
+uniform int u_Sample;           // Index of the sample within the frame
+
+// Starts one camera ray per pixel and queues all of them for extend.glsl
+void main()
+{
+    int path = int(gl_GlobalInvocationID.x);
+    if (path >= u_PathCount)
+        return;
+
+    SetPixel(path);
+    PathState state = Paths.paths[path];
+    if (u_Sample == 0)
+    {
+        g_Seed = GenerateSeed();
+        state.radiance = vec3(0.0);
+    }
+    else
+    {
+        g_Seed = state.seed;
+    }
+
+    // Same sub-pixel jitter and depth of field as pt.glsl
+    float r_1 = Randf01();
+    float r_2 = Randf01();
+    vec2 ndc = (g_PixelCoord + vec2(r_1, r_2)) / u_Resolution * 2.0 - 1.0;
+    Ray r = RayGen(ndc);
+    vec3 focal_point = r.origin + r.direction * Camera.focalLength;
+    vec2 offset = Camera.aperture * 0.5 * SampleUniformUnitCirle(r_1, r_2);
+    r.origin += vec3(offset, 0.0);
+    r.direction = normalize(focal_point - r.origin);
+
+    state.origin = r.origin;
+    state.direction = r.direction;
+    state.throughput = vec3(1.0);
+    state.bounce = 0;
+    state.flags = 0;
+    state.hitPrim = -1;
+    state.seed = g_Seed;
+    Paths.paths[path] = state;
+
+    // Queued in pixel order, which keeps neighbouring rays together for the first bounce
+    Queues.items[QUEUE_EXTEND * u_PathCount + path] = uint(path);
+    if (path == 0)
+        Counters.counts[QUEUE_EXTEND] = uint(u_PathCount);
+}
@@ -0,0 +1,47 @@
+#version 450 core
+
+#define STAGE_EXTEND 0
+#define STAGE_SHADE 1
+#define STAGE_CONNECT 2
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+
+layout (local_size_x = 1) in;
+
+uniform int u_Stage;            // STAGE_* about to be dispatched
+
+void SetDispatch(int queue)
+{
+    Counters.dispatchArgs[queue * 3 + 0] = (Counters.counts[queue] + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+    Counters.dispatchArgs[queue * 3 + 1] = 1u;
+    Counters.dispatchArgs[queue * 3 + 2] = 1u;
+}
+
+// Turns the length of the queues the next stage reads into its indirect dispatch sizes, and
+// empties the queues it appends to. Keeps the queue lengths on the GPU, nothing is read back.
+void main()
+{
+    if (u_Stage == STAGE_EXTEND)
+    {
+        SetDispatch(QUEUE_EXTEND);
+        Counters.counts[QUEUE_SHADE_DIFFUSE] = 0u;
+        Counters.counts[QUEUE_SHADE_METAL] = 0u;
+        Counters.counts[QUEUE_SHADE_GLASS] = 0u;
+    }
+    else if (u_Stage == STAGE_SHADE)
+    {
+        SetDispatch(QUEUE_SHADE_DIFFUSE);
+        SetDispatch(QUEUE_SHADE_METAL);
+        SetDispatch(QUEUE_SHADE_GLASS);
+        Counters.counts[QUEUE_EXTEND] = 0u;
+        Counters.counts[QUEUE_CONNECT] = 0u;
+    }
+    else
+    {
+        SetDispatch(QUEUE_CONNECT);
+    }
+}
@@ -0,0 +1,24 @@
+#version 450 core
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+
+layout (local_size_x = WAVEFRONT_GROUP_SIZE) in;
+
+layout (rgba32f) uniform writeonly image2D u_AccumulationImage;
+
+// Adds the frame's samples to the running average, exactly like the end of pt.glsl
+void main()
+{
+    int path = int(gl_GlobalInvocationID.x);
+    if (path >= u_PathCount)
+        return;
+
+    ivec2 coord = SetPixel(path);
+    vec4 irradiance = vec4(Paths.paths[path].radiance / float(u_SamplesPerPixel), 1.0);
+    vec4 accumulatedScaledUp = texelFetch(u_AccumulationTexture, coord, 0) * u_SampleIterations;
+    imageStore(u_AccumulationImage, coord, (accumulatedScaledUp + irradiance) / (u_SampleIterations + 1));
+}
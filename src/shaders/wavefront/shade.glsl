@@ -0,0 +1,122 @@
+#version 450 core
+
+#include <common/defines.glsl>
+#include <common/structs.glsl>
+#include <common/uniforms.glsl>
+#include <common/utils.glsl>
+#include <common/wavefront.glsl>
+#include <common/pbr.glsl>
+
+layout (local_size_x = WAVEFRONT_GROUP_SIZE) in;
+
+uniform int u_Queue;            // QUEUE_SHADE_* worked through by this dispatch
+
+// Unoccluded contribution of a point sampled on light, the visibility is left to connect.glsl
+bool SampleLight(Light light, Payload payload, Ray ray, out ShadowRay shadowRay)
+{
+    PrimitiveGeometry primitive = Prims.Primitives[light.id];
+    Material mat = PrimMaterials.Materials[light.id];
+    if (!all(greaterThan(mat.emissive, vec3(0.0)))) return false;
+
+    float pdf;
+    vec3 sampledPos = SamplePointOnPrimitive(primitive, pdf, payload.position);
+    vec3 wi = normalize(sampledPos - payload.position);
+    float cos_term = dot(wi, payload.normal);
+    if (cos_term == 0.0) return false;
+
+    // Convert area pdf to solid angle pdf. pt.glsl uses the distance to the shadow ray's hit,
+    // which has to lie next to the sampled point for the sample to count at all.
+    vec3 origin = payload.position + payload.normal * EPS;
+    float r = distance(origin, sampledPos);
+    cos_term = abs(cos_term);
+    pdf = (r*r) / cos_term * pdf;
+    if (pdf < 0.01) return false;
+
+    float brdf_pdf;
+    shadowRay.direction = wi;
+    shadowRay.maxDistance = r;
+    shadowRay.contribution = (EvalBSDF(ray, payload, wi, brdf_pdf) * cos_term * mat.emissive * mat.intensity) / pdf;
+    shadowRay.lightPrim = light.id;
+    return true;
+}
+
+bool SampleSun(Payload payload, Ray ray, out ShadowRay shadowRay)
+{
+#ifdef SUN_ENABLED
+    if (Scene.Day == 1)
+    {
+        vec3 wi = normalize(GetConeSample(normalize(Scene.SunDirection), 1e-5));
+        float cos_term = dot(wi, payload.normal);
+        if (cos_term == 0.0) return false;
+
+        float pdf = 1.0;
+        shadowRay.direction = wi;
+        shadowRay.maxDistance = INF;
+        shadowRay.contribution = EvalBSDF(ray, payload, wi, pdf) * Scene.SunColour * abs(cos_term) * SUN_INTENSITY / pdf;
+        shadowRay.lightPrim = -1;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Samples direct light and the next bounce for the hits of one material class. Direct light
+// becomes up to two shadow rays, one light picked at random and the sun, so a path never
+// needs more than two whatever the number of lights in the scene.
+void main()
+{
+    int path = PopQueue(u_Queue);
+    if (path < 0)
+        return;
+
+    SetPixel(path);
+    PathState state = Paths.paths[path];
+    g_Seed = state.seed;
+    Ray ray = Ray(state.origin, state.direction);
+    Payload hit = LoadHit(state);
+
+    // https://blog.demofox.org/2020/06/14/casual-shadertoy-path-tracing-3-fresnel-rough-refraction-absorption-orbit-camera/
+    if (hit.fromInside)
+        state.throughput *= exp(-hit.mat.absorption * hit.t);
+
+    state.flags &= ~(PATH_SHADOW_LIGHT | PATH_SHADOW_SUN);
+    ShadowRay shadowRay;
+    if (Scene.n_Lights > 0)
+    {
+        // Picking one of n lights uniformly and scaling by n keeps the sum over all lights unbiased
+        int index = min(int(Randf01() * Scene.n_Lights), Scene.n_Lights - 1);
+        Light light = SceneLights.Lights[index];
+        if (light.id != hit.primID && SampleLight(light, hit, ray, shadowRay))
+        {
+            shadowRay.contribution *= state.throughput * float(Scene.n_Lights);
+            ShadowRays.rays[path * 2] = shadowRay;
+            state.flags |= PATH_SHADOW_LIGHT;
+        }
+    }
+    if (SampleSun(hit, ray, shadowRay))
+    {
+        shadowRay.contribution *= state.throughput;
+        ShadowRays.rays[path * 2 + 1] = shadowRay;
+        state.flags |= PATH_SHADOW_SUN;
+    }
+
+    // Calculate indirect lighting
+    bool lastBounceSpecular = (state.flags & PATH_SPECULAR_BOUNCE) != 0;
+    float BRDF_pdf = 1.0;
+    vec3 indirect = EvalIndirectBSDF(ray, hit, BRDF_pdf, lastBounceSpecular);
+    bool extend = BRDF_pdf > 0.0 && state.bounce + 1 < Scene.Depth;
+    if (BRDF_pdf > 0.0)
+        state.throughput *= indirect / BRDF_pdf;
+    state.origin = ray.origin;
+    state.direction = ray.direction;
+    state.bounce++;
+    if (lastBounceSpecular)
+        state.flags |= PATH_SPECULAR_BOUNCE;
+    state.seed = g_Seed;
+    Paths.paths[path] = state;
+
+    if ((state.flags & (PATH_SHADOW_LIGHT | PATH_SHADOW_SUN)) != 0)
+        PushQueue(QUEUE_CONNECT, uint(path));
+    if (extend)
+        PushQueue(QUEUE_EXTEND, uint(path));
+}
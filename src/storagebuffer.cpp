@@ -0,0 +1,54 @@
+#include "storagebuffer.h"
+
+
+void StorageBuffer::Create(uint32_t binding, size_t initialCapacity)
+{
+    m_Binding = binding;
+    m_Capacity = initialCapacity > 0 ? initialCapacity : 1;
+    glGenBuffers(1, &m_ID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ID);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, m_Capacity, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, m_Binding, m_ID);
+}
+
+void StorageBuffer::Destroy()
+{
+    if (m_ID)
+        glDeleteBuffers(1, &m_ID);
+    m_ID = 0;
+    m_Capacity = 0;
+}
+
+void StorageBuffer::Upload(size_t offset, const void* data, size_t size)
+{
+    if (size == 0)
+        return;
+    Reserve(offset + size);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_ID);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, size, data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void StorageBuffer::Reserve(size_t size)
+{
+    if (size <= m_Capacity)
+        return;
+
+    size_t capacity = m_Capacity * 2 > size ? m_Capacity * 2 : size;
+
+    // Copy the old contents across on the GPU so partial updates can keep patching them
+    uint32_t buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, m_ID);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, m_Capacity);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &m_ID);
+
+    m_ID = buffer;
+    m_Capacity = capacity;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, m_Binding, m_ID);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <glad/glad.h>
+#include <cstddef>
+#include <cstdint>
+
+
+// Shader storage buffer bound to a fixed binding point that grows with the data written to it.
+// Capacity at least doubles whenever a write does not fit, so a scene growing one primitive at
+// a time only reallocates a logarithmic number of times. Growing keeps the current contents.
+class StorageBuffer
+{
+public:
+    StorageBuffer() = default;
+    ~StorageBuffer() {};
+
+    void Create(uint32_t binding, size_t initialCapacity = 1024);
+    void Destroy();
+
+    // Writes size bytes at offset, growing the buffer first if they do not fit
+    void Upload(size_t offset, const void* data, size_t size);
+    void Reserve(size_t size);
+
+    uint32_t GetID() const { return m_ID; }
+    size_t GetCapacity() const { return m_Capacity; }
+
+private:
+    uint32_t m_ID = 0;
+    uint32_t m_Binding = 0;
+    size_t m_Capacity = 0;
+};
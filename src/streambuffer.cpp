@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cstring>
+#include "streambuffer.h"
+
+
+void StreamBuffer::Create(uint32_t target, uint32_t binding, size_t initialCapacity)
+{
+    m_Target = target;
+    m_Binding = binding;
+
+    GLint alignment = 0;
+    glGetIntegerv(target == GL_UNIFORM_BUFFER ? GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT : GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    m_Alignment = alignment > 0 ? size_t(alignment) : 256;
+
+    Allocate(initialCapacity);
+}
+
+void StreamBuffer::Destroy()
+{
+    for (int i = 0; i < STREAM_FRAMES; ++i)
+    {
+        if (m_Fences[i])
+            glDeleteSync(m_Fences[i]);
+        m_Fences[i] = nullptr;
+    }
+    if (m_ID)
+    {
+        glBindBuffer(m_Target, m_ID);
+        glUnmapBuffer(m_Target);
+        glBindBuffer(m_Target, 0);
+        glDeleteBuffers(1, &m_ID);
+    }
+    m_ID = 0;
+    m_Mapped = nullptr;
+    m_RegionSize = 0;
+}
+
+void StreamBuffer::Invalidate(size_t offset, size_t size)
+{
+    if (size == 0)
+        return;
+    for (int i = 0; i < STREAM_FRAMES; ++i)
+        m_Pending[i].push_back({ int(offset), int(offset + size) });
+}
+
+void StreamBuffer::Update(const void* source, size_t size)
+{
+    if (size > m_RegionSize)
+    {
+        // Storage is immutable, so grow into a new buffer once the GPU let go of the old one
+        size_t capacity = std::max(size, 2 * m_RegionSize);
+        for (int i = 0; i < STREAM_FRAMES; ++i)
+            WaitForRegion(i);
+        Destroy();
+        Allocate(capacity);
+        for (int i = 0; i < STREAM_FRAMES; ++i)
+            m_Pending[i].assign(1, { 0, int(size) });
+    }
+
+    // Nothing changed since the current region was written, the GPU keeps reading it
+    if (m_Pending[m_Region].empty())
+    {
+        glBindBufferRange(m_Target, m_Binding, m_ID, m_Region * m_RegionSize, m_RegionSize);
+        return;
+    }
+
+    m_Region = (m_Region + 1) % STREAM_FRAMES;
+    WaitForRegion(m_Region);
+
+    // Merge the ranges missed since the region was last written and copy them across
+    std::vector<DirtyRange>& pending = m_Pending[m_Region];
+    std::sort(pending.begin(), pending.end(), [](const DirtyRange& a, const DirtyRange& b) { return a.begin < b.begin; });
+    uint8_t* region = m_Mapped + m_Region * m_RegionSize;
+    int begin = pending[0].begin;
+    int end = pending[0].end;
+    for (size_t i = 1; i <= pending.size(); ++i)
+    {
+        if (i < pending.size() && pending[i].begin <= end)
+        {
+            end = std::max(end, pending[i].end);
+            continue;
+        }
+        int last = std::min(end, int(size));
+        if (begin < last)
+            memcpy(region + begin, static_cast<const uint8_t*>(source) + begin, last - begin);
+        if (i < pending.size())
+        {
+            begin = pending[i].begin;
+            end = pending[i].end;
+        }
+    }
+    pending.clear();
+
+    glBindBufferRange(m_Target, m_Binding, m_ID, m_Region * m_RegionSize, m_RegionSize);
+}
+
+void StreamBuffer::Fence()
+{
+    if (m_Fences[m_Region])
+        glDeleteSync(m_Fences[m_Region]);
+    m_Fences[m_Region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void StreamBuffer::Allocate(size_t capacity)
+{
+    // Every region starts on an offset glBindBufferRange accepts
+    m_RegionSize = (std::max(capacity, size_t(1)) + m_Alignment - 1) / m_Alignment * m_Alignment;
+    m_Region = 0;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &m_ID);
+    glBindBuffer(m_Target, m_ID);
+    glBufferStorage(m_Target, STREAM_FRAMES * m_RegionSize, nullptr, flags);
+    m_Mapped = static_cast<uint8_t*>(glMapBufferRange(m_Target, 0, STREAM_FRAMES * m_RegionSize, flags));
+    glBindBuffer(m_Target, 0);
+    glBindBufferRange(m_Target, m_Binding, m_ID, 0, m_RegionSize);
+}
+
+void StreamBuffer::WaitForRegion(int region)
+{
+    GLsync fence = m_Fences[region];
+    if (!fence)
+        return;
+
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+    {
+        fenceWaits++;
+        do
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        while (result == GL_TIMEOUT_EXPIRED);
+    }
+    glDeleteSync(fence);
+    m_Fences[region] = nullptr;
+}
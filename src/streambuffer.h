@@ -0,0 +1,51 @@
+#pragma once
+#include <glad/glad.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "utils.h"
+
+
+// Buffer the CPU streams per-frame data through without stalling on the GPU. It is split into
+// STREAM_FRAMES regions that stay persistently mapped: each change is written to the next
+// region while the GPU may still be reading older ones, and a fence placed after the frame's
+// draws tells when a region can be overwritten again. Regions are kept complete copies of the
+// data, changes not yet written to a region are remembered and copied across when it comes up.
+class StreamBuffer
+{
+public:
+    static const int STREAM_FRAMES = 3;
+
+    StreamBuffer() = default;
+    ~StreamBuffer() {};
+
+    // target is GL_UNIFORM_BUFFER or GL_SHADER_STORAGE_BUFFER
+    void Create(uint32_t target, uint32_t binding, size_t initialCapacity);
+    void Destroy();
+
+    // Marks size bytes at offset as changed, they are copied in by the next Update
+    void Invalidate(size_t offset, size_t size);
+    // Moves on to the next region if anything changed since the last frame, brings it up to date
+    // from source, size bytes long, and binds it. Waits on the region's fence if the GPU still uses it.
+    void Update(const void* source, size_t size);
+    // Call after the draws reading the current region were issued
+    void Fence();
+
+    size_t GetCapacity() const { return m_RegionSize; }
+    uint32_t fenceWaits = 0;     // Times Update() found its region still in use and had to wait
+
+private:
+    void Allocate(size_t capacity);
+    void WaitForRegion(int region);
+
+    uint32_t m_ID = 0;
+    uint32_t m_Target = 0;
+    uint32_t m_Binding = 0;
+    size_t m_Alignment = 256;
+    size_t m_RegionSize = 0;
+    uint8_t* m_Mapped = nullptr;
+    int m_Region = 0;
+
+    GLsync m_Fences[STREAM_FRAMES] = {};
+    std::vector<DirtyRange> m_Pending[STREAM_FRAMES];   // Byte ranges each region is missing
+};
@@ -0,0 +1,214 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+
+#include "tlas.h"
+
+static GeometryKey ShapeKey(const Primitive& primitive)
+{
+    // Adding zero turns -0 into +0, which compare equal but would hash differently
+    GeometryKey key;
+    key.type = primitive.type;
+    if (primitive.type == PRIM_SPHERE)
+        key.radius = primitive.radius + 0.0f;
+    if (primitive.type == PRIM_AABB)
+        key.dimensions = primitive.dimensions + glm::vec3(0.0f);
+    return key;
+}
+
+size_t GeometryKeyHash::operator()(const GeometryKey& key) const
+{
+    std::hash<float> hashFloat;
+    size_t hash = std::hash<int>()(key.type);
+    for (float value : { key.radius, key.dimensions.x, key.dimensions.y, key.dimensions.z })
+        hash = hash * 31 + hashFloat(value);
+    return hash;
+}
+
+void TLAS::Update(const std::vector<Primitive>& primitives)
+{
+    // Instances shift when primitives are added or removed, so refresh all of them then
+    bool resized = instances.size() != primitives.size();
+    bool rebuild = resized;
+    instances.resize(primitives.size());
+    m_InstanceBounds.resize(primitives.size());
+
+    std::vector<bool> used(geometries.size(), false);
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        const Primitive& prim = primitives[i];
+        int geometryIndex = FindOrAddGeometry(prim);
+        const Geometry& geometry = geometries[geometryIndex];
+        used.resize(geometries.size(), false);
+        used[geometryIndex] = true;
+
+        // Same object space as Intersect() in intersect.glsl: translate, then rotate
+        Instance instance;
+        instance.worldToObject = prim.rotation * glm::translate(glm::mat4(1.0f), -prim.position);
+        instance.objectToWorld = glm::inverse(instance.worldToObject);
+        instance.blasRoot = geometry.blasRoot;
+        instance.geometryIndex = geometryIndex;
+        instance.materialIndex = (int) i;
+
+        if (resized || memcmp(&instance, &instances[i], sizeof(Instance)) != 0)
+        {
+            // World bounds of the instance are those of the transformed corners of its BLAS
+            const LinearBVH_Node& root = blasNodes[geometry.blasRoot];
+            AABB bounds;
+            for (int c = 0; c < 8; ++c)
+            {
+                glm::vec3 corner(
+                    c & 1 ? root.bMax.x : root.bMin.x,
+                    c & 2 ? root.bMax.y : root.bMin.y,
+                    c & 4 ? root.bMax.z : root.bMin.z);
+                bounds = Union(bounds, glm::vec3(instance.objectToWorld * glm::vec4(corner, 1.0f)));
+            }
+            instances[i] = instance;
+            m_InstanceBounds[i] = bounds;
+            rebuild = true;
+        }
+    }
+
+    // Shapes no instance refers to any more pile up while e.g. a radius is being dragged,
+    // a new one every frame. Once they outnumber the ones in use they are dropped, which
+    // keeps the BLAS arrays bounded without building any BLAS again.
+    size_t nUsed = std::count(used.begin(), used.end(), true);
+    bool compacted = geometries.size() > 2 * nUsed + 16;
+    if (compacted)
+        CompactGeometries(used);
+
+    if (rebuild)
+    {
+        tlas.BuildFromBounds(m_InstanceBounds);
+        tlasBuilds++;
+    }
+    if (rebuild || compacted)
+    {
+        leafInstances.resize(tlas.primitivesIndexBuffer.size());
+        for (size_t k = 0; k < leafInstances.size(); ++k)
+            leafInstances[k] = instances[tlas.primitivesIndexBuffer[k]];
+        b_TLASChanged = true;
+    }
+}
+
+void TLAS::Clear()
+{
+    instances.resize(0);
+    geometries.resize(0);
+    leafInstances.resize(0);
+    blasNodes.resize(0);
+    blasGeometry.resize(0);
+    m_InstanceBounds.resize(0);
+    m_GeometryLookup.clear();
+    tlas.Clear();
+    b_TLASChanged = true;
+    b_BLASChanged = true;
+}
+
+int TLAS::FindOrAddGeometry(const Primitive& primitive)
+{
+    GeometryKey key = ShapeKey(primitive);
+    auto found = m_GeometryLookup.find(key);
+    if (found != m_GeometryLookup.end())
+        return found->second;
+
+    // Only the shape is kept, placement and material belong to the instances
+    Primitive shape;
+    shape.type = primitive.type;
+    shape.radius = primitive.radius;
+    shape.dimensions = primitive.dimensions;
+
+    Geometry geometry;
+    geometry.primitives.push_back(shape);
+    BuildBLAS(geometry);
+    geometries.push_back(geometry);
+    m_GeometryLookup[key] = (int) geometries.size() - 1;
+    return (int) geometries.size() - 1;
+}
+
+void TLAS::BuildBLAS(Geometry& geometry)
+{
+    BVH blas(geometry.primitives);
+    int nodeBase = (int) blasNodes.size();
+    int geometryBase = (int) blasGeometry.size();
+    geometry.blasRoot = nodeBase;
+    geometry.blasNodes = blas.totalNodes;
+    geometry.firstPrimitive = geometryBase;
+    geometry.blasPrimitives = (int) blas.primitivesIndexBuffer.size();
+
+    for (int i = 0; i < blas.totalNodes; ++i)
+    {
+        LinearBVH_Node node = blas.flat_root[i];
+        if (node.primitiveCount > 0)
+        {
+            node.primitiveOffset += geometryBase;
+        }
+        else
+        {
+            node.bMin.w += float(nodeBase);
+            node.bMax.w += float(nodeBase);
+            node.secondChildOffset += nodeBase;
+        }
+        blasNodes.push_back(node);
+    }
+    for (int index : blas.primitivesIndexBuffer)
+        blasGeometry.push_back(geometry.primitives[index].Geometry());
+
+    b_BLASChanged = true;
+    blasBuilds++;
+}
+
+void TLAS::CompactGeometries(const std::vector<bool>& used)
+{
+    std::vector<Geometry> kept;
+    std::vector<LinearBVH_Node> nodes;
+    std::vector<PrimitiveGeometry> shapes;
+    std::vector<int> newIndex(geometries.size(), -1);
+    for (size_t g = 0; g < geometries.size(); ++g)
+    {
+        if (!used[g])
+            continue;
+
+        // Shift the BLAS down over the dropped ones, rebasing its links like BuildBLAS does
+        Geometry geometry = geometries[g];
+        int nodeShift = (int) nodes.size() - geometry.blasRoot;
+        int primitiveShift = (int) shapes.size() - geometry.firstPrimitive;
+        for (int i = 0; i < geometry.blasNodes; ++i)
+        {
+            LinearBVH_Node node = blasNodes[geometry.blasRoot + i];
+            if (node.primitiveCount > 0)
+            {
+                node.primitiveOffset += primitiveShift;
+            }
+            else
+            {
+                node.bMin.w += float(nodeShift);
+                node.bMax.w += float(nodeShift);
+                node.secondChildOffset += nodeShift;
+            }
+            nodes.push_back(node);
+        }
+        auto first = blasGeometry.begin() + geometry.firstPrimitive;
+        shapes.insert(shapes.end(), first, first + geometry.blasPrimitives);
+
+        geometry.blasRoot += nodeShift;
+        geometry.firstPrimitive += primitiveShift;
+        newIndex[g] = (int) kept.size();
+        kept.push_back(geometry);
+    }
+
+    for (Instance& instance : instances)
+    {
+        instance.geometryIndex = newIndex[instance.geometryIndex];
+        instance.blasRoot = kept[instance.geometryIndex].blasRoot;
+    }
+    geometries.swap(kept);
+    m_GeometryLookup.clear();
+    for (size_t g = 0; g < geometries.size(); ++g)
+        m_GeometryLookup[ShapeKey(geometries[g].primitives[0])] = (int) g;
+    blasNodes.swap(nodes);
+    blasGeometry.swap(shapes);
+    b_BLASChanged = true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "primitives.h"
+#include "bvh.h"
+#include <vector>
+#include <unordered_map>
+
+// Placement of a shared geometry in the scene. Matches the Instance struct in structs.glsl.
+struct Instance
+{
+    glm::mat4 worldToObject = glm::mat4(1.0f);   // Takes world space rays into the geometry's frame
+    glm::mat4 objectToWorld = glm::mat4(1.0f);   // Takes object space normals back out
+    int blasRoot = 0;        // Root of the geometry's BLAS in blasNodes
+    int geometryIndex = 0;
+    int materialIndex = 0;   // Scene primitive whose material the instance is shaded with, also reported as the hit's primID
+    int pad = 0;             // Rounds the struct up to the 16-byte alignment of its matrices
+};
+
+// Shape shared by every instance placed with it, built around the origin with no rotation
+struct Geometry
+{
+    std::vector<Primitive> primitives;
+    int blasRoot = 0;
+    int blasNodes = 0;
+    int firstPrimitive = 0;  // Offset of the BLAS leaves' primitives in blasGeometry
+    int blasPrimitives = 0;
+};
+
+// Shape a geometry is looked up by. Fields the primitive type does not use are left at zero.
+struct GeometryKey
+{
+    int type = 0;
+    float radius = 0.0f;
+    glm::vec3 dimensions = glm::vec3(0.0f);
+
+    bool operator==(const GeometryKey& other) const
+    {
+        return type == other.type && radius == other.radius && dimensions == other.dimensions;
+    }
+};
+
+struct GeometryKeyHash
+{
+    size_t operator()(const GeometryKey& key) const;
+};
+
+// Two-level acceleration structure over the scene. Primitives with the same shape share one
+// geometry and its bottom-level BVH (BLAS); every primitive becomes an instance that places
+// a geometry with a rigid transform and a material, and the top-level BVH (TLAS) is built
+// over the instances' world bounds.
+class TLAS
+{
+public:
+    TLAS() {};
+
+    // Brings the structure up to date with the scene. A BLAS is only built for a shape seen
+    // for the first time, moving or re-materialing instances rebuilds the TLAS alone.
+    void Update(const std::vector<Primitive>& primitives);
+    void Clear();
+
+public:
+    std::vector<Instance> instances;
+    std::vector<Geometry> geometries;
+    BVH tlas;
+    // Instances in the order the TLAS leaves reference them, which is how the shaders read them
+    std::vector<Instance> leafInstances;
+
+    // Every BLAS flattened into shared arrays, with node links and primitive offsets rebased.
+    // The primitives are stored in leaf order too, so neither level needs an index buffer.
+    std::vector<LinearBVH_Node> blasNodes;
+    std::vector<PrimitiveGeometry> blasGeometry;
+
+    // Set when the corresponding GPU blocks need uploading
+    bool b_TLASChanged = false;
+    bool b_BLASChanged = false;
+    int tlasBuilds = 0;
+    int blasBuilds = 0;
+
+private:
+    int FindOrAddGeometry(const Primitive& primitive);
+    void BuildBLAS(Geometry& geometry);
+    // Drops the geometries no instance uses and moves the remaining BLASes together
+    void CompactGeometries(const std::vector<bool>& used);
+
+    std::vector<AABB> m_InstanceBounds;
+    std::unordered_map<GeometryKey, int, GeometryKeyHash> m_GeometryLookup;   // Shape to index in geometries
+};
@@ -14,4 +14,53 @@ void GenerateAndCreateVAO(std::vector<float> vertices, std::vector<uint32_t> ind
     
     glBindBuffer       (GL_ELEMENT_ARRAY_BUFFER, IBO); 
     glBufferData       (GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * indices.size(), indices.data(), GL_STATIC_DRAW);
-}
\ No newline at end of file
+}
+
+void DirtySet::Add(size_t index)
+{
+    if (index >= m_Flags.size())
+        m_Flags.resize(index + 1, false);
+    if (!m_Flags[index])
+    {
+        m_Flags[index] = true;
+        m_Count++;
+    }
+}
+
+void DirtySet::Add(size_t first, size_t last)
+{
+    for (size_t i = first; i < last; ++i)
+        Add(i);
+}
+
+void DirtySet::Clear()
+{
+    m_Flags.assign(m_Flags.size(), false);
+    m_Count = 0;
+}
+
+std::vector<DirtyRange> DirtySet::Coalesce(size_t maxGap) const
+{
+    std::vector<DirtyRange> ranges;
+    for (size_t i = 0, found = 0; i < m_Flags.size() && found < m_Count; ++i)
+    {
+        if (!m_Flags[i])
+            continue;
+        found++;
+        if (!ranges.empty() && i - size_t(ranges.back().end) <= maxGap)
+            ranges.back().end = int(i + 1);
+        else
+            ranges.push_back({ int(i), int(i + 1) });
+    }
+    return ranges;
+}
+
+void HashBytes(uint64_t* hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        *hash ^= bytes[i];
+        *hash *= 0x100000001b3ull;
+    }
+}
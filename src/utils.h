@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <climits>
 #include <vector>
 #include <glad/glad.h>
 #include <glfw/include/GLFW/glfw3.h>
@@ -9,20 +10,76 @@
 #define PATH_TO_SHADERS std::string("../../src/shaders/")
 #define PROJECT_PATH std::string("../../")
 #define PATH_TO_HDR std::string("../../assets/hdr/")
+#define PATH_TO_BVH_CACHE std::string("../../cache/bvh/")
+#define PATH_TO_SHADER_CACHE std::string("../../cache/shaders/")
 
 //"Jodie-Reinhard\0ACES film\0ACES fitted\0Tony McMapface\0AgX Punchy\0"
 enum { JODIE_REINHARD = 0, ACES_FILM, ACES_FITTED, TONY_MCMAPFACE, AGX_PUNCHY };
 
+//"Binary\0BVH4\0Quantized\0Stackless\0"
+enum { BVH_LAYOUT_BINARY = 0, BVH_LAYOUT_BVH4, BVH_LAYOUT_QUANTIZED, BVH_LAYOUT_STACKLESS };
+
+//"Fragment\0Wavefront (Compute)\0"
+enum { BACKEND_FRAGMENT = 0, BACKEND_WAVEFRONT };
+
 struct ApplicationSettings
 {
     int tonemap = TONY_MCMAPFACE;
     bool enableVsync = false;
     bool enableBVH = false;
+    int bvhLayout = BVH_LAYOUT_BINARY;
+    bool enableInstancing = false;
     bool enableDebugBVHVisualisation = false;
     bool enableGui = true;
     bool enableCrosshair = true;
     bool enableBlueNoise = true;
+    int backend = BACKEND_FRAGMENT;
+};
+
+// Half-open range [begin, end) of array elements that changed since the last upload
+struct DirtyRange
+{
+    int begin = INT_MAX;
+    int end = 0;
+
+    void Add(int index) { Add(index, index + 1); }
+    void Add(int first, int last)
+    {
+        begin = first < begin ? first : begin;
+        end = last > end ? last : end;
+    }
+    bool Empty() const { return begin >= end; }
+    void Clear() { begin = INT_MAX; end = 0; }
+};
+
+// Set of array elements that changed since the last upload. Unlike DirtyRange it keeps edits
+// far apart from each other separate, and hands them out as a few coalesced ranges.
+class DirtySet
+{
+public:
+    void Add(size_t index);
+    void Add(size_t first, size_t last);
+    bool Empty() const { return m_Count == 0; }
+    void Clear();
+
+    // Sorted ranges covering every dirty element. Runs separated by at most maxGap clean
+    // elements are merged, re-uploading a few clean elements is cheaper than another call.
+    std::vector<DirtyRange> Coalesce(size_t maxGap) const;
+
+private:
+    std::vector<bool> m_Flags;
+    size_t m_Count = 0;
 };
 
 void GenerateAndCreateVAO(std::vector<float> vertices, std::vector<uint32_t> indices,
-        uint32_t &VAO, uint32_t &VBO, uint32_t &IBO);
\ No newline at end of file
+        uint32_t &VAO, uint32_t &VBO, uint32_t &IBO);
+
+// 64-bit FNV-1a, folding in _size_ bytes at _data_. Start from HASH_SEED.
+static const uint64_t HASH_SEED = 0xcbf29ce484222325ull;
+void HashBytes(uint64_t* hash, const void* data, size_t size);
+
+template <typename T>
+void HashValue(uint64_t* hash, const T& value)
+{
+    HashBytes(hash, &value, sizeof(T));
+}
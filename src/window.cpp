@@ -1,3 +1,16 @@
+#include <cstdlib>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <csignal>
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #include "window.h"
 
 void WindowResize(GLFWwindow* window, int width, int height);
@@ -49,20 +62,50 @@ void APIENTRY glDebugOutput(GLenum source,
     } std::cout << std::endl;
     std::cout << std::endl;
 
+    // Only actual errors stop in the debugger, everything else is just logged
+    if (type != GL_DEBUG_TYPE_ERROR)
+        return;
+#ifdef _WIN32
     DebugBreak();
+#else
+    raise(SIGTRAP);
+#endif
 }
 
-Window::Window(std::string title, uint32_t width, uint32_t height)
+Window::Window(std::string title, uint32_t width, uint32_t height, bool headless)
     : m_Title(title)
     , m_Width(width)
     , m_Height(height)
+    , m_Headless(headless)
 {
     if (!Window::Init())
         glfwTerminate();
 }
 
+Window::~Window()
+{
+#ifndef _WIN32
+    if (m_EGLDisplay != nullptr)
+    {
+        eglMakeCurrent(m_EGLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(m_EGLDisplay, m_EGLContext);
+        eglTerminate(m_EGLDisplay);
+    }
+#endif
+    glfwTerminate();
+}
+
 bool Window::Init()
 {
+    // Without a display, e.g. on a CI machine, GLFW only provides the null platform and the
+    // context comes from a surfaceless EGL display, which Mesa backs with llvmpipe
+    bool noDisplay = false;
+#ifndef _WIN32
+    noDisplay = m_Headless && getenv("DISPLAY") == nullptr && getenv("WAYLAND_DISPLAY") == nullptr;
+    if (noDisplay)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
+
     if (!glfwInit())
     {
         std::cout << "\033[1;31m[ERROR]\033[1;37m Failed to initialise GLFW" << std::endl;
@@ -71,10 +114,14 @@ bool Window::Init()
 
     // Define version and compatibility settings
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6); 
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5); 
     glfwWindowHint(GLFW_OPENGL_PROFILE,GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true); // comment this line in a release build! 
+    if (m_Headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    if (noDisplay)
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
     m_Window = glfwCreateWindow(m_Width, m_Height, m_Title.c_str(), NULL, NULL);
     if (!m_Window)
@@ -83,6 +130,9 @@ bool Window::Init()
         return false;
     }
 
+    if (noDisplay)
+        return InitSurfaceless() && InitGL();
+
     glfwMakeContextCurrent(m_Window);
     glfwSetFramebufferSizeCallback(m_Window, WindowResize);
     glfwSetCursorPosCallback(m_Window, CursorPosition);
@@ -93,10 +143,54 @@ bool Window::Init()
     // glad: load all OpenGL function pointers
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
-	    std::cout << "\033[1;31m[ERROR]\033[0;37m Failed to load OpenGL extensions" << std::endl;
+        std::cout << "\033[1;31m[ERROR]\033[0;37m Failed to load OpenGL extensions" << std::endl;
+        return false;
+    }
+
+    return InitGL();
+}
+
+bool Window::InitSurfaceless()
+{
+#ifdef _WIN32
+    return false;
+#else
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != nullptr)
+        m_EGLDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+
+    EGLint major, minor;
+    if (m_EGLDisplay == nullptr || !eglInitialize(m_EGLDisplay, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cout << "\033[1;31m[ERROR]\033[0;37m Failed to open a surfaceless EGL display" << std::endl;
         return false;
     }
 
+    const EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 5,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+        EGL_NONE
+    };
+    m_EGLContext = eglCreateContext(m_EGLDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    if (m_EGLContext == EGL_NO_CONTEXT || !eglMakeCurrent(m_EGLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, m_EGLContext))
+    {
+        std::cout << "\033[1;31m[ERROR]\033[0;37m Failed to create an OpenGL 4.5 context" << std::endl;
+        return false;
+    }
+
+    if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+    {
+        std::cout << "\033[1;31m[ERROR]\033[0;37m Failed to load OpenGL extensions" << std::endl;
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool Window::InitGL()
+{
     // enable OpenGL debug context if context allows for debug context
     int flags; glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
     if (flags & GL_CONTEXT_FLAG_DEBUG_BIT)
@@ -137,7 +231,8 @@ void Window::Clear() const
 void Window::Update() const
 {
     glfwPollEvents();
-    glfwSwapBuffers(m_Window);
+    if (m_EGLDisplay == nullptr)
+        glfwSwapBuffers(m_Window);
 }
 
 bool Window::Closed() const
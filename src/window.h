@@ -12,8 +12,9 @@ class Window
 {
 public:
     Window() = default;
-    Window(std::string title, uint32_t width, uint32_t height);
-    ~Window() { glfwTerminate(); }
+    // A headless window is never shown, it only provides the GL context
+    Window(std::string title, uint32_t width, uint32_t height, bool headless = false);
+    ~Window();
     void ProcessInput();
     void Clear() const;
     void Update() const;
@@ -23,9 +24,16 @@ public:
 
 private:
     bool Init();
+    bool InitSurfaceless();
+    bool InitGL();
 
     std::string m_Title;
     uint32_t m_Width;
     uint32_t m_Height;
+    bool m_Headless;
     GLFWwindow* m_Window;
+
+    // Surfaceless context of a headless window without a display, an EGLDisplay and EGLContext
+    void* m_EGLDisplay = nullptr;
+    void* m_EGLContext = nullptr;
 };